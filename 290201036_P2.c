@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,274 +6,8775 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio_ext.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <math.h>
+#include <limits.h>
 
-#define MAX_LINE 100
-#define MAX_ARGS 10
-#define HISTORY_COUNT 10
+#define READ_CHUNK 65536
+#define HISTORY_COUNT 10        // Default number of entries shown by 'history'
+#define HISTORY_MAGIC "SH322HI1"
+#define HISTORY_PREFIX_BUCKETS 65536
+#define HISTORY_HEADER_SIZE sizeof(struct history_header)
+#define TRIGRAM_MAGIC "SH322TR1"
+#define SCRIPT_CACHE_MAGIC "SH322SC1"
+#define TRIGRAM_BUCKETS 65536
+#define TRIGRAM_HEADER_SIZE sizeof(struct trigram_header)
+#define HASH_BUCKETS 64
+#define ARENA_CHUNK 65536
+#define MAX_JOBS 64
+#define PROC_SLOTS 1024
+#define JOB_STAT_STAGES 16    // Processes per job with individual resource statistics
+#define TIME_REPORT_STAGES 64 // Processes per command line kept for 'time'
+#define MAX_COPROCS 16
+#define MEMO_BUCKETS 64
+#define MEMO_BYTES (4 << 20)         // Arena size at which the memo cache is dropped
+#define MEMO_MAX_OUTPUT (1 << 20)    // Larger outputs are passed through but not cached
+#define COPROC_BUFFER 4096
+#define EVENT_TRACE_MS 100    // Trace flush interval while the shell waits for children
+#define EVENT_BATCH 64        // Events taken per epoll_wait
+#define REMOTE_JOBS 32        // Hosts an '@group' command runs on at once by default
+#define REMOTE_PERSIST "10m"  // How long an idle ssh master connection is kept
+#define TRACE_RING 4096       // Events buffered before the trace file is written
+#define AST_CACHE_SLOTS 64    // Parsed command lines kept for re-execution
+#define AST_CACHE_BYTES (1 << 20)
+#define FANOUT_CHUNK (1 << 20)     // Most bytes a fan-out pump moves per tee/splice round
+#define SPAWN_MAX_FDS 64             // Descriptors per spawn server request
+#define SPAWN_MSG_MAX (128 * 1024)   // Bytes of path, argv and envp per spawn server request
+#define VAR_BUCKETS 128
+#define OUT_IOVECS 1024              // Segments per writev (IOV_MAX on Linux)
+#define OUT_TEXT 65536               // Bytes of formatted output gathered before a flush
+#define DIR_CACHE_BUCKETS 64
+#define DIR_CACHE_BYTES (8 << 20)    // Arena size at which the directory cache is dropped
+#define DIR_CACHE_SETTLE 2           // Seconds after its mtime before a listing is trusted
+#define SCRIPT_CACHE_SETTLE 2        // Seconds after its mtime before a script is compiled to disk
+#define SCRIPT_CACHE_DEPTH 4096      // Deepest tree decoded; deeper ones are parsed from the text
+#define COMPLETE_WAIT_MS 50          // Time Tab waits for listings before going on without them
 
-// Array to store command history with fixed size HISTORY_COUNT
-char *history[HISTORY_COUNT];
+extern char **environ;
 
-// Index to track the current position in the history array
-int history_index = 0;
+// Header of the mapped history index file, followed by one history_record per entry
+struct history_header {
+    char magic[8];
+    uint64_t count;          // Number of entries; ids run from 1 to count
+    uint64_t data_size;      // Bytes of the data file covered by the index
+    uint64_t reserved;
+    uint32_t prefix_heads[HISTORY_PREFIX_BUCKETS];  // Newest id per two-byte prefix, 0 = none
+};
 
+// Fixed-size index record of one history entry
+struct history_record {
+    uint64_t offset;         // Start of the command in the data file
+    uint32_t length;         // Length without the trailing newline
+    uint32_t prev_prefix;    // Previous id with the same two-byte prefix, 0 = none
+};
+
+// Header of the mapped trigram index, followed by the posting array
+struct trigram_header {
+    char magic[8];
+    uint64_t postings;       // Number of postings in use
+    uint64_t indexed;        // Highest history id already indexed
+    uint64_t reserved;
+    uint32_t heads[TRIGRAM_BUCKETS];   // Newest posting (1-based) per trigram bucket, 0 = none
+    uint32_t counts[TRIGRAM_BUCKETS];  // Number of postings per bucket, to pick the rarest trigram
+};
+
+// One entry of a trigram bucket's posting list, linked newest first
+struct trigram_posting {
+    uint32_t entry;          // History id containing the trigram
+    uint32_t prev;           // Previous posting of the same bucket, 0 = none
+};
+
+// History is recorded for interactive shells, or when SHELL322_HISTFILE is set
+int history_enabled = 0;
+
+// Number of entries shown by 'history' and kept by the in-memory fallback ring
+int history_window = HISTORY_COUNT;
+
+// In-memory fallback ring used when the history file cannot be opened
+char **history_ring = NULL;
+long history_total = 0;
+
+// Persistent history files and their mappings
+int history_data_fd = -1;
+int history_index_fd = -1;
+struct history_header *history_header = NULL;
+struct history_record *history_records = NULL;
+size_t history_index_len = 0;
+const char *history_data = NULL;
+size_t history_data_len = 0;
+
+// Trigram index file beside the history, used by the incremental reverse search
+int trigram_fd = -1;
+struct trigram_header *trigram_header = NULL;
+struct trigram_posting *trigram_postings = NULL;
+size_t trigram_len = 0;
+
+// Entry of the command-location cache: command name -> absolute path
+struct hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+};
+
+// Hash table of resolved command locations, filled on first lookup
+struct hash_entry *command_hash[HASH_BUCKETS];
+
+// Lifecycle of a job slot
+enum job_state {
+    JOB_FREE,
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+};
+
+// Resource usage of one process, filled by wait4 in the SIGCHLD handler
+struct stage_stats {
+    pid_t pid;
+    int status;
+    struct timespec start;   // CLOCK_MONOTONIC at spawn
+    struct timespec end;     // CLOCK_MONOTONIC when reaped
+    struct rusage usage;
+    char name[32];
+};
+
+// A job is every process started for one command (a single command or a whole pipeline).
+// Fields updated by the SIGCHLD handler are volatile; main only changes them with SIGCHLD blocked.
+struct job {
+    volatile sig_atomic_t state;
+    volatile sig_atomic_t live;      // Processes that have not exited yet
+    volatile sig_atomic_t stopped;   // Live processes that are currently stopped
+    volatile int status;             // Wait status of the last process of the job
+    int background;                  // Completion is reported asynchronously
+    int collected;                   // Started by a builtin (e.g. par) that collects it itself
+    int nprocs;
+    pid_t pgid;                      // Process group with job control, otherwise 0
+    pid_t last_pid;
+    unsigned long seq;               // Start order, used to find the current job
+    char command[128];               // Command text, fixed size so the handler never frees it
+    int nstats;                      // Entries used in stats
+    struct stage_stats stats[JOB_STAT_STAGES];  // Per-process usage, in spawn order
+};
+
+// Process table entry mapping a child pid to its job (pid 0 = empty, -1 = deleted)
+struct proc_slot {
+    volatile pid_t pid;
+    int job;
+    int stopped;
+    int stage;               // Index into the job's stats, or -1 if not tracked individually
+};
+
+// Job table, its O(1) free list, and the pid -> job hash table used by the SIGCHLD handler
+struct job jobs[MAX_JOBS];
+int job_free_list[MAX_JOBS];
+volatile int job_free_top = 0;
+struct proc_slot procs[PROC_SLOTS];
+unsigned long job_seq = 0;
+
+// Descriptor setup of a child about to be spawned: dup2 operations applied in order, where a
+// source is a descriptor number as the child sees it at that point (as with posix_spawn)
+struct spawn_fds {
+    int count;
+    int cap;
+    int (*dup)[2];   // dup[i][0] = source, dup[i][1] = target
+};
+
+// Request sent to the spawn server; path, argv and envp strings follow it in the same message
+struct spawn_request {
+    pid_t pgid;                   // Group to join if setpgroup (0 = new group led by the child)
+    int setpgroup;
+    int take_tty;                 // Hand the terminal to the new group before exec
+    sigset_t mask;                // Signal mask of the child
+    mode_t umask;                 // The shell's file creation mask
+    int nfds;                     // Descriptors passed with SCM_RIGHTS, in order, then the cwd
+    int fd_numbers[SPAWN_MAX_FDS];  // Their numbers in the shell, recreated in the child
+    int ndups;
+    int dups[SPAWN_MAX_FDS][2];
+    int argc;
+    int envc;
+};
+
+// Answer of the spawn server: the child's pid, or the errno of a failed exec
+struct spawn_reply {
+    pid_t pid;
+    int err;
+};
+
+// Spawn server ('set -o spawnserver'): socket to it and its pid, -1 when it is not running
+int spawn_server_fd = -1;
+pid_t spawn_server_pid = -1;
+
+// Shell variable; entry holds 'NAME=value', so exported variables go into envp as they are
+struct var {
+    unsigned int hash;
+    size_t name_len;
+    char *entry;
+    int exported;
+    struct var *next;
+};
+
+// Shell variables, starting with the environment the shell was given
+struct var *var_table[VAR_BUCKETS];
+
+// envp of children: the exported entries, shared by every spawn until an exported variable
+// changes (env_dirty), and only then rebuilt
+char **env_snapshot = NULL;
+int env_dirty = 1;
+
+// Prefix assignments ('A=1 cmd') of the command being started, layered over the variables
+char **env_overlay = NULL;
+
+// Positional parameters: $0, then shell_nargs parameters $1...
+char **shell_args = NULL;
+int shell_nargs = 0;
+
+// Values of $$ and $!
+pid_t shell_pid = 0;
+pid_t last_background_pid = 0;
+
+// Entry of the builtin dispatch table (builtins[], after the handlers); a utility entry
+// stands in for a program from PATH and is skipped under 'set -o posix'
+struct builtin {
+    const char *name;
+    int (*fn)(char **args);
+    int utility;
+};
+
+// Descriptor event_wait watches: its signalfd, a coprocess's output pipe, or a stream of a
+// waiting builtin ('par -t' output); ready is called when fd is readable or hung up
+struct event_source {
+    int fd;
+    void (*ready)(struct event_source *src);
+    void *arg;
+};
+
+// Long-lived child started by 'coproc', talked to over a pair of pipes
+struct coproc {
+    char name[32];          // Empty if the slot is unused
+    int job;                // Background job running it
+    unsigned long seq;      // Job sequence number, to notice the slot was reused
+    int to_fd;              // Write end of the coprocess's stdin, -1 once closed
+    int from_fd;            // Read end of the coprocess's stdout
+    char buf[COPROC_BUFFER];  // Bytes read from from_fd but not yet returned as lines
+    size_t buf_len;
+    int at_eof;             // from_fd reached EOF while 'coproc -r' waited on it
+    struct event_source source;  // from_fd in the event loop, while 'coproc -r' waits on it
+};
+
+struct coproc coprocs[MAX_COPROCS];
+
+// Output pipe of a 'par -t' job, passed on line by line with the job's label in front
+struct par_stream {
+    struct event_source source;   // source.fd is the read end, -1 once closed
+    const char *label;
+    int to_fd;                    // STDOUT_FILENO or STDERR_FILENO
+    char *buf;                    // Start of a line that has not ended yet
+    size_t len;
+    size_t cap;
+};
+
+// Per-process statistics of every foreground job of a command line, reported by 'time'
+struct time_report {
+    int count;
+    struct stage_stats stages[TIME_REPORT_STAGES];
+};
+
+// Report being collected for the current line, and the one of the previous line
+struct time_report time_current;
+struct time_report time_previous;
+
+// Settings of a 'limit' prefix, parsed with the command line
+struct job_limits {
+    long cpu_milli;   // --cpu: CPU bandwidth in thousandths of a CPU, 0 for none
+    long mem;         // --mem: bytes of memory, 0 for none
+    int nice;         // --nice: added to the nice value of each process
+    int set_nice;
+    cpu_set_t cpus;   // --cpus: CPUs the processes may run on
+    int set_cpus;
+};
+
+// A 'limit' being applied: every process started while it is active gets it between fork and
+// exec (spawn_limited, fork_child_setup), by joining its cgroup or through rlimits and affinity
+struct limit_state {
+    const struct job_limits *limits;
+    char cgroup[PATH_MAX];      // Transient cgroup v2 directory, '' if none could be made
+    int procs_fd;               // Its cgroup.procs, written by each child to join it
+    cpu_set_t cpus;             // Affinity to apply: --cpus, or --cpu N CPUs without a cgroup
+    int set_cpus;
+    int first_stage;            // time_current entries from this index on ran under the limit
+    struct limit_state *outer;  // Limit active before this one
+};
+struct limit_state *active_limit = NULL;
+
+// Transient cgroups whose processes were still running (background jobs) when their limit
+// ended; removed by limit_cleanup once they are empty
+struct limit_leftover {
+    char *path;
+    struct limit_leftover *next;
+};
+struct limit_leftover *limit_leftovers = NULL;
+
+// Set by job_free (also in the SIGCHLD handler) while there are leftovers: a job that ended may
+// have emptied one, so limit_cleanup runs at the next safe point (event loop, next command)
+volatile sig_atomic_t limit_cleanup_due = 0;
+
+// Kinds of trace events
+enum trace_type {
+    TRACE_READ_LINE,
+    TRACE_PARSE,
+    TRACE_BUILTIN,
+    TRACE_SPAWN,      // posix_spawn call, ends when the child has exec'd
+    TRACE_WAIT,       // Foreground wait for a job
+    TRACE_CHILD,      // Child lifetime from spawn to reap, recorded by the SIGCHLD handler
+    TRACE_LINE,
+    TRACE_PIPELINE,
+    TRACE_AND
+};
+
+// One slot of the trace ring buffer; seq publishes the slot to the reader
+struct trace_event {
+    volatile uint64_t seq;
+    uint64_t start;
+    uint64_t end;
+    int type;
+    int tid;
+    int arg;
+    char name[28];
+};
+
+// Trace output (SHELL322_TRACE) and its lock-free ring buffer
+int trace_fd = -1;
+int trace_json_lines = 0;
+struct trace_event *trace_ring = NULL;
+uint64_t trace_write = 0;     // Next slot to claim (producers: main and the SIGCHLD handler)
+uint64_t trace_read = 0;      // Next slot to flush (consumer: main)
+uint64_t trace_dropped = 0;
+uint64_t trace_epoch = 0;
+
+// Text of the command line being executed; jobs are labeled with their part of it (job_label)
+const char *current_command = "";
+
+// Exit status of the last command line, and whether the 'exit' builtin ran
+int last_status = 0;
+int exit_requested = 0;
+
+// Shell options changed with 'set -o'; a pipe size of 0 keeps the kernel's default capacity
+long opt_pipe_size = 0;
+int opt_pipe_direct = 0;
+int opt_posix = 0;       // Run echo, printf, test, true, false and cat from PATH
+long pipe_max_size = 0;  // /proc/sys/fs/pipe-max-size, read on first use
+
+// Placement of pipeline stages ('set -o pipeplace=...'): off, on CPUs sharing a last-level
+// cache, or on CPUs of one NUMA node
+enum pipe_place {
+    PLACE_OFF,
+    PLACE_CACHE,
+    PLACE_NODE
+};
+int opt_pipe_place = PLACE_OFF;
+
+// CPU groups stages are placed on, read from /sys/devices/system/cpu when placement is first used
+struct cpu_topology {
+    int loaded;
+    cpu_set_t *cache;  // CPUs sharing a last-level cache
+    int ncache;
+    cpu_set_t *node;   // CPUs of a NUMA node
+    int nnode;
+};
+struct cpu_topology topology;
+
+// Placement of the pipeline being started (place_begin / place_stage / place_end)
+struct stage_placement {
+    int active;
+    int group;                // Group the next stage goes to
+    int used;                 // Stages already put on that group
+    unsigned int next_start;  // Group the next pipeline starts on
+    cpu_set_t saved;          // Affinity of the shell before the pipeline
+};
+struct stage_placement placement;
+
+// Pipeline pipe ends the shell holds while it starts stages (make_pipe / close_pipe); a forked
+// builtin stage closes all of them, as an exec'd stage does through O_CLOEXEC
+int *stage_pipe_fds = NULL;
+int stage_pipe_count = 0;
+int stage_pipe_cap = 0;
+
+// One block of arena memory; allocations are bumped out of data[]
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+// Bump allocator for per-command state, released all at once by arena_reset
+struct arena {
+    struct arena_chunk *head;  // Chunk currently allocated from; older chunks follow
+    size_t total;              // Bytes requested since the last reset (high-water mark)
+};
+
+// Arena holding everything built for the current command line; reset after each line
+struct arena line_arena;
+
+// Kinds of tokens produced by the tokenizer
+enum token_type {
+    TOK_WORD,   // A word after quote and escape removal
+    TOK_PIPE,   // '|'
+    TOK_AND,    // '&&'
+    TOK_OR,     // '||'
+    TOK_BG,     // '&'
+    TOK_SEMI,   // ';'
+    TOK_REDIR   // '<', '>', '>>', '<&' or '>&', with an optional fd number in front ('2>')
+};
+
+// Flags of a word token
+enum token_flags {
+    TOKEN_RAW = 1,    // Has '$' expansions or glob characters: kept with its quotes for expand_command
+    TOKEN_ASSIGN = 2  // Starts with an unquoted NAME=
+};
+
+// A token is a span (offset, length) into the line it was scanned from
+struct token {
+    enum token_type type;
+    int flags;
+    size_t offset;
+    size_t length;
+    size_t end;      // Offset just past the token as written (length shrinks when quotes are removed)
+};
+
+// Growable token array filled by parse_input
+struct token_list {
+    struct arena *arena;  // Arena the items array lives in
+    struct token *items;
+    int count;
+    int cap;
+};
+
+// Kinds of nodes in the command tree built by parse_line
+enum node_type {
+    NODE_COMMAND,     // Simple command: argv
+    NODE_PIPELINE,    // stages[0] | stages[1] | ..., the last one may be a NODE_FANOUT
+    NODE_AND,         // left && right
+    NODE_OR,          // left || right
+    NODE_SEQUENCE,    // left ; right
+    NODE_BACKGROUND,  // left &
+    NODE_TIME,        // time left; a bare 'time' has no left
+    NODE_LIMIT,       // limit OPTIONS left: left runs under the resource limits in limits
+    NODE_FANOUT       // Last pipeline stage '{ a , b }': stages[] each get a copy of the input
+};
+
+// Kinds of redirections of a simple command
+enum redirect_type {
+    REDIR_IN,      // fd < file
+    REDIR_OUT,     // fd > file
+    REDIR_APPEND,  // fd >> file
+    REDIR_DUP      // fd >& n or fd <& n
+};
+
+// One redirection; a command's redirections are applied in the order written
+struct redirect {
+    enum redirect_type type;
+    int fd;          // Descriptor being redirected
+    char *target;    // File name, or the descriptor number for REDIR_DUP
+    int raw;         // target still has quotes and '$' expansions
+};
+
+// Node of a parsed command line; the whole tree lives in one arena
+struct node {
+    enum node_type type;
+    char **argv;           // NODE_COMMAND: NULL-terminated words
+    char **assigns;        // NODE_COMMAND: leading NAME=value words, NULL-terminated
+    int nassigns;
+    unsigned char *raw;    // NODE_COMMAND: per argv word, then per assignment, 1 if it still has
+                           // quotes and '$' expansions; NULL if nothing in the command has
+    struct redirect *redirects;  // NODE_COMMAND: redirections in order
+    int nredirects;
+    struct node **stages;  // NODE_PIPELINE: one NODE_COMMAND per stage; NODE_FANOUT: the branches
+    int count;             // Number of words (NODE_COMMAND), stages or branches
+    long pipe_size;        // NODE_PIPELINE: capacity from a 'pipesize N' prefix, 0 if none
+    struct job_limits *limits;  // NODE_LIMIT: the parsed options
+    struct node *left;
+    struct node *right;
+    size_t text_start;     // Span of the node in the line as written, used to label its job;
+    size_t text_len;       // 0 if unknown
+};
+
+// Recursive-descent parser state over one token list
+struct parser {
+    char *line;
+    struct token_list *tokens;
+    int pos;               // Next token to consume
+    struct arena *arena;   // Arena the tree is built in
+    int fanout_depth;      // Inside '{ ... }', where ',' and '}' end a command
+};
+
+// Parsed lines kept by text, so history re-execution ('!!', '!n', 'history -i') skips parsing
+struct ast_cache_entry {
+    unsigned int hash;
+    char *text;
+    struct node *root;
+};
+
+// Command tree cache; its arena is dropped as a whole once it grows past AST_CACHE_BYTES
+struct ast_cache_entry ast_cache[AST_CACHE_SLOTS];
+struct arena ast_arena;
+
+// Nesting depth of run_line ('history -i' runs the accepted line from inside a builtin)
+int line_depth = 0;
+
+// Result of a command run through 'memo', replayed while its key matches and it is still valid
+struct memo_entry {
+    unsigned int hash;
+    char *key;                // cwd, argv and the selected environment, 0x1f separated
+    char *output;             // Captured stdout
+    size_t output_len;
+    int status;
+    struct timespec created;  // CLOCK_MONOTONIC
+    long ttl;                 // Seconds the result stays valid, 0 for no limit
+    int nfiles;               // Files whose change (mtime or size) invalidates the result
+    char **files;
+    struct stat *file_stats;
+    struct memo_entry *next;
+};
+
+// Memo cache; entries and their output live in memo_arena, which is dropped as a whole when full
+struct memo_entry *memo_table[MEMO_BUCKETS];
+struct arena memo_arena;
+
+// Entries of a directory as read for pathname expansion, reused while the directory's inode
+// and mtime stay the same
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int settled;           // Listed DIR_CACHE_SETTLE seconds or more after mtime, so reusable
+    int count;
+    char **names;          // Without '.' and '..', in readdir order
+    unsigned char *types;  // d_type of each name
+    struct dir_listing *next;
+};
+
+// Directory cache; listings live in dir_arena, which is dropped as a whole when full. The
+// completion thread reads directories too, so both are only changed under dir_cache_lock.
+struct dir_listing *dir_cache[DIR_CACHE_BUCKETS];
+struct arena dir_arena;
+pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Output of builtins and of the shell itself: formatted text is gathered in text[], bytes that
+// stay in memory until the flush are referenced in place, and out_flush writes it all at once
+struct out_buffer {
+    struct iovec iov[OUT_IOVECS];
+    int count;
+    size_t text_len;
+    char text[OUT_TEXT];
+};
+struct out_buffer out;
+
+// Source of command lines: a memory-mapped script, a '-c' string, or a descriptor read in chunks
+struct line_reader {
+    int fd;             // Descriptor to read more chunks from, or -1 if all input is in memory
+    const char *data;   // Current input bytes (mapping, string or chunk buffer)
+    size_t len;         // Number of valid bytes in data
+    size_t pos;         // Offset of the next unread byte in data
+    void *map;          // Mapping of a regular script file, if any
+    char *chunk;        // Owned chunk buffer for descriptor input
+    char *line;         // Growable buffer holding the current line
+    size_t line_len;
+    size_t line_cap;
+};
+
+// Identity of a script file and of the shell binary that compiled it; a cached script is used
+// only while all of it is unchanged (a rebuilt shell may parse differently)
+struct script_cache_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t shell_size;
+    int64_t shell_mtime_sec;
+    int64_t shell_mtime_nsec;
+};
+
+// Start of a compiled script file; everything after it is addressed by file offsets
+struct script_cache_header {
+    char magic[8];                 // SCRIPT_CACHE_MAGIC
+    uint64_t file_size;            // Bytes in the whole file, so a truncated one is rejected
+    struct script_cache_key key;
+    uint32_t path;                 // Absolute path of the script
+    uint32_t lines;                // nlines uint32_t offsets of line records, in script order
+    uint32_t nlines;
+    uint32_t reserved;
+};
+
+// A line record is the line as written (NUL-terminated; blank and comment lines are left out),
+// a byte that is 1 if a tree follows (0 if the line did not parse and is parsed again when
+// reached), then the tree in preorder. Each node is:
+//   type byte, SCRIPT_* field bits byte, count (varint), text start and length (varints),
+//   argv: count strings; assigns: nassigns (varint) and its strings; raw: count + nassigns bytes;
+//   redirects: n (varint), then per redirection: type byte, fd (varint), raw byte, target string;
+//   NODE_PIPELINE: pipe_size (varint); limits: a struct job_limits;
+//   stages: count nodes; left: a node; right: a node.
+// Strings are NUL-terminated in place and varints are LEB128, so decoding is one forward pass.
+enum script_field {
+    SCRIPT_ARGV = 1 << 0,
+    SCRIPT_ASSIGNS = 1 << 1,
+    SCRIPT_RAW = 1 << 2,
+    SCRIPT_REDIRECTS = 1 << 3,
+    SCRIPT_STAGES = 1 << 4,
+    SCRIPT_LIMITS = 1 << 5,
+    SCRIPT_LEFT = 1 << 6,
+    SCRIPT_RIGHT = 1 << 7
+};
+
+// Compiled form of the script being run: its cache file mapped copy-on-write, or the buffer
+// it was just compiled into
+struct script_cache {
+    char *data;
+    size_t size;
+    int mapped;
+    const uint32_t *lines;
+    uint32_t nlines;
+    uint32_t next;     // Next line to run
+};
+
+// Position of script_decode in a compiled script
+struct script_decoder {
+    const struct script_cache *c;
+    size_t pos;
+    int bad;           // A read went past the end or the tree is implausibly deep
+    int depth;
+};
+
+// Compiled script being built: a growing buffer laid out exactly like the cache file
+struct script_writer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;            // Out of memory or past 4 GiB; the result is thrown away
+};
+
+// State of the interactive line editor; buf keeps its capacity from one line to the next
+struct line_editor {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;                  // Cursor offset into buf
+    const char *prompt;
+    long hist_id;                // History entry shown, history_count() + 1 for the new line
+    char *typed;                 // Line being typed before Up, also the prefix Up/Down match
+    size_t typed_len;
+    unsigned long edits;         // Changes to the line; a completion for an older state is dropped
+    unsigned long pending;       // Completion request still being listed by the thread, 0 if none
+    unsigned long pending_edits;
+    int pending_show;            // Pending completion should list the candidates
+    int last_was_tab;
+};
+
+// Request to the completion thread: the directories to list for the word being completed.
+// The thread fills the cache through dir_read and hands back pointers to the listings.
+struct completion_job {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned long seq;              // Latest request
+    unsigned long taken;            // Latest request the thread has picked up
+    unsigned long done;             // Request whose listings are in listings[]
+    char **dirs;                    // One malloc block: pointers, then the strings
+    int ndirs;
+    struct dir_listing **listings;  // NULL for a directory that could not be read
+    int nlistings;
+    int notify[2];                  // The thread writes a byte here when a request is done
+    int started;
+};
+struct completion_job completer = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, 0, NULL, 0, { -1, -1 }, 0
+};
+
+
+void *arena_alloc(struct arena *a, size_t n) {
+    /*
+        - Returns n bytes of 16-byte aligned memory from the arena.
+        - Bumps a pointer inside the current chunk; only when it is full is a new chunk
+          (at least twice the previous size) taken from malloc.
+        - Memory is never freed individually, only by arena_reset or arena_free.
+    */
+    n = (n + 15) & ~(size_t)15;
+    a->total += n;
+
+    struct arena_chunk *c = a->head;
+    if (!c || c->used + n > c->size) {
+        size_t size = c ? c->size * 2 : ARENA_CHUNK;
+        while (size < n) size *= 2;
+        c = malloc(sizeof(*c) + size);
+        if (!c) {
+            perror("arena");
+            exit(EXIT_FAILURE);
+        }
+        c->size = size;
+        c->used = 0;
+        c->next = a->head;
+        a->head = c;
+    }
+
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+void *arena_grow(struct arena *a, void *p, size_t old_size, size_t new_size) {
+    /*
+        - Resizes an arena allocation to new_size bytes, like realloc.
+        - If p is the most recent allocation and its chunk has room, it grows in place;
+          otherwise a new block is allocated and the old contents are copied.
+    */
+    struct arena_chunk *c = a->head;
+    size_t old_aligned = (old_size + 15) & ~(size_t)15;
+    size_t new_aligned = (new_size + 15) & ~(size_t)15;
+    if (p && c && (char *)p + old_aligned == c->data + c->used &&
+        c->used - old_aligned + new_aligned <= c->size) {
+        c->used = c->used - old_aligned + new_aligned;
+        a->total += new_aligned - old_aligned;
+        return p;
+    }
+
+    void *q = arena_alloc(a, new_size);
+    if (p) memcpy(q, p, old_size);
+    return q;
+}
+
+char *arena_strndup(struct arena *a, const char *str, size_t n) {
+    /*
+        - Copies n bytes of str into the arena and NUL-terminates the copy.
+    */
+    char *copy = arena_alloc(a, n + 1);
+    memcpy(copy, str, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+void arena_free(struct arena *a) {
+    /*
+        - Returns every chunk of the arena to malloc.
+    */
+    struct arena_chunk *c = a->head;
+    while (c) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+    a->total = 0;
+}
+
+void arena_reset(struct arena *a) {
+    /*
+        - Releases everything allocated from the arena at once.
+        - If the last command needed more than one chunk, the chunks are replaced by a single
+          chunk big enough for all of it, so the next line of similar size does no malloc at all.
+    */
+    if (a->head && a->head->next) {
+        size_t size = a->head->size;
+        while (size < a->total) size *= 2;
+        arena_free(a);
+        struct arena_chunk *c = malloc(sizeof(*c) + size);
+        if (!c) return;  // Next allocation will retry
+        c->size = size;
+        c->used = 0;
+        c->next = NULL;
+        a->head = c;
+    } else if (a->head) {
+        a->head->used = 0;
+    }
+    a->total = 0;
+}
+
+int out_write_segments() {
+    /*
+        - Writes every queued segment with writev, resuming after partial writes, and empties
+          the buffer even if the write fails.
+        - Returns 0, or -1 with errno set.
+    */
+    struct iovec *iov = out.iov;
+    int count = out.count, result = 0;
+    while (count > 0) {
+        ssize_t n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) n -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    out.count = 0;
+    out.text_len = 0;
+    return result;
+}
+
+int out_flush() {
+    /*
+        - Writes the queued output, then anything written through stdio after it (the utility
+          builtins print with stdio).
+        - Called after every builtin and command line, before every fork and before anything
+          writes to the stdout descriptor directly or moves it.
+        - Returns 0, or -1 if a write failed.
+    */
+    int result = out.count ? out_write_segments() : 0;
+    if (fflush(stdout) != 0) result = -1;
+    return result;
+}
+
+void out_commit(size_t len) {
+    /*
+        - Queues the len bytes just placed at the end of the text buffer, extending the last
+          segment when it ends there. The caller makes sure a segment slot is free.
+    */
+    char *start = out.text + out.text_len;
+    struct iovec *last = out.count ? &out.iov[out.count - 1] : NULL;
+    if (last && (char *)last->iov_base + last->iov_len == start) {
+        last->iov_len += len;
+    } else {
+        out.iov[out.count++] = (struct iovec){ start, len };
+    }
+    out.text_len += len;
+}
+
+void out_prepare(size_t len) {
+    /*
+        - Makes room for a segment of len bytes of text. Output still pending in stdio is
+          older than anything queued now, so it is written first.
+    */
+    if (__fpending(stdout)) out_flush();
+    if (out.count == OUT_IOVECS || len > OUT_TEXT - out.text_len) out_write_segments();
+}
+
+void out_ref(const void *data, size_t len) {
+    /*
+        - Queues len bytes at data without copying them; they must stay unchanged until the
+          next flush (history entries in the mapping, cached memo output).
+    */
+    out_prepare(0);
+    out.iov[out.count++] = (struct iovec){ (void *)data, len };
+}
+
+void out_write(const void *data, size_t len) {
+    /*
+        - Queues a copy of len bytes at data; data larger than the text buffer is written at once.
+    */
+    if (len > OUT_TEXT) {
+        out_ref(data, len);
+        out_write_segments();
+        return;
+    }
+    out_prepare(len);
+    memcpy(out.text + out.text_len, data, len);
+    out_commit(len);
+}
+
+void out_printf(const char *format, ...) {
+    /*
+        - printf into the output buffer; the text is formatted in place.
+    */
+    va_list ap;
+    out_prepare(0);
+    va_start(ap, format);
+    int n = vsnprintf(out.text + out.text_len, OUT_TEXT - out.text_len, format, ap);
+    va_end(ap);
+    if (n < 0) return;
+
+    if ((size_t)n >= OUT_TEXT - out.text_len) {
+        // Did not fit in what was left: format it again into an empty buffer, or the heap
+        out_write_segments();
+        va_start(ap, format);
+        if ((size_t)n < OUT_TEXT) {
+            vsnprintf(out.text, OUT_TEXT, format, ap);
+        } else {
+            char *text;
+            if (vasprintf(&text, format, ap) >= 0) {
+                out_write(text, n);
+                free(text);
+            }
+            n = 0;
+        }
+        va_end(ap);
+        if (n == 0) return;
+    }
+    out_commit(n);
+}
+
+void history_ring_add(const char *cmd, size_t len) {
+    /*
+        - In-memory fallback used when the history file cannot be opened.
+        - Duplicates the command into a circular buffer of history_window entries,
+          freeing the entry it overwrites.
+    */
+    if (!history_ring) history_ring = calloc(history_window, sizeof(char *));
+    int idx = history_total % history_window;
+    free(history_ring[idx]);
+    history_ring[idx] = strndup(cmd, len);
+    history_total++;
+}
+
+unsigned int history_prefix_key(const char *cmd, size_t len) {
+    /*
+        - Bucket of the prefix index: the first two bytes of a command.
+    */
+    unsigned int c0 = len > 0 ? (unsigned char)cmd[0] : 0;
+    unsigned int c1 = len > 1 ? (unsigned char)cmd[1] : 0;
+    return (c0 << 8) | c1;
+}
+
+int history_remap(int need_records, size_t need_data) {
+    /*
+        - Makes sure the index mapping covers need_records records and the data mapping covers
+          need_data bytes, growing the index file and the mappings geometrically with mremap.
+        - Another shell may have appended to the same files, so this is checked before each use.
+        - Returns 0 on success, -1 if the files could not be grown or remapped.
+    */
+    size_t index_need = HISTORY_HEADER_SIZE + (size_t)need_records * sizeof(struct history_record);
+    if (index_need > history_index_len) {
+        size_t len = history_index_len;
+        while (len < index_need) len *= 2;
+
+        struct stat st;
+        if (fstat(history_index_fd, &st) < 0) return -1;
+        if ((size_t)st.st_size < len && ftruncate(history_index_fd, len) < 0) return -1;
+
+        void *map = mremap(history_header, history_index_len, len, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) return -1;
+        history_header = map;
+        history_records = (struct history_record *)((char *)map + HISTORY_HEADER_SIZE);
+        history_index_len = len;
+    }
+
+    if (need_data > history_data_len) {
+        // The data mapping may extend past EOF; only bytes below data_size are ever read
+        size_t len = history_data_len;
+        while (len < need_data) len *= 2;
+        void *map = mremap((void *)history_data, history_data_len, len, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) return -1;
+        history_data = map;
+        history_data_len = len;
+    }
+    return 0;
+}
+
+void history_index_entry(const char *cmd, size_t len, uint64_t offset) {
+    /*
+        - Appends one record to the mapped index and links it into its prefix chain.
+        - The caller holds the file lock and has made room with history_remap.
+    */
+    uint64_t id = history_header->count + 1;
+    unsigned int key = history_prefix_key(cmd, len);
+    struct history_record *rec = &history_records[id - 1];
+    rec->offset = offset;
+    rec->length = len;
+    rec->prev_prefix = history_header->prefix_heads[key];
+    history_header->prefix_heads[key] = (uint32_t)id;
+    history_header->count = id;  // Published last, so readers never see a half-written record
+}
+
+void history_rebuild_index() {
+    /*
+        - Rebuilds the offset index by scanning the data file once.
+        - Only needed when the index file is missing or does not match the data file.
+    */
+    struct stat st;
+    if (fstat(history_data_fd, &st) < 0) return;
+
+    memset(history_header, 0, HISTORY_HEADER_SIZE);
+    memcpy(history_header->magic, HISTORY_MAGIC, sizeof(history_header->magic));
+    if (history_remap(0, st.st_size) < 0) return;
+
+    size_t pos = 0;
+    while (pos < (size_t)st.st_size) {
+        const char *start = history_data + pos;
+        const char *nl = memchr(start, '\n', st.st_size - pos);
+        size_t len = nl ? (size_t)(nl - start) : st.st_size - pos;
+        if (history_remap(history_header->count + 1, 0) < 0) return;
+        history_index_entry(start, len, pos);
+        pos += len + 1;
+    }
+    history_header->data_size = st.st_size;
+}
+
+long history_count() {
+    /*
+        - Returns the number of stored history entries; entry ids run from 1 to this value.
+    */
+    if (!history_header) return history_total;
+    return history_header->count;
+}
+
+const char *history_get(long id, size_t *len) {
+    /*
+        - Returns entry id (1-based) and its length, or NULL if it is not available.
+        - With a history file this is one index lookup into the mapping; the text is not
+          NUL-terminated. Ring entries are available only for the last history_window ids.
+    */
+    if (id < 1 || id > history_count()) return NULL;
+
+    if (!history_header) {
+        if (id <= history_total - history_window) return NULL;  // Overwritten
+        const char *entry = history_ring[(id - 1) % history_window];
+        *len = strlen(entry);
+        return entry;
+    }
+
+    if (history_remap(id, 0) < 0) return NULL;
+    struct history_record *rec = &history_records[id - 1];
+    if (rec->offset + rec->length > history_data_len &&
+        history_remap(0, rec->offset + rec->length) < 0) {
+        return NULL;
+    }
+    *len = rec->length;
+    return history_data + rec->offset;
+}
+
+unsigned int trigram_bucket(const char *p) {
+    /*
+        - Hashes the three bytes at p to a bucket of the trigram index.
+    */
+    uint32_t t = ((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) |
+                 (unsigned char)p[2];
+    return (t * 2654435761u) >> (32 - 16);
+}
+
+int trigram_reserve(uint64_t postings) {
+    /*
+        - Makes sure the trigram mapping has room for the given number of postings,
+          growing the file and the mapping geometrically. Returns 0 on success, -1 on failure.
+    */
+    size_t need = TRIGRAM_HEADER_SIZE + postings * sizeof(struct trigram_posting);
+    if (need <= trigram_len) return 0;
+
+    size_t len = trigram_len;
+    while (len < need) len *= 2;
+
+    struct stat st;
+    if (fstat(trigram_fd, &st) < 0) return -1;
+    if ((size_t)st.st_size < len && ftruncate(trigram_fd, len) < 0) return -1;
+
+    void *map = mremap(trigram_header, trigram_len, len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) return -1;
+    trigram_header = map;
+    trigram_postings = (struct trigram_posting *)((char *)map + TRIGRAM_HEADER_SIZE);
+    trigram_len = len;
+    return 0;
+}
+
+int trigram_add(uint32_t id, const char *cmd, size_t len) {
+    /*
+        - Adds history entry id to the posting list of every distinct trigram bucket in cmd.
+        - Postings are appended and linked newest-first from the bucket head, so each
+          add costs O(length of the command). The caller holds the history file lock.
+        - Only the entry right after the last indexed one is taken, and 'indexed' moves only
+          once its postings are written, so a failed reserve leaves the index stale (search
+          then scans) instead of leaving a gap; trigram_open catches up later.
+        - Returns 0, or -1 if the entry was not indexed.
+    */
+    if (!trigram_header || id != trigram_header->indexed + 1) return -1;
+    if (len < 3) {
+        trigram_header->indexed = id;
+        return 0;
+    }
+
+    // Collect the distinct buckets of this command (commands are short; a small sort is enough)
+    size_t n = len - 2;
+    unsigned int local[256];
+    unsigned int *buckets = n <= 256 ? local : malloc(n * sizeof(unsigned int));
+    if (!buckets) return -1;
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned int b = trigram_bucket(cmd + i);
+        size_t k = distinct;
+        while (k > 0 && buckets[k - 1] > b) k--;
+        if (k > 0 && buckets[k - 1] == b) continue;
+        memmove(&buckets[k + 1], &buckets[k], (distinct - k) * sizeof(unsigned int));
+        buckets[k] = b;
+        distinct++;
+    }
+
+    int status = trigram_reserve(trigram_header->postings + distinct);
+    if (status == 0) {
+        for (size_t i = 0; i < distinct; i++) {
+            uint32_t pos = (uint32_t)++trigram_header->postings;
+            trigram_postings[pos - 1].entry = id;
+            trigram_postings[pos - 1].prev = trigram_header->heads[buckets[i]];
+            trigram_header->heads[buckets[i]] = pos;
+            trigram_header->counts[buckets[i]]++;
+        }
+        trigram_header->indexed = id;
+    }
+    if (buckets != local) free(buckets);
+    return status;
+}
+
+void trigram_open(const char *history_path, int rebuilt) {
+    /*
+        - Opens (or creates) the trigram index '<history>.tri' next to the history file and maps it.
+        - Entries missing from it (new file, or history written by an older shell) are indexed
+          once here; afterwards add_to_history keeps it current.
+        - When the history index was just rebuilt, the ids in the old postings may name other
+          commands, so the file is truncated and indexed from scratch.
+        - The caller holds the history file lock. On failure, search falls back to a backward scan.
+    */
+    char path[4100];
+    snprintf(path, sizeof(path), "%s.tri", history_path);
+    trigram_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (trigram_fd < 0) return;
+    if (rebuilt && ftruncate(trigram_fd, 0) < 0) goto fail;
+
+    struct stat st;
+    size_t len = TRIGRAM_HEADER_SIZE + 4096 * sizeof(struct trigram_posting);
+    if (fstat(trigram_fd, &st) < 0) goto fail;
+    while (len < (size_t)st.st_size) len *= 2;
+    if ((size_t)st.st_size < len && ftruncate(trigram_fd, len) < 0) goto fail;
+
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, trigram_fd, 0);
+    if (map == MAP_FAILED) goto fail;
+    trigram_header = map;
+    trigram_postings = (struct trigram_posting *)((char *)map + TRIGRAM_HEADER_SIZE);
+    trigram_len = len;
+
+    if (memcmp(trigram_header->magic, TRIGRAM_MAGIC, sizeof(trigram_header->magic)) != 0 ||
+        trigram_header->indexed > history_header->count) {
+        memset(trigram_header, 0, TRIGRAM_HEADER_SIZE);
+        memcpy(trigram_header->magic, TRIGRAM_MAGIC, sizeof(trigram_header->magic));
+    }
+
+    for (uint64_t id = trigram_header->indexed + 1; id <= history_header->count; id++) {
+        size_t entry_len;
+        const char *entry = history_get(id, &entry_len);
+        if (!entry || trigram_add(id, entry, entry_len) < 0) break;
+    }
+    return;
+
+fail:
+    close(trigram_fd);
+    trigram_fd = -1;
+}
+
+int history_entry_matches(long id, const char *query, size_t qlen) {
+    /*
+        - Returns non-zero if history entry id contains query as a substring.
+    */
+    size_t len;
+    const char *entry = history_get(id, &len);
+    return entry && memmem(entry, len, query, qlen) != NULL;
+}
+
+long history_search_substring(const char *query, long at_or_before) {
+    /*
+        - Returns the newest entry with id <= at_or_before containing query, or 0.
+        - With the trigram index, only the posting list of the query's rarest trigram is
+          walked, and each candidate is verified with memmem; every extra keystroke can only
+          make that list shorter. Queries under three bytes fall back to a backward scan.
+    */
+    size_t qlen = strlen(query);
+    if (qlen == 0) return at_or_before > 0 ? at_or_before : 0;
+
+    if (trigram_header && qlen >= 3 && trigram_header->indexed >= (uint64_t)history_count() &&
+        trigram_reserve(trigram_header->postings) == 0) {
+        unsigned int best = trigram_bucket(query);
+        for (size_t i = 1; i + 2 < qlen; i++) {
+            unsigned int b = trigram_bucket(query + i);
+            if (trigram_header->counts[b] < trigram_header->counts[best]) best = b;
+        }
+
+        // Postings are newest first: skip the ones after the cursor, then verify the rest
+        for (uint32_t pos = trigram_header->heads[best]; pos; pos = trigram_postings[pos - 1].prev) {
+            long id = trigram_postings[pos - 1].entry;
+            if (id > at_or_before) continue;
+            if (history_entry_matches(id, query, qlen)) return id;
+        }
+        return 0;
+    }
+
+    for (long id = at_or_before; id >= 1; id--) {
+        if (history_entry_matches(id, query, qlen)) return id;
+    }
+    return 0;
+}
+
+char *history_search_interactive() {
+    /*
+        - Ctrl-R style incremental reverse search over the history on the terminal.
+        - Puts the terminal in raw mode; printable keys extend the query, Backspace shortens it,
+          Ctrl-R moves to the next older match, Enter accepts, Esc / Ctrl-G / Ctrl-C cancel.
+        - Each keystroke re-queries from the current match through history_search_substring,
+          so the whole history is never rescanned.
+        - Returns the accepted entry (in line_arena), or NULL if the search was cancelled.
+    */
+    struct termios saved, raw;
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0) {
+        fprintf(stderr, "history: -i: not a terminal\n");
+        return NULL;
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+    char query[256];
+    size_t qlen = 0;
+    query[0] = '\0';
+    long total = history_count();
+    long match = total;
+    char *result = NULL;
+
+    while (1) {
+        // Redraw the search line
+        size_t len = 0;
+        const char *entry = match > 0 ? history_get(match, &len) : NULL;
+        printf("\r\033[K(%sreverse-i-search)`%s': %.*s", match > 0 || qlen == 0 ? "" : "failed ",
+               query, entry ? (int)len : 0, entry ? entry : "");
+        fflush(stdout);
+
+        char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        if (c == '\r' || c == '\n') {
+            if (entry && qlen > 0) result = arena_strndup(&line_arena, entry, len);
+            break;
+        } else if (c == 27 || c == 7 || c == 3) {
+            break;  // Esc, Ctrl-G, Ctrl-C
+        } else if (c == 18) {
+            // Ctrl-R: next older match of the same query
+            if (match > 1) {
+                long older = history_search_substring(query, match - 1);
+                if (older > 0) match = older;
+            }
+        } else if (c == 127 || c == 8) {
+            if (qlen > 0) query[--qlen] = '\0';
+            match = history_search_substring(query, total);
+        } else if ((unsigned char)c >= 32 && qlen + 1 < sizeof(query)) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            match = history_search_substring(query, match > 0 ? match : total);
+        }
+    }
+
+    printf("\r\033[K");
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    return result;
+}
+
+// The history settings are shell variables, read from the table defined further down
+const char *var_get(const char *name);
+
+void history_open() {
+    /*
+        - Opens (or creates) the persistent history: an append-only data file holding one command
+          per line and a '.idx' file of fixed-size records indexing it. Both are memory-mapped,
+          so startup cost does not depend on the number of entries.
+        - Also opens the trigram index used by the incremental reverse search.
+        - The location is $SHELL322_HISTFILE, or ~/.shell322_history.
+        - On any failure, history silently falls back to the in-memory ring.
+    */
+    const char *window = var_get("SHELL322_HISTSIZE");
+    if (window && atoi(window) > 0) history_window = atoi(window);
+
+    char path[4096];
+    const char *file = var_get("SHELL322_HISTFILE");
+    if (file && *file) {
+        snprintf(path, sizeof(path), "%s", file);
+    } else {
+        const char *home = var_get("HOME");
+        if (!home) return;
+        snprintf(path, sizeof(path), "%s/.shell322_history", home);
+    }
+
+    char index_path[4100];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+
+    history_data_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    history_index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (history_data_fd < 0 || history_index_fd < 0) goto fail;
+
+    flock(history_index_fd, LOCK_EX);
+
+    struct stat index_st, data_st;
+    if (fstat(history_index_fd, &index_st) < 0 || fstat(history_data_fd, &data_st) < 0) goto fail_locked;
+
+    size_t index_len = HISTORY_HEADER_SIZE + 1024 * sizeof(struct history_record);
+    while (index_len < (size_t)index_st.st_size) index_len *= 2;
+    if ((size_t)index_st.st_size < index_len && ftruncate(history_index_fd, index_len) < 0) goto fail_locked;
+
+    void *index_map = mmap(NULL, index_len, PROT_READ | PROT_WRITE, MAP_SHARED, history_index_fd, 0);
+    if (index_map == MAP_FAILED) goto fail_locked;
+    history_header = index_map;
+    history_records = (struct history_record *)((char *)index_map + HISTORY_HEADER_SIZE);
+    history_index_len = index_len;
+
+    size_t data_len = 1 << 20;
+    while (data_len < (size_t)data_st.st_size) data_len *= 2;
+    void *data_map = mmap(NULL, data_len, PROT_READ, MAP_SHARED, history_data_fd, 0);
+    if (data_map == MAP_FAILED) {
+        munmap(index_map, index_len);
+        history_header = NULL;
+        goto fail_locked;
+    }
+    history_data = data_map;
+    history_data_len = data_len;
+
+    // A missing, foreign or stale index is rebuilt from the data file, and the trigram index with it
+    int rebuilt = memcmp(history_header->magic, HISTORY_MAGIC, sizeof(history_header->magic)) != 0 ||
+                  history_header->data_size != (uint64_t)data_st.st_size;
+    if (rebuilt) history_rebuild_index();
+    trigram_open(path, rebuilt);
+
+    flock(history_index_fd, LOCK_UN);
+    return;
+
+fail_locked:
+    flock(history_index_fd, LOCK_UN);
+fail:
+    if (history_data_fd >= 0) close(history_data_fd);
+    if (history_index_fd >= 0) close(history_index_fd);
+    history_data_fd = -1;
+    history_index_fd = -1;
+}
+
+void history_close() {
+    /*
+        - Unmaps and closes the history files and frees the in-memory ring.
+    */
+    if (history_header) {
+        munmap(history_header, history_index_len);
+        munmap((void *)history_data, history_data_len);
+        close(history_index_fd);
+        close(history_data_fd);
+        history_header = NULL;
+    }
+    if (trigram_header) {
+        munmap(trigram_header, trigram_len);
+        close(trigram_fd);
+        trigram_header = NULL;
+    }
+    if (history_ring) {
+        for (int i = 0; i < history_window; i++) free(history_ring[i]);
+        free(history_ring);
+        history_ring = NULL;
+    }
+}
 
 void add_to_history(const char *cmd) {
     /*
-        - Adds a command to the history buffer.
-        - If the current slot is occupied, free it to avoid memory leaks.
-        - Duplicates the input command string and stores it in the history array.
-        - Uses circular buffer logic to overwrite oldest entries when full.
+        - Adds a command to the history in O(1).
+        - With a history file: appends the line to the data file and one fixed-size record
+          to the mapped index, under an flock so several shells can share the files,
+          and adds the entry to the trigram index.
+        - Without one: stores a copy in the in-memory ring of history_window entries.
+        - Leading blanks are not stored.
+    */
+    if (!history_enabled) return;
+
+    cmd += strspn(cmd, " \t");
+    size_t len = strlen(cmd);
+    if (len == 0) return;
+
+    if (!history_header) {
+        history_ring_add(cmd, len);
+        return;
+    }
+
+    flock(history_index_fd, LOCK_EX);
+    uint64_t offset = history_header->data_size;
+
+    struct iovec iov[2] = {
+        { (void *)cmd, len },
+        { "\n", 1 },
+    };
+    if (pwritev(history_data_fd, iov, 2, offset) == (ssize_t)(len + 1) &&
+        history_remap(history_header->count + 1, offset + len + 1) == 0) {
+        history_index_entry(cmd, len, offset);
+        history_header->data_size = offset + len + 1;
+        trigram_add(history_header->count, cmd, len);
+    }
+    flock(history_index_fd, LOCK_UN);
+}
+
+long history_find_prefix(const char *prefix, long before) {
+    /*
+        - Returns the id of the newest entry older than 'before' that starts with prefix, or 0.
+        - Prefixes of two or more bytes follow the index's prefix chain, which only visits
+          entries sharing the first two bytes; shorter prefixes scan backwards.
+    */
+    size_t plen = strlen(prefix);
+    size_t len;
+
+    if (history_header && plen >= 2 && history_remap(history_header->count, 0) == 0) {
+        long id = history_header->prefix_heads[history_prefix_key(prefix, plen)];
+        while (id >= before && id > 0) id = history_records[id - 1].prev_prefix;
+        while (id > 0) {
+            const char *entry = history_get(id, &len);
+            if (entry && len >= plen && memcmp(entry, prefix, plen) == 0) return id;
+            id = history_records[id - 1].prev_prefix;
+        }
+        return 0;
+    }
+
+    for (long id = before - 1; id >= 1; id--) {
+        const char *entry = history_get(id, &len);
+        if (!entry) break;
+        if (len >= plen && memcmp(entry, prefix, plen) == 0) return id;
+    }
+    return 0;
+}
+
+int history_map_all(long total) {
+    /*
+        - Maps the index and data of entries 1..total in full before they are printed with
+          out_ref: a later mremap could move the mapping under the iovecs already queued.
+        - Returns 1 if entries may be queued by reference, 0 if they must be copied.
+    */
+    if (!history_header || total == 0) return 1;
+    if (history_remap(total, 0) < 0) return 0;
+    struct history_record *last = &history_records[total - 1];
+    return history_remap(0, last->offset + last->length) == 0;
+}
+
+void show_history_entry(long id, const char *entry, size_t len, int by_ref) {
+    /*
+        - Prints one history entry as '[id] text', straight from the mapping when by_ref.
+    */
+    out_printf("[%ld] ", id);
+    if (by_ref) {
+        out_ref(entry, len);
+    } else {
+        out_write(entry, len);
+    }
+    out_write("\n", 1);
+}
+
+int show_history(char **args) {
+    /*
+        - Built-in command handler for 'history'.
+        - 'history' prints the last history_window entries, 'history N' the last N entries.
+        - 'history -m PREFIX' prints the newest history_window entries starting with PREFIX,
+          found through the prefix index.
+        - Returns 0, or 1 on a usage error.
+        - Each entry is printed with its absolute number, as used by '!n'.
+    */
+    long total = history_count();
+    int by_ref = history_map_all(total);
+
+    if (args[1] && strcmp(args[1], "-m") == 0) {
+        if (!args[2]) {
+            fprintf(stderr, "history: -m: prefix required\n");
+            return 1;
+        }
+        int shown = 0;
+        for (long id = history_find_prefix(args[2], total + 1); id > 0 && shown < history_window;
+             id = history_find_prefix(args[2], id)) {
+            size_t len;
+            const char *entry = history_get(id, &len);
+            show_history_entry(id, entry, len, by_ref);
+            shown++;
+        }
+        return 0;
+    }
+
+    long n = history_window;
+    if (args[1]) {
+        char *end;
+        n = strtol(args[1], &end, 10);
+        if (*end != '\0' || n < 0) {
+            fprintf(stderr, "history: %s: numeric argument required\n", args[1]);
+            return 1;
+        }
+    }
+
+    long first = total - n + 1;
+    if (first < 1) first = 1;
+    for (long id = first; id <= total; id++) {
+        size_t len;
+        const char *entry = history_get(id, &len);
+        if (!entry) continue;
+        show_history_entry(id, entry, len, by_ref);
+    }
+    return 0;
+}
+
+unsigned int hash_string(const char *str) {
+    /*
+        - Computes a 32-bit FNV-1a hash of a NUL-terminated string.
+        - Used to pick buckets in the shell's hash tables.
+    */
+    unsigned int h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void hash_clear() {
+    /*
+        - Empties the command-location cache ('hash -r').
+        - Called whenever PATH changes, since every cached location may now be stale.
+    */
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        struct hash_entry *e = command_hash[i];
+        while (e) {
+            struct hash_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        command_hash[i] = NULL;
+    }
+}
+
+void hash_forget(const char *name) {
+    /*
+        - Removes a single command from the cache.
+        - Used when a cached path no longer exists so the next lookup walks PATH again.
+    */
+    struct hash_entry **link = &command_hash[hash_string(name) % HASH_BUCKETS];
+    while (*link) {
+        struct hash_entry *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+size_t var_name_length(const char *s) {
+    /*
+        - Returns the length of the variable name at the start of s ([A-Za-z_][A-Za-z0-9_]*),
+          or 0 if s does not start with one.
+    */
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_') return 0;
+    size_t n = 1;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_') n++;
+    return n;
+}
+
+struct var *var_lookup(const char *name, size_t len, unsigned int *hash) {
+    /*
+        - Finds the variable called name[0, len); also returns the name's hash through hash.
+    */
+    unsigned int h = 5381;
+    for (size_t i = 0; i < len; i++) h = h * 33 + (unsigned char)name[i];
+    if (hash) *hash = h;
+    for (struct var *v = var_table[h % VAR_BUCKETS]; v; v = v->next) {
+        if (v->hash == h && v->name_len == len && memcmp(v->entry, name, len) == 0) return v;
+    }
+    return NULL;
+}
+
+const char *env_overlay_get(const char *name, size_t len) {
+    /*
+        - Returns the value name[0, len) has in the prefix assignments of the command being
+          started, or NULL if they do not set it.
+    */
+    for (char **a = env_overlay; a && *a; a++) {
+        if (strncmp(*a, name, len) == 0 && (*a)[len] == '=') return *a + len + 1;
+    }
+    return NULL;
+}
+
+const char *var_get_n(const char *name, size_t len) {
+    /*
+        - Returns the value of the variable name[0, len), or NULL if it is unset. Prefix
+          assignments of the command being started ('HOME=/x cd') take precedence.
+    */
+    const char *value = env_overlay_get(name, len);
+    if (value) return value;
+    struct var *v = var_lookup(name, len, NULL);
+    return v ? v->entry + len + 1 : NULL;
+}
+
+const char *var_get(const char *name) {
+    /*
+        - Returns the value of the variable name, or NULL if it is unset (see var_get_n).
+        - The shell never updates environ, so this, not getenv, is how the shell reads its
+          own settings (SHELL322_*, HOME, ...) once started.
+    */
+    return var_get_n(name, strlen(name));
+}
+
+void var_set(const char *name, const char *value, int export) {
+    /*
+        - Sets a shell variable; with export set it is also put in the environment of
+          children, otherwise an existing variable keeps its export attribute.
+        - Every variable change made by the shell goes through here: a change to an exported
+          variable marks the envp snapshot stale, and a PATH change clears the
+          command-location cache.
+    */
+    size_t len = strlen(name);
+    unsigned int h;
+    struct var *v = var_lookup(name, len, &h);
+    if (!v) {
+        v = calloc(1, sizeof(*v));
+        v->hash = h;
+        v->name_len = len;
+        v->next = var_table[h % VAR_BUCKETS];
+        var_table[h % VAR_BUCKETS] = v;
+    }
+    char *entry = malloc(len + strlen(value) + 2);
+    sprintf(entry, "%s=%s", name, value);
+    free(v->entry);  // A stale snapshot may still point at it, but it is rebuilt before any use
+    v->entry = entry;
+    if (export) v->exported = 1;
+    if (v->exported) env_dirty = 1;
+    if (strcmp(name, "PATH") == 0) hash_clear();
+}
+
+void var_assign(const char *assignment) {
+    /*
+        - Runs one 'NAME=value' word as a plain assignment to a shell variable.
+    */
+    size_t len = var_name_length(assignment);
+    char name[len + 1];
+    memcpy(name, assignment, len);
+    name[len] = '\0';
+    var_set(name, assignment + len + 1, 0);
+}
+
+void var_unset(const char *name) {
+    /*
+        - Removes a shell variable, and with it its environment entry if it was exported.
+    */
+    unsigned int h;
+    struct var *v = var_lookup(name, strlen(name), &h);
+    if (!v) return;
+    for (struct var **link = &var_table[h % VAR_BUCKETS]; *link; link = &(*link)->next) {
+        if (*link != v) continue;
+        *link = v->next;
+        break;
+    }
+    if (v->exported) env_dirty = 1;
+    if (strcmp(name, "PATH") == 0) hash_clear();
+    free(v->entry);
+    free(v);
+}
+
+void var_import(char **envp) {
+    /*
+        - Loads the environment the shell was started with as exported variables.
+    */
+    for (; *envp; envp++) {
+        size_t len = var_name_length(*envp);
+        if (!len || (*envp)[len] != '=') continue;  // Not a name a variable could have
+        char name[len + 1];
+        memcpy(name, *envp, len);
+        name[len] = '\0';
+        var_set(name, *envp + len + 1, 1);
+    }
+}
+
+void var_clear() {
+    /*
+        - Frees every variable and the envp snapshot, at exit.
+    */
+    for (int i = 0; i < VAR_BUCKETS; i++) {
+        while (var_table[i]) {
+            struct var *v = var_table[i];
+            var_table[i] = v->next;
+            free(v->entry);
+            free(v);
+        }
+    }
+    free(env_snapshot);
+    env_snapshot = NULL;
+    env_dirty = 1;
+}
+
+char **env_build() {
+    /*
+        - Returns the envp for the command being started.
+        - The exported variables' entries are collected into env_snapshot only when one of
+          them changed since the last spawn; otherwise every spawn shares the same array.
+        - Prefix assignments are layered on top in a per-line pointer array (line_arena) that
+          lists them first and then the snapshot entries they do not replace, so neither the
+          snapshot nor any string is copied.
+    */
+    if (env_dirty || !env_snapshot) {
+        size_t count = 0;
+        for (int i = 0; i < VAR_BUCKETS; i++) {
+            for (struct var *v = var_table[i]; v; v = v->next) count += v->exported;
+        }
+        free(env_snapshot);
+        env_snapshot = malloc((count + 1) * sizeof(char *));
+        count = 0;
+        for (int i = 0; i < VAR_BUCKETS; i++) {
+            for (struct var *v = var_table[i]; v; v = v->next) {
+                if (v->exported) env_snapshot[count++] = v->entry;
+            }
+        }
+        env_snapshot[count] = NULL;
+        env_dirty = 0;
+    }
+    if (!env_overlay || !env_overlay[0]) return env_snapshot;
+
+    size_t n = 0, m = 0;
+    while (env_overlay[n]) n++;
+    while (env_snapshot[m]) m++;
+    char **envp = arena_alloc(&line_arena, (n + m + 1) * sizeof(char *));
+    memcpy(envp, env_overlay, n * sizeof(char *));
+    size_t count = n;
+    for (size_t i = 0; i < m; i++) {
+        const char *eq = strchr(env_snapshot[i], '=');
+        if (!env_overlay_get(env_snapshot[i], eq - env_snapshot[i])) envp[count++] = env_snapshot[i];
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+int run_builtin_export(char **args) {
+    /*
+        - Built-in command handler for 'export NAME[=VALUE]...': puts the variables (set to
+          VALUE if given) in the environment of every command started afterwards.
+        - 'export' alone lists the exported variables.
+        - Returns 0, or 1 if a name is not valid.
+    */
+    if (!args[1]) {
+        for (char **e = env_build(); *e; e++) out_printf("export %s\n", *e);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        size_t len = var_name_length(args[i]);
+        if (!len || (args[i][len] != '=' && args[i][len] != '\0')) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        char name[len + 1];
+        memcpy(name, args[i], len);
+        name[len] = '\0';
+        const char *value = args[i][len] == '=' ? args[i] + len + 1 : var_get(name);
+        var_set(name, value ? value : "", 1);
+    }
+    return status;
+}
+
+int run_builtin_unset(char **args) {
+    /*
+        - Built-in command handler for 'unset NAME...': removes the variables, from the
+          environment of later commands too. Unknown names are ignored. Returns 0.
+    */
+    for (int i = 1; args[i]; i++) var_unset(args[i]);
+    return 0;
+}
+
+char *search_path(const char *name) {
+    /*
+        - Walks every directory of $PATH looking for an executable regular file called name.
+        - Returns a newly allocated absolute path, or NULL if the command is not found.
+        - Uses stat/access instead of failed execve attempts, so nothing is executed here.
+    */
+    const char *path_env = var_get("PATH");
+    if (!path_env) path_env = "/usr/local/bin:/usr/bin:/bin";
+
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+
+        // An empty PATH element means the current directory
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (dir_len == 0) {
+            sprintf(candidate, "./%s", name);
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+        }
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        if (!end) break;
+        dir = end + 1;
+    }
+    return NULL;
+}
+
+const char *lookup_command(const char *name) {
+    /*
+        - Resolves a command name to the path that should be passed to execve.
+        - Names containing '/' are used as-is, exactly like execvp does.
+        - Otherwise the hash table is consulted first; on a miss PATH is searched once
+          and the result is remembered, so repeated commands cost no failed execve calls.
+        - Returns NULL if the command cannot be found.
+    */
+    if (strchr(name, '/')) return name;
+    if (env_overlay_get("PATH", 4)) {
+        // 'PATH=... cmd' searches that PATH, without caching the result
+        char *path = search_path(name);
+        if (!path) return NULL;
+        char *copy = arena_strndup(&line_arena, path, strlen(path));
+        free(path);
+        return copy;
+    }
+
+    unsigned int bucket = hash_string(name) % HASH_BUCKETS;
+    for (struct hash_entry *e = command_hash[bucket]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    char *path = search_path(name);
+    if (!path) return NULL;
+
+    struct hash_entry *e = malloc(sizeof(*e));
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 1;
+    e->next = command_hash[bucket];
+    command_hash[bucket] = e;
+    return e->path;
+}
+
+int run_builtin_hash(char **args) {
+    /*
+        - Built-in command handler for 'hash'.
+        - With no arguments, prints every cached command with its hit count and path.
+        - 'hash -r' forgets all remembered locations.
+        - 'hash name...' looks each name up and remembers its location.
+    */
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        hash_clear();
+        return 0;
+    }
+
+    if (args[1]) {
+        int status = 0;
+        for (int i = 1; args[i]; i++) {
+            hash_forget(args[i]);
+            if (!lookup_command(args[i])) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    int printed = 0;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        for (struct hash_entry *e = command_hash[i]; e; e = e->next) {
+            if (!printed) out_printf("hits\tcommand\n");
+            out_printf("%4d\t%s\n", e->hits, e->path);
+            printed = 1;
+        }
+    }
+    if (!printed) out_printf("hash: hash table empty\n");
+    return 0;
+}
+
+uint64_t trace_now() {
+    /*
+        - Returns CLOCK_MONOTONIC in nanoseconds if tracing is on, otherwise 0 without a syscall.
+        - Async-signal-safe.
+    */
+    if (trace_fd < 0) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void trace_record(int type, uint64_t start, int tid, int arg, const char *name) {
+    /*
+        - Appends one complete event [start, now] to the trace ring buffer.
+        - tid is the child pid for per-child events, or 0 for the shell itself.
+        - Lock-free and async-signal-safe: a slot is claimed with a compare-and-swap on the
+          write index, filled, then published through its sequence number, so the SIGCHLD
+          handler can record while main is recording or flushing. A full ring drops the event.
+    */
+    if (trace_fd < 0 || start == 0) return;
+    uint64_t end = trace_now();
+
+    uint64_t idx = __atomic_load_n(&trace_write, __ATOMIC_RELAXED);
+    do {
+        if (idx - __atomic_load_n(&trace_read, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+            __atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace_write, &idx, idx + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    struct trace_event *ev = &trace_ring[idx % TRACE_RING];
+    ev->start = start;
+    ev->end = end;
+    ev->type = type;
+    ev->tid = tid;
+    ev->arg = arg;
+    size_t n = 0;
+    if (name) {
+        while (name[n] && n + 1 < sizeof(ev->name)) {
+            ev->name[n] = name[n];
+            n++;
+        }
+    }
+    ev->name[n] = '\0';
+    __atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void trace_flush() {
+    /*
+        - Writes every published event of the ring to the trace file and frees their slots.
+        - Each event becomes one Chrome trace 'complete' event ("ph":"X") on its own line;
+          timestamps are microseconds since the shell started.
+        - Called from main between commands, from event_wait and at exit, never from the
+          signal handler.
+    */
+    if (trace_fd < 0) return;
+
+    static const char *names[] = {
+        [TRACE_READ_LINE] = "read-line", [TRACE_PARSE] = "parse", [TRACE_BUILTIN] = "builtin",
+        [TRACE_SPAWN] = "spawn", [TRACE_WAIT] = "wait", [TRACE_CHILD] = "child",
+        [TRACE_LINE] = "line", [TRACE_PIPELINE] = "pipeline", [TRACE_AND] = "and",
+    };
+
+    char buf[8192];
+    size_t len = 0;
+    uint64_t r = trace_read;
+    while (1) {
+        struct trace_event *ev = &trace_ring[r % TRACE_RING];
+        if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != r + 1) break;  // Not yet published
+
+        // Escape the detail text for JSON
+        char detail[2 * sizeof(ev->name)];
+        size_t d = 0;
+        for (const char *c = ev->name; *c; c++) {
+            if (*c == '"' || *c == '\\') detail[d++] = '\\';
+            detail[d++] = ((unsigned char)*c < 32) ? ' ' : *c;
+        }
+        detail[d] = '\0';
+
+        if (len + 512 > sizeof(buf)) {
+            ssize_t ignored = write(trace_fd, buf, len);
+            (void)ignored;
+            len = 0;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%d,\"detail\":\"%s\"}}%s\n",
+                        names[ev->type], (ev->start - trace_epoch) / 1000.0,
+                        (ev->end - ev->start) / 1000.0, getpid(), ev->tid ? ev->tid : getpid(), ev->arg, detail,
+                        trace_json_lines ? "" : ",");
+        r++;
+        __atomic_store_n(&trace_read, r, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_exchange_n(&trace_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"events\":%llu}}%s\n",
+                        (trace_now() - trace_epoch) / 1000.0, getpid(), getpid(),
+                        (unsigned long long)dropped, trace_json_lines ? "" : ",");
+    }
+    if (len > 0) {
+        ssize_t ignored = write(trace_fd, buf, len);
+        (void)ignored;
+    }
+}
+
+void trace_open() {
+    /*
+        - Enables tracing when SHELL322_TRACE names a file.
+        - A name ending in '.jsonl' gets plain JSON lines; anything else gets the Chrome trace
+          array format (an opening '[' and comma-terminated events, closed by trace_close, loadable
+          in chrome://tracing).
+        - The file is opened O_CLOEXEC so children never inherit it.
+    */
+    const char *file = var_get("SHELL322_TRACE");
+    if (!file || !*file) return;
+
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "shell322: trace: %s: %s\n", file, strerror(errno));
+        return;
+    }
+    trace_ring = calloc(TRACE_RING, sizeof(struct trace_event));
+    if (!trace_ring) {
+        close(trace_fd);
+        trace_fd = -1;
+        return;
+    }
+
+    size_t n = strlen(file);
+    trace_json_lines = n > 6 && strcmp(file + n - 6, ".jsonl") == 0;
+    if (!trace_json_lines) {
+        ssize_t ignored = write(trace_fd, "[\n", 2);
+        (void)ignored;
+    }
+    trace_epoch = trace_now();
+}
+
+void trace_close() {
+    /*
+        - Flushes the remaining events and closes the trace file.
+        - The Chrome format gets an empty '{}' after the last comma and a closing ']', so the
+          file is a complete JSON array rather than relying on the viewer's leniency.
+    */
+    if (trace_fd < 0) return;
+    trace_flush();
+    if (!trace_json_lines) {
+        ssize_t ignored = write(trace_fd, "{}]\n", 4);
+        (void)ignored;
+    }
+    close(trace_fd);
+    trace_fd = -1;
+    free(trace_ring);
+    trace_ring = NULL;
+}
+
+// Non-zero when the shell is interactive and runs every job in its own process group
+int job_control = 0;
+
+// Process group of the shell itself, given back the terminal after foreground jobs
+pid_t shell_pgid;
+
+// Signal mask in effect outside job-table critical sections
+sigset_t shell_sigmask;
+
+void block_sigchld(sigset_t *old) {
+    /*
+        - Blocks SIGCHLD so the job table can be changed without racing the handler.
+        - Stores the previous mask in old for unblock_sigchld.
+    */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+void unblock_sigchld(const sigset_t *old) {
+    /*
+        - Restores the signal mask saved by block_sigchld.
+    */
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+int proc_slot_of(pid_t pid) {
+    /*
+        - Returns the index of pid in the process table, or -1 if it is not a tracked child.
+        - Open addressing with linear probing; safe to call from the SIGCHLD handler.
+    */
+    unsigned int idx = (unsigned int)pid & (PROC_SLOTS - 1);
+    for (int n = 0; n < PROC_SLOTS; n++) {
+        if (procs[idx].pid == pid) return idx;
+        if (procs[idx].pid == 0) return -1;  // Empty slot ends the probe chain
+        idx = (idx + 1) & (PROC_SLOTS - 1);
+    }
+    return -1;
+}
+
+void proc_slot_release(int slot) {
+    /*
+        - Removes a process from the table. It is left as a tombstone (-1), so probes for
+          other pids still run past it, unless the next slot is empty: then no probe chain
+          continues through it, and it and the tombstones right before it become empty
+          again. Without that, tombstones would pile up over the shell's life and every
+          lookup of an untracked pid would scan the whole table.
+        - Safe to call from the SIGCHLD handler.
+    */
+    unsigned int idx = slot;
+    if (procs[(idx + 1) & (PROC_SLOTS - 1)].pid != 0) {
+        procs[idx].pid = -1;
+        return;
+    }
+    procs[idx].pid = 0;
+    for (int n = 1; n < PROC_SLOTS; n++) {
+        idx = (idx - 1) & (PROC_SLOTS - 1);
+        if (procs[idx].pid != -1) break;
+        procs[idx].pid = 0;
+    }
+}
+
+int job_alloc(const char *command, int background) {
+    /*
+        - Takes a free job slot in O(1) from the free list and initializes it.
+        - The command text is copied into the slot (truncated), so the handler never needs malloc/free.
+        - Must be called with SIGCHLD blocked. Returns the slot index, or -1 if the table is full.
+    */
+    if (job_free_top == 0) {
+        fprintf(stderr, "shell322: too many jobs\n");
+        return -1;
+    }
+    int j = job_free_list[--job_free_top];
+    struct job *job = &jobs[j];
+    job->state = JOB_RUNNING;
+    job->background = background;
+    job->collected = 0;
+    job->pgid = 0;
+    job->nprocs = 0;
+    job->live = 0;
+    job->stopped = 0;
+    job->status = 0;
+    job->last_pid = 0;
+    job->seq = ++job_seq;
+    job->nstats = 0;
+    snprintf(job->command, sizeof(job->command), "%s", command ? command : "");
+    return j;
+}
+
+const char *job_label(const struct node *n) {
+    /*
+        - Returns the text n was parsed from, to label the job that runs it ('sleep 1' of
+          'sleep 1 & echo'), or the whole line if the span is unknown.
+    */
+    size_t len = strlen(current_command);
+    if (n->text_len == 0 || n->text_start > len || n->text_len > len - n->text_start) return current_command;
+    return arena_strndup(&line_arena, current_command + n->text_start, n->text_len);
+}
+
+void job_free(int j) {
+    /*
+        - Returns a job slot to the free list in O(1).
+        - Called from the SIGCHLD handler for finished background jobs, or with SIGCHLD blocked.
+    */
+    jobs[j].state = JOB_FREE;
+    job_free_list[job_free_top++] = j;
+    if (limit_leftovers) limit_cleanup_due = 1;
+}
+
+int job_add_process(int j, pid_t pid, const char *name) {
+    /*
+        - Registers a spawned process as a member of job j.
+        - Records its start time and name for the resource statistics of the job.
+        - The last process added is the one whose exit status becomes the job status.
+        - Must be called with SIGCHLD blocked, so the handler cannot see an unknown pid.
+        - If the process table is full, the process could never be reaped through it, so it
+          is killed and reaped here and not counted in the job; returns -1 with errno EAGAIN
+          then, otherwise 0.
+    */
+    unsigned int idx = (unsigned int)pid & (PROC_SLOTS - 1);
+    int n = 0;
+    for (; n < PROC_SLOTS; n++) {
+        if (procs[idx].pid <= 0) {
+            procs[idx].pid = pid;
+            procs[idx].job = j;
+            procs[idx].stopped = 0;
+            procs[idx].stage = -1;
+            if (jobs[j].nstats < JOB_STAT_STAGES) {
+                struct stage_stats *st = &jobs[j].stats[jobs[j].nstats];
+                memset(st, 0, sizeof(*st));
+                st->pid = pid;
+                clock_gettime(CLOCK_MONOTONIC, &st->start);
+                snprintf(st->name, sizeof(st->name), "%s", name);
+                procs[idx].stage = jobs[j].nstats++;
+            }
+            break;
+        }
+        idx = (idx + 1) & (PROC_SLOTS - 1);
+    }
+    if (n == PROC_SLOTS) {
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+        errno = EAGAIN;
+        return -1;
+    }
+    if (jobs[j].pgid == 0) jobs[j].pgid = job_control ? pid : 0;
+    jobs[j].nprocs++;
+    jobs[j].live++;
+    jobs[j].last_pid = pid;
+    return 0;
+}
+
+size_t append_text(char *buf, size_t len, size_t cap, const char *str) {
+    /*
+        - Appends str to buf without stdio; async-signal-safe helper for the SIGCHLD handler.
+    */
+    while (*str && len + 1 < cap) buf[len++] = *str++;
+    return len;
+}
+
+size_t append_number(char *buf, size_t len, size_t cap, long value) {
+    /*
+        - Appends a decimal number to buf without stdio; async-signal-safe.
+    */
+    char digits[24];
+    int n = 0;
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0 && len + 1 < cap) buf[len++] = '-';
+    while (n > 0 && len + 1 < cap) buf[len++] = digits[--n];
+    return len;
+}
+
+void report_job(int j, const char *what, int number) {
+    /*
+        - Writes a '[n] <what> [number]  <command>' line to stderr with a single write(2).
+        - Async-signal-safe, so background completions are reported the moment they are reaped.
+    */
+    char buf[256];
+    size_t len = 0;
+    len = append_text(buf, len, sizeof(buf), "[");
+    len = append_number(buf, len, sizeof(buf), j + 1);
+    len = append_text(buf, len, sizeof(buf), "] ");
+    len = append_text(buf, len, sizeof(buf), what);
+    if (number >= 0) {
+        len = append_text(buf, len, sizeof(buf), " ");
+        len = append_number(buf, len, sizeof(buf), number);
+    }
+    len = append_text(buf, len, sizeof(buf), "\t");
+    len = append_text(buf, len, sizeof(buf), jobs[j].command);
+    buf[len++] = '\n';
+    ssize_t ignored = write(STDERR_FILENO, buf, len);
+    (void)ignored;
+}
+
+void reap_children() {
+    /*
+        - Reaps every child that changed state with wait4(-1, WNOHANG) in a loop, keeping each
+          process's resource usage and end time in its job's statistics.
+        - Updates the owning job's counters; a job whose processes have all exited is DONE.
+        - Finished background jobs are reported immediately and their slot is freed in O(1);
+          foreground jobs are left for wait_for_job, which needs their status.
+        - Async-signal-safe. Runs in the SIGCHLD handler, or in the event loop while SIGCHLD
+          is blocked.
+    */
+    int saved_errno = errno;
+    int status;
+    pid_t pid;
+    struct rusage usage;
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        int slot = proc_slot_of(pid);
+        if (slot < 0) continue;  // Not a tracked child
+
+        struct proc_slot *p = &procs[slot];
+        struct job *job = &jobs[p->job];
+
+        if (WIFSTOPPED(status)) {
+            if (!p->stopped) {
+                p->stopped = 1;
+                job->stopped++;
+            }
+            if (job->stopped == job->live) {
+                job->state = JOB_STOPPED;
+                if (job->background && !job->collected) report_job(p->job, "Stopped", -1);
+            }
+            continue;
+        }
+        if (WIFCONTINUED(status)) {
+            if (p->stopped) {
+                p->stopped = 0;
+                job->stopped--;
+            }
+            job->state = JOB_RUNNING;
+            continue;
+        }
+
+        // Process exited or was killed
+        if (p->stage >= 0) {
+            struct stage_stats *st = &job->stats[p->stage];
+            st->status = status;
+            st->usage = usage;
+            clock_gettime(CLOCK_MONOTONIC, &st->end);
+            trace_record(TRACE_CHILD, (uint64_t)st->start.tv_sec * 1000000000u + st->start.tv_nsec,
+                         pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status), st->name);
+        }
+        if (p->stopped) job->stopped--;
+        if (pid == job->last_pid) job->status = status;
+        proc_slot_release(slot);
+        job->live--;
+
+        if (job->live == 0) {
+            job->state = JOB_DONE;
+            if (job->background && !job->collected) {
+                if (WIFSIGNALED(job->status)) {
+                    report_job(p->job, "Killed by signal", WTERMSIG(job->status));
+                } else if (WEXITSTATUS(job->status) != 0) {
+                    report_job(p->job, "Exit", WEXITSTATUS(job->status));
+                } else {
+                    report_job(p->job, "Done", -1);
+                }
+                job_free(p->job);
+            }
+        } else if (job->stopped == job->live) {
+            job->state = JOB_STOPPED;
+        }
+    }
+
+    errno = saved_errno;
+}
+
+void sigchld_handler(int sig) {
+    /*
+        - SIGCHLD handler, for children that change state while the shell is not waiting in
+          the event loop (reading input, running a builtin).
+    */
+    (void)sig;
+    reap_children();
+}
+
+// Event loop the shell sleeps in while it waits for children: one epoll set watching a signalfd
+// for SIGCHLD and SIGINT, the output pipes of coprocesses and the streams of a waiting builtin.
+// Created on first use, -1 until then.
+int event_fd = -1;
+void event_signal_ready(struct event_source *src);
+struct event_source event_signal = { -1, event_signal_ready, NULL };
+
+// Set by event_signal_ready when a SIGINT was read; event_wait returns it
+int event_sigint = 0;
+
+void event_signal_ready(struct event_source *src) {
+    /*
+        - Drains the signalfd: several SIGCHLDs may be merged into one, and the reap loop
+          collects every child anyway.
+    */
+    struct signalfd_siginfo info;
+    int child = 0;
+    while (read(src->fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) child = 1;
+        if (info.ssi_signo == SIGINT) event_sigint = 1;
+    }
+    if (child) reap_children();
+}
+
+void event_close() {
+    /*
+        - Closes the epoll set and the signalfd.
+        - A forked child calls this so it never shares (and edits) the parent's epoll set;
+          its first wait creates its own.
+    */
+    if (event_fd >= 0) close(event_fd);
+    if (event_signal.fd >= 0) close(event_signal.fd);
+    event_fd = event_signal.fd = -1;
+}
+
+int event_open() {
+    /*
+        - Creates the epoll set and the signalfd on first use.
+        - A signalfd only reports signals that are blocked: SIGCHLD while a caller holds it
+          blocked (every place the shell waits), SIGINT only while 'par' blocks it.
+        - Returns 0, or -1 if either cannot be created; event_wait then uses sigwaitinfo.
+    */
+    if (event_fd >= 0) return 0;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGINT);
+    event_signal.fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (event_signal.fd < 0) return -1;
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &event_signal };
+    if (event_fd < 0 || epoll_ctl(event_fd, EPOLL_CTL_ADD, event_signal.fd, &ev) < 0) {
+        event_close();
+        return -1;
+    }
+    return 0;
+}
+
+int event_add(struct event_source *src) {
+    /*
+        - Starts watching src->fd; src must stay valid until event_remove.
+        - Returns 0, or -1 if the descriptor cannot be watched.
+    */
+    if (event_open() < 0) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = src };
+    return epoll_ctl(event_fd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+void event_remove(struct event_source *src) {
+    /*
+        - Stops watching src->fd; called before the descriptor is closed.
+    */
+    if (event_fd >= 0) epoll_ctl(event_fd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+void coproc_ready(struct event_source *src) {
+    /*
+        - Reads what a coprocess wrote into its buffer while 'coproc -r' waits for a line.
+    */
+    struct coproc *c = src->arg;
+    ssize_t r = read(c->from_fd, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len);
+    if (r > 0) {
+        c->buf_len += r;
+    } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+        event_remove(src);
+        c->at_eof = 1;
+    }
+}
+
+// Leftover cgroups are removed from the event loop once a job ended (see limit_cleanup_due)
+void limit_cleanup();
+
+int event_wait() {
+    /*
+        - Sleeps until something happens, then handles everything that did: children are
+          reaped (one wait4 loop per wakeup, however many exited), the ready callbacks of the
+          caller's sources run (a coprocess 'coproc -r' waits on, 'par -t' streams), and while
+          tracing the trace ring is flushed at least every EVENT_TRACE_MS.
+        - Used wherever the shell waits for children, in place of sigsuspend; the caller
+          re-checks its condition afterwards.
+        - Must be called with SIGCHLD blocked: a child exiting between the caller's check and
+          the sleep leaves SIGCHLD pending, which makes the signalfd readable.
+        - Returns SIGINT if one arrived (only possible while the caller blocks it), otherwise 0.
+    */
+    if (event_open() < 0) {
+        sigset_t set, blocked;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigprocmask(SIG_BLOCK, NULL, &blocked);
+        if (sigismember(&blocked, SIGINT)) sigaddset(&set, SIGINT);
+        int sig = sigwaitinfo(&set, NULL);
+        if (sig == SIGCHLD) reap_children();
+        return sig == SIGINT ? SIGINT : 0;
+    }
+
+    struct epoll_event events[EVENT_BATCH];
+    int n = epoll_wait(event_fd, events, EVENT_BATCH, trace_fd >= 0 ? EVENT_TRACE_MS : -1);
+    event_sigint = 0;
+    for (int i = 0; i < n; i++) {
+        struct event_source *src = events[i].data.ptr;
+        src->ready(src);
+    }
+    if (limit_cleanup_due) limit_cleanup();
+    trace_flush();
+    return event_sigint ? SIGINT : 0;
+}
+
+int status_code(int status) {
+    /*
+        - Converts a wait status into a shell exit code (128 + signal for killed processes).
+    */
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+int wait_for_job(int j) {
+    /*
+        - Waits in the foreground until job j finishes or stops.
+        - Must be called with SIGCHLD blocked; the job's processes are reaped by event_wait,
+          which also keeps reporting background jobs and serving coprocesses meanwhile.
+        - With job control, the job owns the terminal while it runs and the shell takes it back afterwards.
+        - A finished job is freed and its exit code returned; a stopped job becomes a background job.
+        - The job's per-process statistics are appended to the current line's time report.
+    */
+    struct job *job = &jobs[j];
+    if (job->live == 0 && job->state != JOB_DONE) job->state = JOB_DONE;  // Nothing was started
+
+    if (job_control && job->pgid > 0) tcsetpgrp(STDIN_FILENO, job->pgid);
+
+    uint64_t trace_start = trace_now();
+    while (job->state == JOB_RUNNING) {
+        event_wait();
+    }
+    trace_record(TRACE_WAIT, trace_start, 0, j + 1, job->command);
+
+    if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (job->state == JOB_STOPPED) {
+        job->background = 1;
+        fprintf(stderr, "\n");
+        report_job(j, "Stopped", -1);
+        return 128 + SIGTSTP;
+    }
+
+    // Keep the per-process statistics for 'time' before the slot is reused
+    for (int i = 0; i < job->nstats && time_current.count < TIME_REPORT_STAGES; i++) {
+        time_current.stages[time_current.count++] = job->stats[i];
+    }
+
+    int code = job->nprocs > 0 ? status_code(job->status) : 127;
+    job_free(j);
+    return code;
+}
+
+int parse_job_spec(const char *spec) {
+    /*
+        - Resolves a job specification ('%n', 'n', or '%%'/'%+' for the most recent job) to a slot.
+        - Returns the slot index, or -1 (after printing an error) if no such job exists.
+    */
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        // Most recently started job still in the table
+        int best = -1;
+        for (int j = 0; j < MAX_JOBS; j++) {
+            if (jobs[j].state == JOB_FREE || jobs[j].state == JOB_DONE) continue;
+            if (best < 0 || jobs[j].seq > jobs[best].seq) best = j;
+        }
+        if (best < 0) fprintf(stderr, "shell322: no current job\n");
+        return best;
+    }
+
+    const char *num = spec[0] == '%' ? spec + 1 : spec;
+    char *end;
+    long n = strtol(num, &end, 10);
+    if (*num == '\0' || *end != '\0' || n < 1 || n > MAX_JOBS ||
+        jobs[n - 1].state == JOB_FREE || jobs[n - 1].state == JOB_DONE) {
+        fprintf(stderr, "shell322: %s: no such job\n", spec);
+        return -1;
+    }
+    return n - 1;
+}
+
+void signal_job(int j, int sig) {
+    /*
+        - Sends sig to every process of job j: to the process group with job control,
+          otherwise to each tracked pid of the job.
+    */
+    if (jobs[j].pgid > 0) {
+        killpg(jobs[j].pgid, sig);
+        return;
+    }
+    for (int i = 0; i < PROC_SLOTS; i++) {
+        if (procs[i].pid > 0 && procs[i].job == j) kill(procs[i].pid, sig);
+    }
+}
+
+int run_builtin_jobs(char **args) {
+    /*
+        - Built-in command handler for 'jobs'.
+        - Lists every background or stopped job with its number, state and command.
+    */
+    (void)args;
+    sigset_t old;
+    block_sigchld(&old);
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &jobs[j];
+        if (job->state == JOB_FREE || job->state == JOB_DONE) continue;
+        out_printf("[%d] %s\t%s\n", j + 1, job->state == JOB_STOPPED ? "Stopped" : "Running", job->command);
+    }
+    unblock_sigchld(&old);
+    return 0;
+}
+
+int run_builtin_fg(char **args) {
+    /*
+        - Built-in command handler for 'fg [%n]'.
+        - Moves the job to the foreground, continues it if stopped, and waits for it.
+        - Returns the job's exit code, or 1 if there is no such job.
+    */
+    sigset_t old;
+    block_sigchld(&old);
+    int status = 1;
+    int j = parse_job_spec(args[1]);
+    if (j >= 0) {
+        out_printf("%s\n", jobs[j].command);
+        out_flush();
+        jobs[j].background = 0;
+        if (jobs[j].state == JOB_STOPPED) {
+            signal_job(j, SIGCONT);
+            jobs[j].state = JOB_RUNNING;
+        }
+        status = wait_for_job(j);
+    }
+    unblock_sigchld(&old);
+    return status;
+}
+
+int run_builtin_bg(char **args) {
+    /*
+        - Built-in command handler for 'bg [%n]'.
+        - Continues a stopped job in the background.
+    */
+    sigset_t old;
+    block_sigchld(&old);
+    int j = parse_job_spec(args[1]);
+    if (j >= 0) {
+        jobs[j].background = 1;
+        if (jobs[j].state == JOB_STOPPED) {
+            signal_job(j, SIGCONT);
+            jobs[j].state = JOB_RUNNING;
+        }
+        out_printf("[%d] %s &\n", j + 1, jobs[j].command);
+    }
+    unblock_sigchld(&old);
+    return j >= 0 ? 0 : 1;
+}
+
+int run_builtin_wait(char **args) {
+    /*
+        - Built-in command handler for 'wait [%n...]'.
+        - Without arguments, waits until every running background job has finished.
+        - Sleeps in event_wait, which reports each job's completion as it is reaped.
+    */
+    sigset_t old;
+    block_sigchld(&old);
+    if (!args[1]) {
+        while (1) {
+            int running = 0;
+            for (int j = 0; j < MAX_JOBS; j++) {
+                if (jobs[j].state == JOB_RUNNING && jobs[j].background) running = 1;
+            }
+            if (!running) break;
+            event_wait();
+        }
+    } else {
+        for (int i = 1; args[i]; i++) {
+            int j = parse_job_spec(args[i]);
+            if (j < 0) continue;
+            while (jobs[j].state == JOB_RUNNING) event_wait();
+        }
+    }
+    unblock_sigchld(&old);
+    return 0;
+}
+
+int signal_number(const char *name) {
+    /*
+        - Maps a signal name ('TERM', 'SIGTERM') or number to its signal number, or -1.
+    */
+    static const struct { const char *name; int sig; } names[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+        {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+    };
+    if (strncmp(name, "SIG", 3) == 0) name += 3;
+
+    char *end;
+    long n = strtol(name, &end, 10);
+    if (*name && *end == '\0') return (n > 0 && n < NSIG) ? (int)n : -1;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i].name, name) == 0) return names[i].sig;
+    }
+    return -1;
+}
+
+int run_builtin_kill(char **args) {
+    /*
+        - Built-in command handler for 'kill [-SIG | -s SIG] %n|pid...'.
+        - Job specifications signal the whole job; plain numbers are passed to kill(2).
+        - A stopped job is also sent SIGCONT so it can act on the signal.
+    */
+    int sig = SIGTERM;
+    int i = 1;
+    if (args[i] && strcmp(args[i], "-s") == 0 && args[i + 1]) {
+        sig = signal_number(args[i + 1]);
+        i += 2;
+    } else if (args[i] && args[i][0] == '-' && args[i][1]) {
+        sig = signal_number(args[i] + 1);
+        i++;
+    }
+    if (sig < 0) {
+        fprintf(stderr, "kill: invalid signal specification\n");
+        return 1;
+    }
+    if (!args[i]) {
+        fprintf(stderr, "kill: usage: kill [-s sig | -sig] %%n | pid ...\n");
+        return 1;
+    }
+
+    int status = 0;
+    sigset_t old;
+    block_sigchld(&old);
+    for (; args[i]; i++) {
+        if (args[i][0] == '%') {
+            int j = parse_job_spec(args[i]);
+            if (j < 0) {
+                status = 1;
+                continue;
+            }
+            signal_job(j, sig);
+            if (jobs[j].state == JOB_STOPPED && sig != SIGCONT) signal_job(j, SIGCONT);
+        } else {
+            char *end;
+            long pid = strtol(args[i], &end, 10);
+            if (*end != '\0' || kill((pid_t)pid, sig) != 0) {
+                fprintf(stderr, "kill: %s: %s\n", args[i], *end ? "arguments must be process or job IDs" : strerror(errno));
+                status = 1;
+            }
+        }
+    }
+    unblock_sigchld(&old);
+    return status;
+}
+
+void init_shell(int interactive) {
+    /*
+        - Sets up job tracking: fills the job free list and installs the SIGCHLD handler.
+        - For an interactive shell, enables job control: the shell ignores terminal job-control
+          signals, runs in its own process group and owns the terminal between jobs.
+    */
+    for (int j = MAX_JOBS - 1; j >= 0; j--) {
+        job_free_list[job_free_top++] = j;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (interactive) {
+        // Wait until we are in the foreground before taking over the terminal
+        while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+            kill(-shell_pgid, SIGTTIN);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        shell_pgid = getpid();
+        if (setpgid(shell_pgid, shell_pgid) < 0 && errno != EPERM) {
+            perror("setpgid");
+        }
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        job_control = 1;
+    }
+    sigprocmask(SIG_SETMASK, NULL, &shell_sigmask);
+}
+
+void redirect_close(const struct node *cmd, const int *src, int count) {
+    /*
+        - Closes the files opened by redirect_open for the first count redirections.
+    */
+    for (int i = 0; i < count; i++) {
+        if (cmd->redirects[i].type != REDIR_DUP && src[i] >= 0) close(src[i]);
+    }
+}
+
+int redirect_open(const struct node *cmd, int *src) {
+    /*
+        - Resolves the redirections of a command to source descriptors, before anything is started.
+        - Files are opened here in the shell with O_CLOEXEC and moved to fd 10 or above, so a
+          child only ever sees them through the dup2 made for it and they cannot clash with the
+          low descriptors being redirected. For REDIR_DUP, src[i] is the descriptor number.
+        - Returns 0, or -1 (after printing an error and closing what was opened) if a file
+          cannot be opened.
+    */
+    for (int i = 0; i < cmd->nredirects; i++) {
+        const struct redirect *r = &cmd->redirects[i];
+        if (r->type == REDIR_DUP) {
+            src[i] = atoi(r->target);
+            continue;
+        }
+        int flags = r->type == REDIR_IN ? O_RDONLY :
+                    r->type == REDIR_APPEND ? O_WRONLY | O_CREAT | O_APPEND : O_WRONLY | O_CREAT | O_TRUNC;
+        int fd = open(r->target, flags | O_CLOEXEC, 0666);
+        if (fd >= 0 && fd < 10) {
+            int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            close(fd);
+            fd = high;
+        }
+        if (fd < 0) {
+            fprintf(stderr, "shell322: %s: %s\n", r->target, strerror(errno));
+            src[i] = -1;
+            redirect_close(cmd, src, i);
+            return -1;
+        }
+        src[i] = fd;
+    }
+    return 0;
+}
+
+void spawn_fds_add(struct spawn_fds *fds, int src, int dst) {
+    /*
+        - Appends dup2(src, dst) to a child's descriptor setup; the array lives in line_arena.
+    */
+    if (fds->count == fds->cap) {
+        int cap = fds->cap ? fds->cap * 2 : 8;
+        fds->dup = arena_grow(&line_arena, fds->dup, fds->cap * sizeof(*fds->dup), cap * sizeof(*fds->dup));
+        fds->cap = cap;
+    }
+    fds->dup[fds->count][0] = src;
+    fds->dup[fds->count][1] = dst;
+    fds->count++;
+}
+
+void redirect_actions(struct spawn_fds *fds, const struct node *cmd, const int *src) {
+    /*
+        - Adds one dup2 per redirection, in order, so '2>&1 > file' and '> file 2>&1'
+          behave as in sh. Pipe dup2s are added before, so redirections win.
+    */
+    for (int i = 0; i < cmd->nredirects; i++) {
+        spawn_fds_add(fds, src[i], cmd->redirects[i].fd);
+    }
+}
+
+void redirect_restore(const struct node *cmd, int *saved, int count) {
+    /*
+        - Undoes the first count redirections made by redirect_apply, last one first.
+    */
+    out_flush();
+    fflush(stderr);
+    for (int i = count - 1; i >= 0; i--) {
+        int fd = cmd->redirects[i].fd;
+        if (saved[i] >= 0) {
+            dup2(saved[i], fd);
+            close(saved[i]);
+        } else {
+            close(fd);
+        }
+    }
+}
+
+int redirect_apply(const struct node *cmd, const int *src, int *saved) {
+    /*
+        - Applies the redirections to the current process with dup2, in order.
+        - If saved is not NULL, the previous descriptors are first kept there as O_CLOEXEC
+          copies (-1 if one was closed) so redirect_restore can undo them; in-process builtins
+          need this, forked children do not.
+        - Returns 0, or -1 (after printing an error) if a dup2 failed, e.g. because '>&n'
+          names a descriptor that is not open.
+    */
+    out_flush();
+    fflush(stderr);
+    for (int i = 0; i < cmd->nredirects; i++) {
+        int fd = cmd->redirects[i].fd;
+        if (saved) saved[i] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        if (dup2(src[i], fd) < 0) {
+            fprintf(stderr, "shell322: %d: %s\n", src[i], strerror(errno));
+            if (saved) redirect_restore(cmd, saved, i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+char **script_argv(const char *path, char **args) {
+    /*
+        - Returns the argv that runs path as a shell script, 'sh path args[1]...', in
+          line_arena: a file the kernel rejects with ENOEXEC (no '#!' line) is run by
+          /bin/sh, as execvp does.
+    */
+    int argc = 0;
+    while (args[argc]) argc++;
+    char **argv = arena_alloc(&line_arena, (argc + 2) * sizeof(char *));
+    argv[0] = "sh";
+    argv[1] = (char *)path;
+    for (int i = 1; i <= argc; i++) argv[i + 1] = args[i];
+    return argv;
+}
+
+int spawn_server_start() {
+    /*
+        - Starts the spawn server: the shell binary re-executed from /proc/self/exe with
+          '--spawn-server', so it has a fresh, minimal address space and none of the shell's
+          mappings (history, trace ring, caches).
+        - It talks to the shell over a SOCK_SEQPACKET socket pair, one message per request,
+          passed to it as fd 3. Returns 0, or -1 (after printing an error).
+    */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("spawn server: socketpair");
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], 3);
+    char *args[] = { "shell322", "--spawn-server", "3", NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, "/proc/self/exe", &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+    if (err != 0) {
+        fprintf(stderr, "spawn server: %s\n", strerror(err));
+        close(sv[0]);
+        return -1;
+    }
+    spawn_server_fd = sv[0];
+    spawn_server_pid = pid;
+    return 0;
+}
+
+void spawn_server_stop() {
+    /*
+        - Closes the socket; the server sees EOF and exits (the SIGCHLD handler reaps it).
+    */
+    if (spawn_server_fd >= 0) close(spawn_server_fd);
+    spawn_server_fd = -1;
+    spawn_server_pid = -1;
+}
+
+int spawn_via_server(pid_t *pid, const char *path, char **args, char **envp,
+                     const struct spawn_fds *fds, int job) {
+    /*
+        - Asks the spawn server to start path as a member of job. The server clones the child
+          with CLONE_PARENT, so it is still the shell's child and reaped by the job table.
+        - Sends the shell's stdin/stdout/stderr and every open source descriptor of fds with
+          SCM_RIGHTS, plus their numbers, so the child can rebuild the same numbering and then
+          run the dup2 list exactly like posix_spawn would.
+        - The shell's working directory goes last in the same set as an O_PATH descriptor, and
+          the umask in the request, since the server itself never follows 'cd'.
+        - Returns 0 or the errno of a failed exec, or -1 if the request cannot go through the
+          server (too many descriptors, too large, or the server is gone; it is then stopped)
+          and the caller should spawn directly.
+    */
+    struct spawn_request req;
+    memset(&req, 0, sizeof(req));
+    req.setpgroup = job_control;
+    req.pgid = jobs[job].pgid;
+    req.take_tty = job_control && !jobs[job].background && jobs[job].pgid == 0;
+    req.mask = shell_sigmask;
+    req.umask = umask(0);
+    umask(req.umask);
+    if (fds && fds->count > SPAWN_MAX_FDS) return -1;
+
+    int passed[SPAWN_MAX_FDS + 1];
+    for (int fd = 0; fd < 3; fd++) {
+        if (fcntl(fd, F_GETFD) >= 0) req.fd_numbers[req.nfds++] = fd;
+    }
+    for (int i = 0; fds && i < fds->count; i++) {
+        int src = fds->dup[i][0];
+        int seen = 0;
+        for (int k = 0; k < req.nfds; k++) seen |= req.fd_numbers[k] == src;
+        if (!seen && fcntl(src, F_GETFD) >= 0) {
+            if (req.nfds == SPAWN_MAX_FDS) return -1;
+            req.fd_numbers[req.nfds++] = src;
+        }
+        req.dups[i][0] = src;
+        req.dups[i][1] = fds->dup[i][1];
+        req.ndups++;
+    }
+    for (int k = 0; k < req.nfds; k++) passed[k] = req.fd_numbers[k];
+
+    // Strings: path, then argv, then the environment, each NUL-terminated
+    size_t len = strlen(path) + 1;
+    for (req.argc = 0; args[req.argc]; req.argc++) len += strlen(args[req.argc]) + 1;
+    for (req.envc = 0; envp[req.envc]; req.envc++) len += strlen(envp[req.envc]) + 1;
+    if (len > SPAWN_MSG_MAX) return -1;
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) return -1;
+    passed[req.nfds] = cwd;
+    char *strings = arena_alloc(&line_arena, len);
+    char *w = strings;
+    w = stpcpy(w, path) + 1;
+    for (int i = 0; i < req.argc; i++) w = stpcpy(w, args[i]) + 1;
+    for (int i = 0; i < req.envc; i++) w = stpcpy(w, envp[i]) + 1;
+
+    struct iovec iov[2] = { { &req, sizeof(req) }, { strings, len } };
+    union {
+        char buf[CMSG_SPACE(sizeof(passed))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE((req.nfds + 1) * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((req.nfds + 1) * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), passed, (req.nfds + 1) * sizeof(int));
+
+    struct spawn_reply reply;
+    ssize_t n;
+    while ((n = sendmsg(spawn_server_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+    close(cwd);
+    if (n < 0) {
+        if (errno == EMSGSIZE) return -1;
+        spawn_server_stop();
+        return -1;
+    }
+    while ((n = recv(spawn_server_fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) {}
+    if (n != (ssize_t)sizeof(reply)) {
+        spawn_server_stop();
+        return -1;
+    }
+    if (reply.err == 0) *pid = reply.pid;
+    return reply.err;
+}
+
+int spawn_server(int sock) {
+    /*
+        - Main loop of the spawn server process ('shell322 --spawn-server FD').
+        - For every request: receives the descriptors, clones a child with CLONE_PARENT (so the
+          shell is its parent), and in the child moves to the shell's working directory and
+          umask, rebuilds the shell's descriptor numbering, applies the dup2 list, joins the
+          process group, and execs with the shell's mask and default job-control signals.
+        - The exec result comes back over a CLOEXEC pipe: EOF means the exec succeeded. A file
+          without a '#!' line is run by /bin/sh.
+        - Exits when the shell closes its end of the socket.
+    */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    char *strings = malloc(SPAWN_MSG_MAX);
+    if (!strings) return 1;
+
+    while (1) {
+        struct spawn_request req;
+        struct iovec iov[2] = { { &req, sizeof(req) }, { strings, SPAWN_MSG_MAX } };
+        union {
+            char buf[CMSG_SPACE((SPAWN_MAX_FDS + 1) * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        int received[SPAWN_MAX_FDS + 1];
+        int nreceived = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+            nreceived = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(received, CMSG_DATA(cmsg), nreceived * sizeof(int));
+        }
+
+        char *argv[req.argc + 1], *envp[req.envc + 1];
+        char *path = strings;
+        char *r = path + strlen(path) + 1;
+        for (int i = 0; i < req.argc; i++, r += strlen(r) + 1) argv[i] = r;
+        for (int i = 0; i < req.envc; i++, r += strlen(r) + 1) envp[i] = r;
+        argv[req.argc] = NULL;
+        envp[req.envc] = NULL;
+
+        struct spawn_reply reply = { 0, 0 };
+        int status_pipe[2];
+        if (pipe2(status_pipe, O_CLOEXEC) < 0) {
+            reply.err = errno;
+        } else {
+            pid_t child = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+            if (child == 0) {
+                close(status_pipe[0]);
+                close(sock);
+                if (req.setpgroup) {
+                    setpgid(0, req.pgid);
+                    if (req.take_tty) tcsetpgrp(STDIN_FILENO, getpid());
+                }
+                int defaults[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+                for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) signal(defaults[i], SIG_DFL);
+                sigprocmask(SIG_SETMASK, &req.mask, NULL);
+
+                // Move the status pipe and the received descriptors above every number in use,
+                // so installing the shell's numbers cannot overwrite them
+                int base = status_pipe[1] + 1;
+                for (int i = 0; i < req.nfds; i++) if (req.fd_numbers[i] >= base) base = req.fd_numbers[i] + 1;
+                for (int i = 0; i < req.ndups; i++) if (req.dups[i][1] >= base) base = req.dups[i][1] + 1;
+                int status_fd = fcntl(status_pipe[1], F_DUPFD_CLOEXEC, base);
+                close(status_pipe[1]);
+                base = status_fd + 1;
+                for (int i = 0; i < nreceived; i++) {
+                    int high = fcntl(received[i], F_DUPFD_CLOEXEC, base);
+                    close(received[i]);
+                    received[i] = high;
+                }
+                if (nreceived > req.nfds) {
+                    if (fchdir(received[req.nfds]) < 0) {
+                        int err = errno;
+                        if (write(status_fd, &err, sizeof(err)) < 0) {}
+                        _exit(127);
+                    }
+                    close(received[req.nfds]);
+                }
+                umask(req.umask);
+                for (int i = 0; i < nreceived && i < req.nfds; i++) {
+                    dup3(received[i], req.fd_numbers[i], O_CLOEXEC);
+                    close(received[i]);
+                }
+                for (int i = 0; i < req.ndups; i++) {
+                    if (req.dups[i][0] != req.dups[i][1]) dup2(req.dups[i][0], req.dups[i][1]);
+                    fcntl(req.dups[i][1], F_SETFD, 0);
+                }
+                for (int fd = 0; fd < 3; fd++) fcntl(fd, F_SETFD, 0);
+
+                execve(path, argv, envp);
+                if (errno == ENOEXEC) execve("/bin/sh", script_argv(path, argv), envp);
+                int err = errno;
+                if (write(status_fd, &err, sizeof(err)) < 0) {}
+                _exit(127);
+            }
+            close(status_pipe[1]);
+            if (child < 0) {
+                reply.err = errno;
+            } else {
+                reply.pid = child;
+                int err;
+                ssize_t got;
+                while ((got = read(status_pipe[0], &err, sizeof(err))) < 0 && errno == EINTR) {}
+                if (got == (ssize_t)sizeof(err)) reply.err = err;
+            }
+            close(status_pipe[0]);
+        }
+        for (int i = 0; i < nreceived; i++) close(received[i]);
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) break;
+    }
+    free(strings);
+    return 0;
+}
+
+int write_control_file(const char *dir, const char *name, const char *text) {
+    /*
+        - Writes text to the control file name in the directory dir (cgroupfs, sysfs);
+          returns 0 or -1.
+    */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, text, strlen(text));
+    close(fd);
+    return n == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+int parse_cpu_list(const char *text, cpu_set_t *set) {
+    /*
+        - Parses a CPU list as the kernel prints it ('0-3,8,10-11') into set.
+        - Returns 0, or -1 if text is not a CPU list.
+    */
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p && *p != '\n') {
+        char *end;
+        long from = strtol(p, &end, 10), to = from;
+        if (end == p || from < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if (end == p || to < from) return -1;
+        }
+        for (long c = from; c <= to && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+        if (*end && *end != ',' && *end != '\n') return -1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
+
+int read_control_file(const char *dir, const char *name, char *buf, size_t size) {
+    /*
+        - Reads the control file name in the directory dir (cgroupfs, sysfs) into buf,
+          NUL-terminated; returns 0 or -1.
+    */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+long cgroup_stat(const char *text, const char *key) {
+    /*
+        - Returns the value of 'key N' in a flat-keyed control file (cpu.stat, memory.events),
+          or -1 if it is not there.
+    */
+    size_t len = strlen(key);
+    for (const char *line = text; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, key, len) == 0 && line[len] == ' ') return strtol(line + len + 1, NULL, 10);
+    }
+    return -1;
+}
+
+int cgroup_has_controller(const char *dir, const char *controller) {
+    char list[512];
+    if (read_control_file(dir, "cgroup.controllers", list, sizeof(list)) < 0) return 0;
+    size_t len = strlen(controller);
+    for (char *w = strtok(list, " \n"); w; w = strtok(NULL, " \n")) {
+        if (strlen(w) == len && strcmp(w, controller) == 0) return 1;
+    }
+    return 0;
+}
+
+int limit_cgroup_create(struct limit_state *s) {
+    /*
+        - Creates a transient cgroup v2 group for the limit below $SHELL322_CGROUP (a delegated
+          directory), or else below the shell's own group, and writes cpu.max and memory.max.
+        - Enables the cpu and memory controllers in the parent's subtree_control if they are
+          not yet available to the new group.
+        - Returns 0, or -1 with nothing left behind if the controllers cannot be had (no cgroup
+          v2, no permission, or a parent that holds processes itself).
+    */
+    static unsigned long limit_seq = 0;
+    const struct job_limits *l = s->limits;
+    char base[PATH_MAX - 64];
+    const char *root = var_get("SHELL322_CGROUP");
+    if (root) {
+        snprintf(base, sizeof(base), "%s", root);
+    } else {
+        // Mount point of the cgroup2 hierarchy, plus the shell's own path in it
+        char mount_point[PATH_MAX] = "", own[PATH_MAX] = "";
+        FILE *f = fopen("/proc/self/mounts", "re");
+        char line[1024];
+        while (f && fgets(line, sizeof(line), f)) {
+            char dev[256], dir[PATH_MAX], type[64];
+            if (sscanf(line, "%255s %4095s %63s", dev, dir, type) == 3 && strcmp(type, "cgroup2") == 0) {
+                snprintf(mount_point, sizeof(mount_point), "%s", dir);
+                break;
+            }
+        }
+        if (f) fclose(f);
+        f = fopen("/proc/self/cgroup", "re");
+        while (f && fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(own, sizeof(own), "%s", line + 3);
+            }
+        }
+        if (f) fclose(f);
+        if (!mount_point[0] || !own[0]) return -1;
+        if (snprintf(base, sizeof(base), "%s%s", mount_point, strcmp(own, "/") == 0 ? "" : own) >= (int)sizeof(base)) {
+            return -1;
+        }
+    }
+
+    snprintf(s->cgroup, sizeof(s->cgroup), "%s/shell322-%d-%lu", base, (int)getpid(), ++limit_seq);
+    if (mkdir(s->cgroup, 0755) < 0) {
+        s->cgroup[0] = '\0';
+        return -1;
+    }
+    const char *needed[] = { l->cpu_milli ? "cpu" : NULL, l->mem ? "memory" : NULL };
+    int ok = 1;
+    for (int i = 0; i < 2 && ok; i++) {
+        if (!needed[i] || cgroup_has_controller(s->cgroup, needed[i])) continue;
+        char enable[32];
+        snprintf(enable, sizeof(enable), "+%s", needed[i]);
+        ok = write_control_file(base, "cgroup.subtree_control", enable) == 0 && cgroup_has_controller(s->cgroup, needed[i]);
+    }
+    char value[64];
+    if (ok && l->cpu_milli) {
+        snprintf(value, sizeof(value), "%ld 100000", l->cpu_milli * 100);  // quota per 100ms period
+        ok = write_control_file(s->cgroup, "cpu.max", value) == 0;
+    }
+    if (ok && l->mem) {
+        snprintf(value, sizeof(value), "%ld", l->mem);
+        ok = write_control_file(s->cgroup, "memory.max", value) == 0;
+    }
+    if (ok) {
+        char procs[PATH_MAX + 16];
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", s->cgroup);
+        s->procs_fd = open(procs, O_WRONLY | O_CLOEXEC);
+        ok = s->procs_fd >= 0;
+    }
+    if (!ok) {
+        rmdir(s->cgroup);
+        s->cgroup[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+void limit_apply(const struct limit_state *s) {
+    /*
+        - Runs in a child between fork and exec: joins the limit's cgroup, or without one caps
+          the address space with RLIMIT_AS, then sets affinity and the nice value.
+    */
+    const struct job_limits *l = s->limits;
+    if (s->procs_fd >= 0 && write(s->procs_fd, "0", 1) < 0) {}  // "0" moves the writer itself
+    if (l->mem && s->procs_fd < 0) {
+        struct rlimit r = { (rlim_t)l->mem, (rlim_t)l->mem };
+        setrlimit(RLIMIT_AS, &r);
+    }
+    if (s->set_cpus) sched_setaffinity(0, sizeof(s->cpus), &s->cpus);
+    if (l->set_nice) setpriority(PRIO_PROCESS, 0, getpriority(PRIO_PROCESS, 0) + l->nice);
+}
+
+int spawn_limited(pid_t *pid, const char *path, char **args, char **envp, const struct spawn_fds *fds, int job) {
+    /*
+        - Starts a process under the active 'limit': forks, applies the limit in the child
+          and then does what posix_spawn would (process group, terminal, signals, descriptors)
+          before exec'ing, so the program never runs outside the limit.
+        - The exec result comes back over a CLOEXEC pipe as in the spawn server. Returns 0 or
+          an errno value.
+    */
+    int status_pipe[2];
+    if (pipe2(status_pipe, O_CLOEXEC) < 0) return errno;
+    pid_t child = fork();
+    if (child == 0) {
+        close(status_pipe[0]);
+        limit_apply(active_limit);
+        if (job_control) {
+            setpgid(0, jobs[job].pgid);
+            if (!jobs[job].background && jobs[job].pgid == 0) tcsetpgrp(STDIN_FILENO, getpid());
+        }
+        int defaults[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+        for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) signal(defaults[i], SIG_DFL);
+        sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+        // Move the status pipe above every target, so an explicit 'N>file' cannot overwrite it
+        int base = status_pipe[1] + 1;
+        for (int i = 0; fds && i < fds->count; i++) if (fds->dup[i][1] >= base) base = fds->dup[i][1] + 1;
+        int status_fd = fcntl(status_pipe[1], F_DUPFD_CLOEXEC, base);
+        close(status_pipe[1]);
+        for (int i = 0; fds && i < fds->count; i++) {
+            if (fds->dup[i][0] != fds->dup[i][1]) dup2(fds->dup[i][0], fds->dup[i][1]);
+            else fcntl(fds->dup[i][1], F_SETFD, 0);
+        }
+        execve(path, args, envp);
+        if (errno == ENOEXEC) execve("/bin/sh", script_argv(path, args), envp);
+        int err = errno;
+        if (write(status_fd, &err, sizeof(err)) < 0) {}
+        _exit(127);
+    }
+    close(status_pipe[1]);
+    int err = 0;
+    if (child < 0) {
+        err = errno;
+    } else {
+        ssize_t got;
+        while ((got = read(status_pipe[0], &err, sizeof(err))) < 0 && errno == EINTR) {}
+        if (got != (ssize_t)sizeof(err)) err = 0;
+        if (err) waitpid(child, NULL, 0);  // Failed exec: reap it here, it is in no job
+        else *pid = child;
+    }
+    close(status_pipe[0]);
+    return err;
+}
+
+void topology_add(cpu_set_t **groups, int *count, const cpu_set_t *set) {
+    /*
+        - Adds set to a list of CPU groups unless it is empty or already there.
+    */
+    if (CPU_COUNT(set) == 0) return;
+    for (int i = 0; i < *count; i++) {
+        if (CPU_EQUAL(&(*groups)[i], set)) return;
+    }
+    *groups = realloc(*groups, (*count + 1) * sizeof(cpu_set_t));
+    (*groups)[(*count)++] = *set;
+}
+
+void topology_load() {
+    /*
+        - Reads the CPU topology from /sys/devices/system/cpu, once: for every CPU the shell may
+          run on, the CPUs sharing its last-level cache (the cache index with the highest
+          level, L3 or else L2) and its NUMA node (the cpuN/nodeM link).
+        - Groups are limited to the shell's own affinity, so they never name CPUs a stage
+          could not be moved to.
+    */
+    if (topology.loaded) return;
+    topology.loaded = 1;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return;
+
+    int nnodes = 0;
+    cpu_set_t *nodes = NULL;  // Indexed by node id; empty ones are dropped at the end
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        char dir[96], text[256];
+        int best_level = -1;
+        cpu_set_t shared;
+        for (int k = 0;; k++) {
+            snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d/cache/index%d", c, k);
+            if (read_control_file(dir, "level", text, sizeof(text)) < 0) break;
+            int level = atoi(text);
+            cpu_set_t set;
+            if (level > best_level && read_control_file(dir, "shared_cpu_list", text, sizeof(text)) == 0 &&
+                parse_cpu_list(text, &set) == 0) {
+                best_level = level;
+                CPU_AND(&shared, &set, &allowed);
+            }
+        }
+        if (best_level >= 0) topology_add(&topology.cache, &topology.ncache, &shared);
+
+        snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d", c);
+        DIR *d = opendir(dir);
+        struct dirent *e;
+        while (d && (e = readdir(d))) {
+            if (strncmp(e->d_name, "node", 4) != 0 || !isdigit((unsigned char)e->d_name[4])) continue;
+            int node = atoi(e->d_name + 4);
+            if (node >= nnodes) {
+                nodes = realloc(nodes, (node + 1) * sizeof(cpu_set_t));
+                for (int n = nnodes; n <= node; n++) CPU_ZERO(&nodes[n]);
+                nnodes = node + 1;
+            }
+            CPU_SET(c, &nodes[node]);
+        }
+        if (d) closedir(d);
+    }
+    for (int n = 0; n < nnodes; n++) topology_add(&topology.node, &topology.nnode, &nodes[n]);
+    free(nodes);
+}
+
+void place_begin() {
+    /*
+        - Starts placing the stages of a pipeline under 'set -o pipeplace': the stages go to
+          one cache (or node) group in order, and only move on to the next group once every
+          CPU of the current one has a stage, so neighbours in the pipeline share a cache.
+        - Each pipeline starts on the group after the previous one's, which spreads
+          concurrent pipelines over the machine. Nothing is done with a single group.
+    */
+    if (opt_pipe_place == PLACE_OFF) return;
+    topology_load();
+    int ngroups = opt_pipe_place == PLACE_CACHE ? topology.ncache : topology.nnode;
+    if (ngroups < 2 || sched_getaffinity(0, sizeof(placement.saved), &placement.saved) < 0) return;
+    placement.active = 1;
+    placement.group = placement.next_start++ % ngroups;
+    placement.used = 0;
+}
+
+const cpu_set_t *place_stage() {
+    /*
+        - Returns the CPU group of the next stage, or NULL if stages are not being placed, and
+          moves the shell itself onto it, so the stage inherits it through posix_spawn or fork
+          and never runs elsewhere.
+    */
+    if (!placement.active) return NULL;
+    int ngroups = opt_pipe_place == PLACE_CACHE ? topology.ncache : topology.nnode;
+    cpu_set_t *groups = opt_pipe_place == PLACE_CACHE ? topology.cache : topology.node;
+    if (placement.used >= CPU_COUNT(&groups[placement.group])) {
+        placement.group = (placement.group + 1) % ngroups;
+        placement.used = 0;
+    }
+    placement.used++;
+    const cpu_set_t *set = &groups[placement.group];
+    sched_setaffinity(0, sizeof(*set), set);
+    return set;
+}
+
+void place_end() {
+    /*
+        - Gives the shell back the affinity it had before the pipeline.
+    */
+    if (!placement.active) return;
+    sched_setaffinity(0, sizeof(placement.saved), &placement.saved);
+    placement.active = 0;
+}
+
+int spawn_command(pid_t *pid, char **args, const struct spawn_fds *fds, int job) {
+    /*
+        - Starts args[0] on its cached absolute path as a member of job, with fds applied and
+          the environment from env_build.
+        - With 'set -o spawnserver' the spawn server does the clone and exec; if it cannot
+          take the request, or is off, posix_spawn is used directly. Under 'limit',
+          spawn_limited forks and applies the limit before exec instead.
+        - With job control, the first process creates the job's process group and the others
+          join it; a foreground job is also handed the terminal before exec where supported.
+        - Resets the signals the interactive shell ignores and clears the blocked mask
+          (the caller holds SIGCHLD blocked) so the child starts with default dispositions.
+        - If the cached file has disappeared, forgets it and searches PATH once more.
+        - A file without a '#!' line (ENOEXEC) is run by /bin/sh, as with execvp.
+        - On success the process is added to the job. Returns 0 or an errno value, like posix_spawn.
+        - Pending shell output is flushed first, so it comes before anything the child prints.
+    */
+    out_flush();
+    const char *path = lookup_command(args[0]);
+    if (!path) return ENOENT;
+    char **envp = env_build();
+
+    uint64_t trace_start = trace_now();
+    int err = active_limit ? spawn_limited(pid, path, args, envp, fds, job)
+            : spawn_server_fd >= 0 ? spawn_via_server(pid, path, args, envp, fds, job) : -1;
+    if (err == ENOENT && !strchr(args[0], '/')) {
+        // Stale cache entry: the binary moved or was removed since it was hashed
+        hash_forget(args[0]);
+        path = lookup_command(args[0]);
+        err = !path ? ENOENT : active_limit ? spawn_limited(pid, path, args, envp, fds, job)
+                                            : spawn_via_server(pid, path, args, envp, fds, job);
+    }
+
+    if (err < 0) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        for (int i = 0; fds && i < fds->count; i++) {
+            posix_spawn_file_actions_adddup2(&actions, fds->dup[i][0], fds->dup[i][1]);
+        }
+
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGQUIT);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTIN);
+        sigaddset(&defaults, SIGTTOU);
+        sigaddset(&defaults, SIGCHLD);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setsigmask(&attr, &shell_sigmask);
+
+        if (job_control) {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attr, jobs[job].pgid);  // 0 creates a new group
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+            if (!jobs[job].background && jobs[job].pgid == 0) {
+                // Give the terminal to the new group before exec, so an early tty read cannot SIGTTIN it
+                posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+            }
+#endif
+        }
+        posix_spawnattr_setflags(&attr, flags);
+
+        err = posix_spawn(pid, path, &actions, &attr, args, envp);
+        if (err == ENOENT && !strchr(args[0], '/')) {
+            hash_forget(args[0]);
+            path = lookup_command(args[0]);
+            err = path ? posix_spawn(pid, path, &actions, &attr, args, envp) : ENOENT;
+        }
+        if (err == ENOEXEC) err = posix_spawn(pid, "/bin/sh", &actions, &attr, script_argv(path, args), envp);
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    // posix_spawn returns once the child has exec'd, so this span covers fork + exec
+    trace_record(TRACE_SPAWN, trace_start, 0, err == 0 ? *pid : -err, args[0]);
+
+    if (err == 0 && job_add_process(job, *pid, args[0]) < 0) err = EAGAIN;
+    return err;
+}
+
+int run_builtin_cd(char **args) {
+    /*
+        - Built-in command handler for 'cd'.
+        - Changes the current working directory to the directory specified in args[1].
+        - If no argument is provided, changes to the HOME directory.
+        - On success, updates the PWD environment variable to the new directory.
+        - On failure, prints an error message using perror.
+    */
+    char *target = args[1];
+    if (!target) {
+        target = (char *)var_get("HOME");  // Default to HOME if no argument
+    }
+
+    if (chdir(target) != 0) {
+        perror("cd error");  // Print error if chdir fails
+        return 1;
+    } else {
+        // Update PWD environment variable to reflect current directory
+        char cwd[1024];
+        if (getcwd(cwd, sizeof(cwd))) {
+            var_set("PWD", cwd, 1);
+        }
+    }
+    return 0;
+}
+
+int run_builtin_pwd(char **args) {
+    /*
+        - Built-in command handler for 'pwd'.
+        - Retrieves and prints the current working directory.
+        - Uses getcwd system call; on failure, prints an error message.
+    */
+    (void)args;
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        out_printf("%s\n", cwd);
+    } else {
+        perror("pwd error");
+        return 1;
+    }
+    return 0;
+}
+
+int start_command(char **args, const char *label, int background, const struct spawn_fds *fds) {
+    /*
+        - Starts args as a new job labeled label without waiting for it; the caller must hold
+          SIGCHLD blocked.
+        - fds, if not NULL, holds the descriptor setup of the command (captured output,
+          redirections).
+        - Prints an error message if the command is not found or cannot be started.
+        - Returns the job slot, or -1 if nothing was started.
+    */
+    int j = job_alloc(label, background);
+    if (j < 0) return -1;
+
+    pid_t pid;
+    int err = spawn_command(&pid, args, fds, j);
+    if (err != 0) {
+        if (err == ENOENT) {
+            fprintf(stderr, "%s: command not found\n", args[0]);
+        } else {
+            fprintf(stderr, "exec error: %s: %s\n", args[0], strerror(err));
+        }
+        job_free(j);
+        return -1;
+    }
+    return j;
+}
+
+void copy_to_stdout(int fd) {
+    /*
+        - Writes the whole content of a capture file to stdout, using sendfile so the
+          bytes never pass through user space.
+        - Flushes the output buffer first so builtin output stays in order.
+    */
+    out_flush();
+    off_t offset = 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+
+    while (offset < st.st_size) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, st.st_size - offset);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+
+        // sendfile unsupported for this stdout: fall back to read/write
+        char buf[65536];
+        ssize_t r;
+        while ((r = pread(fd, buf, sizeof(buf), offset)) > 0) {
+            if (write(STDOUT_FILENO, buf, r) != r) return;
+            offset += r;
+        }
+        return;
+    }
+}
+
+int run_external(char **args) {
+    /*
+        - Runs args from PATH as a foreground job of its own, bypassing the builtin table, and
+          returns its exit status; used by utility builtins for the cases they leave to the
+          real program.
+    */
+    out_flush();
+    sigset_t old;
+    block_sigchld(&old);
+    int j = start_command(args, current_command, 0, NULL);
+    int code = j < 0 ? 127 : wait_for_job(j);
+    unblock_sigchld(&old);
+    return code;
+}
+
+int flush_output(const char *name) {
+    /*
+        - Flushes the buffered output of a utility builtin.
+        - Returns 0, or prints a write error for name and returns 1.
+    */
+    if (out_flush() == 0) return 0;
+    fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+    clearerr(stdout);
+    return 1;
+}
+
+const char *put_escape(const char *p, int zero_octal, int *stop) {
+    /*
+        - Prints the backslash escape starting at p (the character after the backslash) and
+          returns the position after it.
+        - Octal escapes are \0NNN when zero_octal is set (echo -e, printf %b) and \NNN
+          otherwise (printf formats). \c sets *stop, which ends all output of the command.
+        - An unknown escape prints the backslash and leaves the character to the caller.
+    */
+    static const char plain[] = "abfnrtv\\";
+    static const char codes[] = "\a\b\f\n\r\t\v\\";
+    const char *c = *p ? strchr(plain, *p) : NULL;
+    if (c) {
+        putchar(codes[c - plain]);
+        return p + 1;
+    }
+    if (*p == 'c') {
+        *stop = 1;
+        return p + 1;
+    }
+
+    int value = 0, digits = 0;
+    if (*p == 'x' && isxdigit((unsigned char)p[1])) {
+        for (p++; digits < 2 && isxdigit((unsigned char)*p); p++, digits++) {
+            value = value * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+        }
+        putchar(value);
+        return p;
+    }
+    if (zero_octal ? *p == '0' : (*p >= '0' && *p <= '7')) {
+        if (zero_octal) p++;
+        for (; digits < 3 && *p >= '0' && *p <= '7'; p++, digits++) value = value * 8 + (*p - '0');
+        putchar(value);
+        return p;
+    }
+    putchar('\\');
+    return p;
+}
+
+int run_builtin_echo(char **args) {
+    /*
+        - Built-in version of echo(1), with the options of the coreutils program: -n drops the
+          trailing newline, -e interprets backslash escapes, -E turns them off again.
+        - An argument is an option only if it consists of those letters ('-nE'); anything
+          else, '-' included, is printed.
+    */
+    int newline = 1, escapes = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *o = args[i] + 1;
+        if (o[strspn(o, "neE")] != '\0') break;
+        for (; *o; o++) {
+            if (*o == 'n') newline = 0;
+            else escapes = *o == 'e';
+        }
+    }
+
+    for (int first = i; args[i]; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) {
+            fputs(args[i], stdout);
+            continue;
+        }
+        const char *p = args[i];
+        int stop = 0;
+        while (*p && !stop) {
+            if (*p == '\\') p = put_escape(p + 1, 1, &stop);
+            else putchar(*p++);
+        }
+        if (stop) return flush_output("echo");
+    }
+    if (newline) putchar('\n');
+    return flush_output("echo");
+}
+
+int printf_number(const char *arg, intmax_t *value) {
+    /*
+        - Converts a printf argument to a number: decimal, 0x hex or 0 octal, or the code of the
+          character after a leading quote ('A).
+        - Returns 0, or prints an error and returns 1 (the value is then what could be read).
+    */
+    if (!arg) {
+        *value = 0;
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char)arg[1];
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoimax(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        return 1;
+    }
+    return 0;
+}
+
+int run_builtin_printf(char **args) {
+    /*
+        - Built-in version of printf(1): 'printf FORMAT [ARG...]'.
+        - FORMAT takes backslash escapes and the conversions %d %i %o %u %x %X %c %s %b %f %e
+          %E %g %G %a %A with flags, width and precision ('*' reads them from the next
+          argument). %b prints its argument with echo -e escapes.
+        - The format is reused while arguments remain; missing arguments count as '' or 0.
+        - Returns 1 if an argument was not a valid number, 2 on a bad format.
+    */
+    int a = 1;
+    if (args[a] && strcmp(args[a], "--") == 0) a++;
+    const char *format = args[a];
+    if (!format) {
+        fprintf(stderr, "printf: usage: printf FORMAT [ARG...]\n");
+        return 2;
+    }
+    char **argp = &args[a + 1];
+    int status = 0, stop = 0;
+
+    do {
+        char **round = argp;
+        const char *p = format;
+        while (*p && !stop) {
+            if (*p == '\\') {
+                p = put_escape(p + 1, 0, &stop);
+                continue;
+            }
+            if (*p != '%' || p[1] == '%') {
+                putchar(*p);
+                p += *p == '%' ? 2 : 1;
+                continue;
+            }
+
+            // Copy flags, width and precision into spec, resolving '*' from the arguments
+            char spec[96];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p && strchr("-+ #0", *p) && n < 16) spec[n++] = *p++;
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*p != '.') break;
+                    spec[n++] = *p++;
+                }
+                if (*p == '*') {
+                    intmax_t v;
+                    status |= printf_number(*argp, &v);
+                    if (*argp) argp++;
+                    n += snprintf(spec + n, 24, "%d", (int)v);
+                    p++;
+                } else {
+                    while (isdigit((unsigned char)*p) && n < 64) spec[n++] = *p++;
+                }
+            }
+            char conv = *p;
+            if (!conv || !strchr("diouxXcsbfeEgGaA", conv)) {
+                fprintf(stderr, "printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+                return 2;
+            }
+            p++;
+            const char *arg = *argp;
+            if (arg) argp++;
+
+            intmax_t v;
+            switch (conv) {
+            case 'd': case 'i':
+                status |= printf_number(arg, &v);
+                strcpy(spec + n, (char[]){ 'j', conv, '\0' });
+                printf(spec, v);
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                status |= printf_number(arg, &v);
+                strcpy(spec + n, (char[]){ 'j', conv, '\0' });
+                printf(spec, (uintmax_t)v);
+                break;
+            case 'c':
+            case 's':
+                strcpy(spec + n, "s");
+                printf(spec, conv == 'c' ? (char[]){ arg ? arg[0] : '\0', '\0' } : (arg ? arg : ""));
+                break;
+            case 'b':
+                for (const char *b = arg ? arg : ""; *b && !stop;) {
+                    if (*b == '\\') b = put_escape(b + 1, 1, &stop);
+                    else putchar(*b++);
+                }
+                break;
+            default: {
+                char *end = NULL;
+                long double d = arg ? strtold(arg, &end) : 0;
+                if (arg && (end == arg || *end)) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    status = 1;
+                }
+                strcpy(spec + n, (char[]){ 'L', conv, '\0' });
+                printf(spec, d);
+            }
+            }
+        }
+        // Only repeat the format if this round consumed arguments
+        if (argp == round) break;
+    } while (*argp && !stop);
+
+    return flush_output("printf") ? 1 : status;
+}
+
+int test_integer(const char *text, long long *value, int *error) {
+    /*
+        - Parses an integer operand of test, allowing blanks around it.
+        - Returns 1, or prints an error, sets *error and returns 0.
+    */
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == text || *end || errno) {
+        fprintf(stderr, "test: %s: integer expression expected\n", text);
+        *error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int test_is_binary(const char *op) {
+    /*
+        - Returns 1 if op is one of test's binary operators, else 0.
+    */
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt",
+                                 "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(op, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+int test_binary(const char *left, const char *op, const char *right, int *error) {
+    /*
+        - Evaluates a binary test primary; op must satisfy test_is_binary.
+    */
+    if (op[0] != '-') {
+        int cmp = strcmp(left, right);
+        if (op[0] == '<') return cmp < 0;
+        if (op[0] == '>') return cmp > 0;
+        return op[0] == '!' ? cmp != 0 : cmp == 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        // -ot is -nt with the operands swapped; a missing file is older than any other
+        if (op[1] == 'o') {
+            const char *t = left;
+            left = right;
+            right = t;
+        }
+        struct stat a, b;
+        int has_a = stat(left, &a) == 0, has_b = stat(right, &b) == 0;
+        if (op[1] == 'e') return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        if (!has_a || !has_b) return has_a;
+        return a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+               (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+    }
+
+    long long l, r;
+    if (!test_integer(left, &l, error) || !test_integer(right, &r, error)) return 0;
+    if (strcmp(op, "-eq") == 0) return l == r;
+    if (strcmp(op, "-ne") == 0) return l != r;
+    if (strcmp(op, "-lt") == 0) return l < r;
+    if (strcmp(op, "-le") == 0) return l <= r;
+    if (strcmp(op, "-gt") == 0) return l > r;
+    return l >= r;
+}
+
+int test_unary(const char *op, const char *arg) {
+    /*
+        - Evaluates a unary test primary; returns -1 if op is not a unary operator.
+    */
+    if (!op[1] || op[2]) return -1;
+    if (op[1] == 'z') return arg[0] == '\0';
+    if (op[1] == 'n') return arg[0] != '\0';
+    if (op[1] == 't') return isatty(atoi(arg));
+    if (op[1] == 'r') return eaccess(arg, R_OK) == 0;
+    if (op[1] == 'w') return eaccess(arg, W_OK) == 0;
+    if (op[1] == 'x') return eaccess(arg, X_OK) == 0;
+
+    struct stat st;
+    if (op[1] == 'h' || op[1] == 'L') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    if (!strchr("bcdefgkpsuGOS", op[1])) return -1;
+    if (stat(arg, &st) != 0) return 0;
+    switch (op[1]) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    }
+    return 1;  // -e
+}
+
+// Operands of the test expression being evaluated, the read position and the error flag
+struct test_parser {
+    char **argv;
+    int argc;
+    int pos;
+    int error;
+};
+
+int test_or(struct test_parser *t);
+
+int test_primary(struct test_parser *t) {
+    /*
+        - primary: '(' expr ')' | STRING BINOP STRING | UNOP STRING | STRING
+        - A binary operator in second place wins, so '[ -f = -f ]' compares strings.
+    */
+    if (t->pos >= t->argc) {
+        fprintf(stderr, "test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+    char **a = &t->argv[t->pos];
+    int left = t->argc - t->pos;
+    if (left >= 3 && test_is_binary(a[1])) {
+        t->pos += 3;
+        return test_binary(a[0], a[1], a[2], &t->error);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->pos++;
+        int value = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            if (!t->error) fprintf(stderr, "test: ')' expected\n");
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return value;
+    }
+    if (a[0][0] == '-' && left >= 2) {
+        int value = test_unary(a[0], a[1]);
+        if (value >= 0) {
+            t->pos += 2;
+            return value;
+        }
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+int test_not(struct test_parser *t) {
+    /*
+        - not: '!' not | primary. A '!' that is the last operand is a string, not an operator.
+    */
+    if (t->pos < t->argc - 1 && strcmp(t->argv[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+int test_and(struct test_parser *t) {
+    /*
+        - and: not ('-a' not)*. Every operand is parsed even once the value is known.
+    */
+    int value = test_not(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        value = test_not(t) && value;
+    }
+    return value;
+}
+
+int test_or(struct test_parser *t) {
+    /*
+        - or: and ('-o' and)*, the loosest level of the expression.
+    */
+    int value = test_and(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        value = test_and(t) || value;
+    }
+    return value;
+}
+
+int run_builtin_test(char **args) {
+    /*
+        - Built-in version of test(1) and '[': file tests (-e -f -d -r -w -x -s -L ...),
+          string tests (-z -n = != < >), integer comparisons (-eq ... -ge), -nt -ot -ef,
+          and '!', '-a', '-o' and parentheses, with '!' binding tightest and -o loosest.
+        - Returns 0 if the expression is true, 1 if it is false or empty, 2 on a syntax error.
+    */
+    int argc = 0;
+    while (args[argc]) argc++;
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    struct test_parser t = { args + 1, argc - 1, 0, 0 };
+    if (t.argc == 0) return 1;
+
+    int value = test_or(&t);
+    if (!t.error && t.pos < t.argc) {
+        fprintf(stderr, "test: %s: unexpected argument\n", t.argv[t.pos]);
+        t.error = 1;
+    }
+    return t.error ? 2 : !value;
+}
+
+int run_builtin_true(char **args) {
+    /*
+        - Built-in version of true(1): returns 0.
+    */
+    (void)args;
+    return 0;
+}
+
+int run_builtin_false(char **args) {
+    /*
+        - Built-in version of false(1): returns 1.
+    */
+    (void)args;
+    return 1;
+}
+
+int cat_fd(int fd, const char *name) {
+    /*
+        - Copies fd to stdout until end of file: sendfile while the kernel takes the pair,
+          read/write otherwise (sendfile advances the file offset, so the fallback resumes
+          where it stopped).
+        - Returns 0, or prints an error for name and returns 1.
+    */
+    ssize_t n;
+    while ((n = sendfile(STDOUT_FILENO, fd, NULL, FANOUT_CHUNK)) > 0) continue;
+    if (n == 0) return 0;
+    if (errno != EINVAL && errno != ENOSYS && errno != EINTR) {
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    char buf[READ_CHUNK];
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            return 1;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(STDOUT_FILENO, buf + done, n - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) {
+                fprintf(stderr, "cat: write error: %s\n", strerror(errno));
+                return 1;
+            }
+            done += w;
+        }
+    }
+    return 0;
+}
+
+int run_builtin_cat(char **args) {
+    /*
+        - Built-in version of cat(1) for its common form 'cat [-u] [FILE...]' ('-' is stdin).
+        - Any other option runs the real cat instead, and so does every cat run by the
+          interactive shell itself: it ignores SIGINT and SIGTSTP, so only a child can be
+          stopped with ^C or ^Z ('cat /dev/zero', a fifo, a large file). A cat forked as a
+          pipeline stage or a background job runs here.
+        - Returns 1 if a file could not be read.
+    */
+    if (job_control) return run_external(args);
+    int files = 0, options = 1;
+    for (int i = 1; args[i]; i++) {
+        if (options && strcmp(args[i], "--") == 0) {
+            options = 0;
+        } else if (options && args[i][0] == '-' && args[i][1]) {
+            if (strcmp(args[i], "-u") != 0) return run_external(args);
+        } else {
+            files++;
+        }
+    }
+
+    out_flush();
+    if (!files) return cat_fd(STDIN_FILENO, "-");
+
+    int status = 0;
+    options = 1;
+    for (int i = 1; args[i]; i++) {
+        if (options && strcmp(args[i], "--") == 0) {
+            options = 0;
+            continue;
+        }
+        if (options && args[i][0] == '-' && args[i][1]) continue;
+        if (strcmp(args[i], "-") == 0) {
+            status |= cat_fd(STDIN_FILENO, "-");
+            continue;
+        }
+        int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        status |= cat_fd(fd, args[i]);
+        close(fd);
+    }
+    return status;
+}
+
+char **par_build_argv(char **cmd, int cmd_len, const char *arg) {
+    /*
+        - Builds the argv for one 'par' job in line_arena.
+        - Every '{}' in the command words is replaced by arg; if no word contains '{}',
+          arg is appended as the last argument.
+    */
+    char **argv = arena_alloc(&line_arena, (cmd_len + 2) * sizeof(char *));
+    int n = 0;
+    int replaced = 0;
+    size_t arg_len = strlen(arg);
+
+    for (int i = 0; i < cmd_len; i++) {
+        const char *word = cmd[i];
+        if (!strstr(word, "{}")) {
+            argv[n++] = cmd[i];
+            continue;
+        }
+
+        // Count placeholders, then copy the word with each one replaced
+        int holes = 0;
+        for (const char *p = strstr(word, "{}"); p; p = strstr(p + 2, "{}")) holes++;
+        char *out = arena_alloc(&line_arena, strlen(word) + holes * arg_len + 1);
+        char *w = out;
+        const char *p = word;
+        const char *hole;
+        while ((hole = strstr(p, "{}"))) {
+            memcpy(w, p, hole - p);
+            w += hole - p;
+            memcpy(w, arg, arg_len);
+            w += arg_len;
+            p = hole + 2;
+        }
+        strcpy(w, p);
+        argv[n++] = out;
+        replaced = 1;
+    }
+    if (!replaced) argv[n++] = (char *)arg;
+    argv[n] = NULL;
+    return argv;
+}
+
+void par_stream_emit(struct par_stream *st, int all) {
+    /*
+        - Passes on every complete line in the stream's buffer as 'label: line'; with all,
+          also the rest that has no newline yet.
+    */
+    size_t start = 0;
+    while (start < st->len) {
+        char *nl = memchr(st->buf + start, '\n', st->len - start);
+        if (!nl && !all) break;
+        size_t end = nl ? (size_t)(nl - st->buf) : st->len;
+        if (st->to_fd == STDOUT_FILENO) {
+            out_write(st->label, strlen(st->label));
+            out_write(": ", 2);
+            out_write(st->buf + start, end - start);
+            out_write("\n", 1);
+        } else {
+            fprintf(stderr, "%s: %.*s\n", st->label, (int)(end - start), st->buf + start);
+        }
+        start = nl ? end + 1 : st->len;
+    }
+    memmove(st->buf, st->buf + start, st->len - start);
+    st->len -= start;
+}
+
+void par_stream_close(struct par_stream *st) {
+    /*
+        - Passes on what is left in the stream and stops watching and closes its pipe.
+    */
+    if (st->source.fd < 0) return;
+    par_stream_emit(st, 1);
+    out_flush();
+    event_remove(&st->source);
+    close(st->source.fd);
+    st->source.fd = -1;
+    free(st->buf);
+    st->buf = NULL;
+}
+
+ssize_t par_stream_read(struct par_stream *st) {
+    /*
+        - Reads once from the (non-blocking) pipe and passes on the lines completed by it; a
+          line longer than READ_CHUNK is passed on in pieces.
+        - Closes the stream at EOF. Returns what read(2) returned.
+    */
+    if (st->cap - st->len < READ_CHUNK) {
+        size_t cap = st->len + READ_CHUNK;
+        char *buf = realloc(st->buf, cap);
+        if (!buf) return -1;
+        st->buf = buf;
+        st->cap = cap;
+    }
+    ssize_t r = read(st->source.fd, st->buf + st->len, READ_CHUNK);
+    if (r > 0) {
+        st->len += r;
+        par_stream_emit(st, st->len >= READ_CHUNK);
+        out_flush();
+    } else if (r == 0 || (errno != EINTR && errno != EAGAIN)) {
+        par_stream_close(st);
+    }
+    return r;
+}
+
+void par_stream_ready(struct event_source *src) {
+    par_stream_read(src->arg);
+}
+
+int par_stream_open(struct par_stream *st, const char *label, int to_fd, struct spawn_fds *fds) {
+    /*
+        - Creates the pipe of a stream, watches its read end in the event loop and adds its
+          write end as the child's descriptor to_fd.
+        - Returns the write end, which the caller closes once the child is started, or -1 if
+          the stream cannot be set up (the child then writes to to_fd directly).
+    */
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) return -1;
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    st->source = (struct event_source){ p[0], par_stream_ready, st };
+    st->label = label;
+    st->to_fd = to_fd;
+    st->buf = NULL;
+    st->len = st->cap = 0;
+    if (event_add(&st->source) < 0) {
+        close(p[0]);
+        close(p[1]);
+        st->source.fd = -1;
+        return -1;
+    }
+    spawn_fds_add(fds, p[1], to_fd);
+    return p[1];
+}
+
+void par_stream_drain(struct par_stream *st) {
+    /*
+        - Called when the job has exited: what it wrote is already in the pipe, so it is read
+          without waiting and the stream is closed; a descendant that still holds the pipe
+          open cannot keep the scheduler waiting.
+    */
+    while (st->source.fd >= 0 && par_stream_read(st) > 0) {
+    }
+    par_stream_close(st);
+}
+
+int par_schedule(char ***argvs, char **labels, int n, long max_jobs, int mode, const char *name) {
+    /*
+        - Scheduler behind 'par' and '@group': starts argvs[0..n) as child jobs, at most
+          max_jobs at once, starting the next one as soon as any exits; the shell sleeps in
+          event_wait, which reaps however many children exited in one wakeup.
+        - Output modes: 0 lets children write straight to stdout; 'g' buffers each job's
+          stdout in a memfd and prints it in one piece when the job ends, so output never
+          interleaves; 'k' does the same in input order; 't' passes each line of a job's
+          stdout and stderr on as it arrives, prefixed with 'label: ', and reports a failed
+          job as 'label: exit N'.
+        - Ctrl-C (SIGINT) stops starting new jobs and interrupts the running ones. SIGINT is
+          blocked meanwhile and arrives through the event loop's signalfd.
+        - Returns 0 if every job succeeded, otherwise 1 (reported under name).
+    */
+    // Per-input bookkeeping: job slot while running, capture fd while buffered
+    int *slot = arena_alloc(&line_arena, n * sizeof(int));
+    int *capture = arena_alloc(&line_arena, n * sizeof(int));
+    char *finished = arena_alloc(&line_arena, n);
+    struct par_stream *streams = arena_alloc(&line_arena, 2 * n * sizeof(struct par_stream));
+    for (int k = 0; k < n; k++) {
+        slot[k] = -1;
+        capture[k] = -1;
+        finished[k] = 0;
+        streams[2 * k].source.fd = streams[2 * k + 1].source.fd = -1;
+    }
+
+    out_flush();
+    sigset_t old, intr;
+    block_sigchld(&old);
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    sigprocmask(SIG_BLOCK, &intr, NULL);
+    int interrupted = 0;
+
+    int next = 0;        // Next input to start
+    int running = 0;
+    int next_print = 0;  // Next input to print in -k mode
+    int failed = 0;
+
+    while (next < n || running > 0) {
+        // Fill every free slot
+        while (!interrupted && running < max_jobs && next < n) {
+            int k = next++;
+            struct spawn_fds fds = { 0 };
+            int out_end = -1, err_end = -1;
+            if (mode == 'g' || mode == 'k') {
+                capture[k] = memfd_create("par-output", MFD_CLOEXEC);
+                if (capture[k] < 0) perror("par: memfd_create");
+                if (capture[k] >= 0) spawn_fds_add(&fds, capture[k], STDOUT_FILENO);
+            } else if (mode == 't') {
+                out_end = par_stream_open(&streams[2 * k], labels[k], STDOUT_FILENO, &fds);
+                err_end = par_stream_open(&streams[2 * k + 1], labels[k], STDERR_FILENO, &fds);
+            }
+            slot[k] = start_command(argvs[k], current_command, 1, &fds);
+            if (out_end >= 0) close(out_end);
+            if (err_end >= 0) close(err_end);
+            if (slot[k] < 0) {
+                par_stream_close(&streams[2 * k]);
+                par_stream_close(&streams[2 * k + 1]);
+                finished[k] = 1;
+                failed++;
+                continue;
+            }
+            jobs[slot[k]].collected = 1;
+            running++;
+        }
+        if (interrupted && next < n) {
+            // Do not start the rest; mark them as finished without output
+            for (; next < n; next++) finished[next] = 1;
+            for (int k = 0; k < n; k++) {
+                if (slot[k] >= 0) signal_job(slot[k], SIGINT);
+            }
+        }
+        if (running == 0) break;
+
+        if (event_wait() == SIGINT) interrupted = 1;
+
+        // Collect every job that finished while we slept
+        for (int k = 0; k < n; k++) {
+            if (slot[k] < 0 || jobs[slot[k]].state != JOB_DONE) continue;
+            int code = status_code(jobs[slot[k]].status);
+            if (code != 0) failed++;
+            job_free(slot[k]);
+            slot[k] = -1;
+            finished[k] = 1;
+            running--;
+
+            if (mode == 't') {
+                par_stream_drain(&streams[2 * k]);
+                par_stream_drain(&streams[2 * k + 1]);
+                if (code != 0) fprintf(stderr, "%s: exit %d\n", labels[k], code);
+            }
+            if (mode == 'g' && capture[k] >= 0) {
+                copy_to_stdout(capture[k]);
+                close(capture[k]);
+                capture[k] = -1;
+            }
+        }
+
+        // In ordered mode, print every finished job at the head of the input order
+        while (mode == 'k' && next_print < n && finished[next_print]) {
+            if (capture[next_print] >= 0) {
+                copy_to_stdout(capture[next_print]);
+                close(capture[next_print]);
+                capture[next_print] = -1;
+            }
+            next_print++;
+        }
+    }
+
+    for (int k = 0; k < n; k++) {
+        if (capture[k] >= 0) close(capture[k]);
+    }
+    // Discard a Ctrl-C that came after the last wakeup, so unblocking does not deliver it
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&intr, NULL, &zero) > 0) {
+    }
+    unblock_sigchld(&old);
+
+    if (failed > 0) fprintf(stderr, "%s: %d of %d jobs failed\n", name, failed, n);
+    return failed > 0 ? 1 : 0;
+}
+
+int run_builtin_par(char **args) {
+    /*
+        - Built-in command handler for 'par [-j N] [-g | -k | -t] cmd [args...] ::: input...'.
+        - Runs cmd once per input ('{}' in cmd is replaced by the input, otherwise it is appended),
+          with at most N children at once (default: number of online CPUs), in par_schedule.
+        - Output modes: by default children write straight to stdout; -g groups each job's
+          output, -k also keeps the input order, -t streams each line tagged with its input.
+        - Returns 0 if every job succeeded, otherwise 1.
+    */
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int mode = 0;  // 0 = direct, 'g' = grouped, 'k' = grouped and ordered, 't' = tagged
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+            max_jobs = strtol(args[++i], NULL, 10);
+        } else if (strncmp(args[i], "-j", 2) == 0 && args[i][2]) {
+            max_jobs = strtol(args[i] + 2, NULL, 10);
+        } else if (strcmp(args[i], "-g") == 0) {
+            mode = 'g';
+        } else if (strcmp(args[i], "-k") == 0) {
+            mode = 'k';
+        } else if (strcmp(args[i], "-t") == 0) {
+            mode = 't';
+        } else {
+            break;
+        }
+    }
+    if (max_jobs < 1) max_jobs = 1;
+
+    char **cmd = &args[i];
+    int cmd_len = 0;
+    while (cmd[cmd_len] && strcmp(cmd[cmd_len], ":::") != 0) cmd_len++;
+    if (cmd_len == 0 || !cmd[cmd_len]) {
+        fprintf(stderr, "par: usage: par [-j N] [-g | -k | -t] cmd [args...] ::: input...\n");
+        return 2;
+    }
+    char **inputs = &cmd[cmd_len + 1];
+    int ninputs = 0;
+    while (inputs[ninputs]) ninputs++;
+    if (ninputs == 0) return 0;
+
+    char ***argvs = arena_alloc(&line_arena, ninputs * sizeof(char **));
+    for (int k = 0; k < ninputs; k++) argvs[k] = par_build_argv(cmd, cmd_len, inputs[k]);
+    return par_schedule(argvs, inputs, ninputs, max_jobs, mode, "par");
+}
+
+// The host file is read with the script reader and the command built with the expansion buffers
+void reader_init_fd(struct line_reader *r, int fd);
+char *reader_next_line(struct line_reader *r);
+void reader_close(struct line_reader *r);
+void text_append(char **buf, size_t *len, size_t *cap, const char *s, size_t n);
+
+int remote_hosts_group(const char *group, char ***hosts, int *cap) {
+    /*
+        - Reads the hosts of group from the first line 'GROUP host...' of $SHELL322_HOSTS, or
+          ~/.shell322_hosts ('#' starts a comment), into *hosts.
+        - Returns the number of hosts, or -1 if there is no such group (or no such file).
+    */
+    char path[PATH_MAX];
+    const char *file = var_get("SHELL322_HOSTS");
+    if (file && *file) {
+        snprintf(path, sizeof(path), "%s", file);
+    } else {
+        const char *home = var_get("HOME");
+        snprintf(path, sizeof(path), "%s/.shell322_hosts", home ? home : "");
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct line_reader reader;
+    reader_init_fd(&reader, fd);
+    int n = -1;
+    char *line;
+    while (n < 0 && (line = reader_next_line(&reader))) {
+        line[strcspn(line, "#")] = '\0';
+        char *save, *word = strtok_r(line, " \t\r", &save);
+        if (!word || strcmp(word, group) != 0) continue;
+        n = 0;
+        while ((word = strtok_r(NULL, " \t\r", &save))) {
+            if (n == *cap) {
+                *hosts = arena_grow(&line_arena, *hosts, *cap * sizeof(char *), 2 * *cap * sizeof(char *));
+                *cap *= 2;
+            }
+            (*hosts)[n++] = arena_strndup(&line_arena, word, strlen(word));
+        }
+    }
+    reader_close(&reader);
+    close(fd);
+    return n;
+}
+
+int remote_hosts(const char *group, char ***hosts) {
+    /*
+        - Returns the hosts '@group' names, in line_arena: the hosts of the group if the
+          hosts file has one of that name (remote_hosts_group), otherwise the word itself as
+          a comma-separated list of host names ('@web', '@a,b,c', '@host').
+        - Returns the number of hosts.
+    */
+    int n, cap = 8;
+    *hosts = arena_alloc(&line_arena, cap * sizeof(char *));
+    if (!strchr(group, ',') && (n = remote_hosts_group(group, hosts, &cap)) >= 0) return n;
+
+    n = 0;
+    for (const char *p = group; *p;) {
+        size_t len = strcspn(p, ",");
+        if (len > 0) {
+            if (n == cap) {
+                *hosts = arena_grow(&line_arena, *hosts, cap * sizeof(char *), 2 * cap * sizeof(char *));
+                cap *= 2;
+            }
+            (*hosts)[n++] = arena_strndup(&line_arena, p, len);
+        }
+        p += len + (p[len] == ',');
+    }
+    return n;
+}
+
+int remote_control_dir(char *dir, size_t size) {
+    /*
+        - Fills dir with the directory of the ssh master sockets, $XDG_RUNTIME_DIR/shell322-ssh
+          or /tmp/shell322-ssh-UID, creating it mode 0700.
+        - Anyone who can reach a master socket can run commands on its host, so the directory
+          must be the user's own and closed to everyone else. Returns 0, or -1 if it is not.
+    */
+    const char *runtime = var_get("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) {
+        snprintf(dir, size, "%s/shell322-ssh", runtime);
+    } else {
+        snprintf(dir, size, "/tmp/shell322-ssh-%d", (int)getuid());
+    }
+    mkdir(dir, 0700);
+    struct stat st;
+    if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        fprintf(stderr, "@: %s: not a private directory, not sharing ssh connections\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+char *remote_quote(char **words) {
+    /*
+        - Joins words into one command line for the remote shell, single-quoting every word
+          that is not made of plain characters, so each arrives as exactly one word.
+    */
+    char *line = NULL;
+    size_t len = 0, cap = 0;
+    for (int i = 0; words[i]; i++) {
+        if (i > 0) text_append(&line, &len, &cap, " ", 1);
+        const char *w = words[i];
+        if (*w && strspn(w, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-./=:,+@%") == strlen(w)) {
+            text_append(&line, &len, &cap, w, strlen(w));
+            continue;
+        }
+        text_append(&line, &len, &cap, "'", 1);
+        for (const char *q; (q = strchr(w, '\'')); w = q + 1) {
+            text_append(&line, &len, &cap, w, q - w);
+            text_append(&line, &len, &cap, "'\\''", 4);
+        }
+        text_append(&line, &len, &cap, w, strlen(w));
+        text_append(&line, &len, &cap, "'", 1);
+    }
+    return line;
+}
+
+int run_builtin_remote(char **args) {
+    /*
+        - Built-in prefix '@GROUP [-j N] cmd [args...]': runs cmd over ssh on every host of
+          the group, or on the hosts GROUP names itself when it is no group ('@host',
+          '@a,b'; see remote_hosts), on at most N hosts at once (default REMOTE_JOBS).
+        - The hosts run through par_schedule in tagged mode, so every line of output arrives
+          as 'host: line' while the hosts are still running, and failures as 'host: exit N'
+          (255 is ssh's own error, e.g. the host is unreachable).
+        - All ssh processes for a host share one ControlMaster connection, kept REMOTE_PERSIST
+          after its last use: only the first command to a host pays for connection setup and
+          authentication; later ones, also from other shells, start a session on it.
+        - ssh runs with BatchMode (no password or host key prompts, which cannot be answered
+          for many hosts at once) and with stdin from /dev/null.
+        - The words are quoted for the remote shell, so they arrive exactly as given here.
+        - Returns 0 if cmd succeeded on every host, otherwise 1, or 2 on a usage error.
+    */
+    const char *group = args[0] + 1;
+    long max_jobs = REMOTE_JOBS;
+    int i = 1;
+    if (args[i] && strcmp(args[i], "-j") == 0 && args[i + 1]) {
+        max_jobs = strtol(args[i + 1], NULL, 10);
+        i += 2;
+    } else if (args[i] && strncmp(args[i], "-j", 2) == 0 && args[i][2]) {
+        max_jobs = strtol(args[i] + 2, NULL, 10);
+        i++;
+    }
+    if (max_jobs < 1) max_jobs = 1;
+    if (!*group || !args[i]) {
+        fprintf(stderr, "@: usage: @GROUP [-j N] cmd [args...]\n");
+        return 2;
+    }
+
+    char **hosts;
+    int n = remote_hosts(group, &hosts);
+    if (n == 0) return 0;
+
+    char dir[PATH_MAX], control_path[PATH_MAX + 32];
+    int shared = remote_control_dir(dir, sizeof(dir)) == 0;
+    snprintf(control_path, sizeof(control_path), "ControlPath=%s/%%C", dir);
+    char *command = remote_quote(&args[i]);
+
+    char ***argvs = arena_alloc(&line_arena, n * sizeof(char **));
+    for (int k = 0; k < n; k++) {
+        char **argv = arena_alloc(&line_arena, 16 * sizeof(char *));
+        int a = 0;
+        argv[a++] = "ssh";
+        argv[a++] = "-n";
+        argv[a++] = "-o";
+        argv[a++] = "BatchMode=yes";
+        if (shared) {
+            argv[a++] = "-o";
+            argv[a++] = "ControlMaster=auto";
+            argv[a++] = "-o";
+            argv[a++] = control_path;
+            argv[a++] = "-o";
+            argv[a++] = "ControlPersist=" REMOTE_PERSIST;
+        }
+        argv[a++] = "--";
+        argv[a++] = hosts[k];
+        argv[a++] = command;
+        argv[a] = NULL;
+        argvs[k] = argv;
+    }
+    return par_schedule(argvs, hosts, n, max_jobs, 't', args[0]);
+}
+
+int parse_size(const char *text, long *size) {
+    /*
+        - Parses a byte count with an optional K, M or G suffix ('1M', '262144').
+        - Returns 0, or -1 if text is not a non-negative size or the scaled size overflows a long.
+    */
+    char *end;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    if (end == text || n < 0 || errno) return -1;
+    int shift = 0;
+    if (*end == 'k' || *end == 'K') {
+        shift = 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        shift = 20;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        shift = 30;
+        end++;
+    }
+    if (*end || n > LONG_MAX >> shift) return -1;
+    *size = n << shift;
+    return 0;
+}
+
+int limit_option(struct job_limits *l, const char *name, const char *value) {
+    /*
+        - Sets one 'limit' option: --cpu N (CPUs of bandwidth, fractions allowed, at most the
+          CPU count times 1000), --mem SIZE
+          (K/M/G suffixes), --nice N, --cpus LIST ('0-3,6').
+        - Returns 0, or -1 after printing an error.
+    */
+    char *end;
+    if (strcmp(name, "--cpu") == 0) {
+        double cpus = strtod(value, &end);
+        if (end == value || *end || !isfinite(cpus) || cpus <= 0) goto invalid;
+        if (cpus > sysconf(_SC_NPROCESSORS_CONF) * 1000.0) goto invalid;  // Keeps cpu_milli well in range
+        l->cpu_milli = (long)(cpus * 1000 + 0.5);
+        if (l->cpu_milli < 1) l->cpu_milli = 1;
+    } else if (strcmp(name, "--mem") == 0) {
+        if (parse_size(value, &l->mem) < 0 || l->mem == 0) goto invalid;
+    } else if (strcmp(name, "--nice") == 0) {
+        l->nice = strtol(value, &end, 10);
+        if (end == value || *end) goto invalid;
+        l->set_nice = 1;
+    } else if (strcmp(name, "--cpus") == 0) {
+        if (parse_cpu_list(value, &l->cpus) < 0 || CPU_COUNT(&l->cpus) == 0) goto invalid;
+        l->set_cpus = 1;
+    } else {
+        fprintf(stderr, "limit: %s: unknown option\n", name);
+        return -1;
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "limit: %s: invalid value '%s'\n", name, value);
+    return -1;
+}
+
+int run_builtin_set(char **args) {
+    /*
+        - Built-in command handler for 'set'.
+        - 'set' or 'set -o' lists the shell options.
+        - 'set -o pipesize=SIZE' sets the capacity of pipeline pipes (K/M suffixes, 0 for the kernel default);
+          'set +o pipesize' goes back to the kernel default.
+        - 'set -o pipedirect' / 'set +o pipedirect' turns packet-mode pipes (O_DIRECT) on / off;
+          each write is then one packet and a read shorter than a packet drops the rest, so it only
+          suits stages that read in large blocks.
+        - 'set -o spawnserver' / 'set +o spawnserver' starts / stops the spawn server, a small
+          helper process that does the fork and exec of external commands for the shell.
+        - 'set -o pipeplace=cache' / 'set -o pipeplace=node' pins the stages of each pipeline
+          to CPUs sharing a last-level cache / a NUMA node, filling one group before the next;
+          'set +o pipeplace' turns it off.
+        - 'set -o posix' / 'set +o posix' runs echo, printf, test, [, true, false and cat from
+          PATH instead of the in-process versions, for scripts that rely on the exact programs.
+        - Returns 0, or 2 on an unknown option or bad value.
+    */
+    if (!args[1] || (strcmp(args[1], "-o") == 0 && !args[2])) {
+        out_printf("pipesize\t%ld\n", opt_pipe_size);
+        out_printf("pipedirect\t%s\n", opt_pipe_direct ? "on" : "off");
+        out_printf("spawnserver\t%s\n", spawn_server_fd >= 0 ? "on" : "off");
+        out_printf("pipeplace\t%s\n", opt_pipe_place == PLACE_CACHE ? "cache" : opt_pipe_place == PLACE_NODE ? "node" : "off");
+        out_printf("posix\t%s\n", opt_posix ? "on" : "off");
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        int on = strcmp(args[i], "-o") == 0;
+        if (!on && strcmp(args[i], "+o") != 0) {
+            fprintf(stderr, "set: %s: invalid option\n", args[i]);
+            return 2;
+        }
+        const char *name = args[++i];
+        if (!name) {
+            fprintf(stderr, "set: option name required\n");
+            return 2;
+        }
+        if (strncmp(name, "pipesize", 8) == 0 && (name[8] == '=' || name[8] == '\0')) {
+            long size = 0;
+            if (on && name[8] == '\0') {
+                fprintf(stderr, "set: pipesize: size required\n");
+                status = 2;
+                continue;
+            }
+            if (on && parse_size(name + 9, &size) < 0) {
+                fprintf(stderr, "set: %s: invalid size\n", name + 9);
+                status = 2;
+                continue;
+            }
+            opt_pipe_size = size;
+        } else if (strncmp(name, "pipeplace", 9) == 0 && (name[9] == '=' || name[9] == '\0')) {
+            const char *mode = name[9] == '=' ? name + 10 : "";
+            if (!on) {
+                opt_pipe_place = PLACE_OFF;
+            } else if (strcmp(mode, "cache") == 0 || strcmp(mode, "node") == 0) {
+                opt_pipe_place = mode[0] == 'c' ? PLACE_CACHE : PLACE_NODE;
+            } else {
+                fprintf(stderr, "set: pipeplace: expected cache or node\n");
+                status = 2;
+            }
+        } else if (strcmp(name, "pipedirect") == 0) {
+            opt_pipe_direct = on;
+        } else if (strcmp(name, "spawnserver") == 0) {
+            if (!on) spawn_server_stop();
+            else if (spawn_server_fd < 0 && spawn_server_start() < 0) status = 1;
+        } else if (strcmp(name, "posix") == 0) {
+            opt_posix = on;
+        } else {
+            fprintf(stderr, "set: %s: invalid option name\n", name);
+            status = 2;
+        }
+    }
+    return status;
+}
+
+struct coproc *coproc_find(const char *name) {
+    /*
+        - Returns the running coprocess called name, or NULL.
+        - A coprocess whose job has finished (the job slot is free or reused) is dropped
+          here: its pipes are closed and its slot freed.
+    */
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        struct coproc *c = &coprocs[i];
+        if (!c->name[0]) continue;
+        struct job *job = &jobs[c->job];
+        if (job->state == JOB_FREE || job->state == JOB_DONE || job->seq != c->seq) {
+            if (c->to_fd >= 0) close(c->to_fd);
+            close(c->from_fd);
+            c->name[0] = '\0';
+            continue;
+        }
+        if (strcmp(c->name, name) == 0) return c;
+    }
+    return NULL;
+}
+
+void coproc_close_fds(const struct node *cmd) {
+    /*
+        - Closes the coprocess pipes in a forked child that never execs (spawned commands
+          lose them through O_CLOEXEC), so it cannot keep a coprocess's stdin open after
+          'coproc -c'. Descriptors that cmd's redirections have just set up are kept.
+    */
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        struct coproc *c = &coprocs[i];
+        if (!c->name[0]) continue;
+        int fds[2] = { c->to_fd, c->from_fd };
+        for (int k = 0; k < 2; k++) {
+            int kept = fds[k] < 0;
+            for (int r = 0; !kept && r < cmd->nredirects; r++) kept = cmd->redirects[r].fd == fds[k];
+            if (!kept) close(fds[k]);
+        }
+        c->name[0] = '\0';
+    }
+}
+
+int coproc_start(const char *name, char **args) {
+    /*
+        - Starts args as a coprocess: a background job whose stdin and stdout are O_CLOEXEC
+          pipes held by the shell, so other children never inherit them.
+        - Prints the job number, PID and the shell-side descriptors, which other commands can
+          use directly with '>&N' / '<&N'.
+        - Returns 0, or 1 if the name is taken, the table is full or the command cannot start.
+    */
+    if (coproc_find(name)) {
+        fprintf(stderr, "coproc: %s: already running\n", name);
+        return 1;
+    }
+    struct coproc *c = NULL;
+    for (int i = 0; i < MAX_COPROCS && !c; i++) {
+        if (!coprocs[i].name[0]) c = &coprocs[i];
+    }
+    if (!c) {
+        fprintf(stderr, "coproc: too many coprocesses\n");
+        return 1;
+    }
+
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        return 1;
+    }
+    if (pipe2(from, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        close(to[0]);
+        close(to[1]);
+        return 1;
+    }
+
+    struct spawn_fds fds = { 0 };
+    spawn_fds_add(&fds, to[0], STDIN_FILENO);
+    spawn_fds_add(&fds, from[1], STDOUT_FILENO);
+
+    sigset_t old;
+    block_sigchld(&old);
+    int j = start_command(args, current_command, 1, &fds);
+    close(to[0]);
+    close(from[1]);
+    if (j < 0) {
+        unblock_sigchld(&old);
+        close(to[1]);
+        close(from[0]);
+        return 1;
+    }
+
+    // Keep the shell's ends above the descriptors that redirections usually name
+    int high_to = fcntl(to[1], F_DUPFD_CLOEXEC, 10), high_from = fcntl(from[0], F_DUPFD_CLOEXEC, 10);
+    if (high_to >= 0) {
+        close(to[1]);
+        to[1] = high_to;
+    }
+    if (high_from >= 0) {
+        close(from[0]);
+        from[0] = high_from;
+    }
+
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->job = j;
+    c->seq = jobs[j].seq;
+    c->to_fd = to[1];
+    c->from_fd = from[0];
+    c->buf_len = 0;
+    out_printf("[%d] Process ID: %d (coproc %s: write >&%d, read <&%d)\n",
+           j + 1, jobs[j].last_pid, c->name, c->to_fd, c->from_fd);
+    unblock_sigchld(&old);
+    return 0;
+}
+
+int coproc_write(struct coproc *c, char **words) {
+    /*
+        - Sends the words, joined by spaces and ended by a newline, to the coprocess's stdin.
+        - SIGPIPE is ignored during the write, so a coprocess that went away only makes this fail.
+        - Returns 0, or 1 on error.
+    */
+    if (c->to_fd < 0) {
+        fprintf(stderr, "coproc: %s: input already closed\n", c->name);
+        return 1;
+    }
+    size_t len = 1;
+    for (int i = 0; words[i]; i++) len += strlen(words[i]) + 1;
+    char *msg = arena_alloc(&line_arena, len);
+    size_t n = 0;
+    for (int i = 0; words[i]; i++) {
+        if (i > 0) msg[n++] = ' ';
+        memcpy(msg + n, words[i], strlen(words[i]));
+        n += strlen(words[i]);
+    }
+    msg[n++] = '\n';
+
+    void (*previous)(int) = signal(SIGPIPE, SIG_IGN);
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = write(c->to_fd, msg + done, n - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        done += w;
+    }
+    signal(SIGPIPE, previous);
+    if (done < n) {
+        fprintf(stderr, "coproc: %s: write failed: %s\n", c->name, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int coproc_read_line(struct coproc *c) {
+    /*
+        - Copies one line of the coprocess's output to stdout, refilling the slot's buffer
+          as needed; a line longer than the buffer is passed on in pieces.
+        - Waits in event_wait with the output pipe as an event source, so children are reaped
+          meanwhile. The pipe is watched only for this wait: the shell never reads ahead what
+          a later '<&N' command should get. Without the event loop it falls back to read(2).
+        - Ctrl-C (SIGINT) ends the wait, as in 'par': SIGINT is blocked meanwhile and arrives
+          through the event loop's signalfd.
+        - Returns 0, 1 at EOF without any data, or 130 if interrupted.
+    */
+    sigset_t old, intr;
+    block_sigchld(&old);
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    sigprocmask(SIG_BLOCK, &intr, NULL);
+    c->at_eof = 0;
+    c->source = (struct event_source){ c->from_fd, coproc_ready, c };
+    int watched = event_add(&c->source) == 0;
+
+    int result = 0;
+    size_t scanned = 0;
+    while (1) {
+        char *nl = memchr(c->buf + scanned, '\n', c->buf_len - scanned);
+        if (nl || c->buf_len == sizeof(c->buf)) {
+            size_t n = nl ? (size_t)(nl - c->buf) + 1 : c->buf_len;
+            out_write(c->buf, n);
+            memmove(c->buf, c->buf + n, c->buf_len - n);
+            c->buf_len -= n;
+            if (nl) break;
+            scanned = 0;
+            continue;
+        }
+        if (c->at_eof) {
+            if (c->buf_len == 0) {
+                result = 1;
+                break;
+            }
+            out_write(c->buf, c->buf_len);  // Last line without a newline
+            out_write("\n", 1);
+            c->buf_len = 0;
+            break;
+        }
+        scanned = c->buf_len;
+        if (watched) {
+            if (event_wait() == SIGINT) {
+                result = 128 + SIGINT;
+                break;
+            }
+            continue;
+        }
+        ssize_t r = read(c->from_fd, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) c->at_eof = 1;
+        else c->buf_len += r;
+    }
+    if (watched && !c->at_eof) event_remove(&c->source);
+    // Discard a Ctrl-C that came after the last wakeup, so unblocking does not deliver it
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&intr, NULL, &zero) > 0) {
+    }
+    unblock_sigchld(&old);
+    return result;
+}
+
+int run_builtin_coproc(char **args) {
+    /*
+        - Built-in command handler for 'coproc', which keeps long-lived workers so tools used for
+          many tiny requests are started once instead of once per request.
+        - 'coproc NAME cmd [args...]' starts cmd as coprocess NAME.
+        - 'coproc -w NAME words...' sends one line to it; 'coproc -r NAME [N]' prints N lines
+          (default 1) of its output; 'coproc -q NAME words...' does both for one request.
+        - 'coproc -c NAME' closes its stdin so it can finish; 'coproc -k NAME' sends it SIGTERM.
+        - 'coproc' alone lists the running coprocesses with their descriptors.
+        - The coprocess must flush its output per line (e.g. 'jq --unbuffered'), else -r waits.
+        - Output is only read while -r waits for it, so a command given the descriptor with
+          '<&N' sees everything -r has not taken.
+        - Returns 0, 1 on an error or EOF, or 2 on a usage error.
+    */
+    if (!args[1]) {
+        coproc_find("");  // Drops finished coprocesses
+        for (int i = 0; i < MAX_COPROCS; i++) {
+            struct coproc *c = &coprocs[i];
+            if (!c->name[0]) continue;
+            out_printf("%s\t%d\twrite >&%d\tread <&%d\t%s\n", c->name, jobs[c->job].last_pid,
+                   c->to_fd, c->from_fd, jobs[c->job].command);
+        }
+        return 0;
+    }
+    if (args[1][0] != '-') {
+        if (!args[2]) {
+            fprintf(stderr, "coproc: usage: coproc NAME cmd [args...]\n");
+            return 2;
+        }
+        return coproc_start(args[1], &args[2]);
+    }
+
+    char op = args[1][1];
+    if (!strchr("wrqck", op) || args[1][2] || !args[2]) {
+        fprintf(stderr, "coproc: usage: coproc [-w | -r | -q | -c | -k] NAME ...\n");
+        return 2;
+    }
+    struct coproc *c = coproc_find(args[2]);
+    if (!c) {
+        fprintf(stderr, "coproc: %s: no such coprocess\n", args[2]);
+        return 1;
+    }
+
+    switch (op) {
+    case 'w':
+        return coproc_write(c, &args[3]);
+    case 'q':
+        if (coproc_write(c, &args[3]) != 0) return 1;
+        return coproc_read_line(c);
+    case 'r': {
+        long lines = args[3] ? strtol(args[3], NULL, 10) : 1;
+        for (long i = 0; i < lines; i++) {
+            int status = coproc_read_line(c);
+            if (status != 0) return status;
+        }
+        return 0;
+    }
+    case 'c':
+        if (c->to_fd >= 0) close(c->to_fd);
+        c->to_fd = -1;
+        return 0;
+    default: {
+        sigset_t old;
+        block_sigchld(&old);
+        signal_job(c->job, SIGTERM);
+        unblock_sigchld(&old);
+        return 0;
+    }
+    }
+}
+
+void memo_file_stat(const char *file, struct stat *st) {
+    /*
+        - Stats a memo dependency file; a missing file is recorded as all zeros.
+    */
+    if (stat(file, st) < 0) memset(st, 0, sizeof(*st));
+}
+
+int memo_valid(const struct memo_entry *e) {
+    /*
+        - Returns 1 if the entry has not expired and none of its files changed since it was made.
+    */
+    if (e->ttl > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - e->created.tv_sec >= e->ttl) return 0;
+    }
+    for (int i = 0; i < e->nfiles; i++) {
+        struct stat st;
+        memo_file_stat(e->files[i], &st);
+        if (st.st_mtim.tv_sec != e->file_stats[i].st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != e->file_stats[i].st_mtim.tv_nsec ||
+            st.st_size != e->file_stats[i].st_size || st.st_ino != e->file_stats[i].st_ino) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The table lists memo itself, so memo needs the lookup declared ahead of it
+const struct builtin *find_builtin(const char *name);
+
+int run_builtin_memo(char **args) {
+    /*
+        - Built-in prefix 'memo [-t SECONDS] [-f FILE]... [-e VAR]... cmd [args...]'.
+        - Runs cmd once with stdout captured in a memfd (as 'par -g' does), prints the output
+          and keeps it with the exit status. Later calls with the same key print the cached
+          output and return the cached status without starting anything.
+        - The key is the working directory, argv and the values of the -e variables.
+        - -t expires the result after SECONDS; -f drops it when FILE changes (mtime, size or
+          inode). Without either the result stays valid for the life of the shell.
+        - 'memo -c' clears the cache; 'memo' alone lists it. Builtins are run directly, and
+          outputs over MEMO_MAX_OUTPUT or stopped commands are not cached.
+    */
+    if (!args[1]) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int b = 0; b < MEMO_BUCKETS; b++) {
+            for (struct memo_entry *e = memo_table[b]; e; e = e->next) {
+                // Show the argv part of the key with spaces
+                const char *argv_part = strchr(e->key, '\x1f');
+                out_printf("%6zu bytes  status %3d  age %4lds  %s  ", e->output_len, e->status,
+                       (long)(now.tv_sec - e->created.tv_sec), memo_valid(e) ? "valid  " : "expired");
+                for (const char *c = argv_part ? argv_part + 1 : ""; *c && *c != '\x1e'; c++) {
+                    out_write(*c == '\x1f' ? " " : c, 1);
+                }
+                out_write("\n", 1);
+            }
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "-c") == 0 && !args[2]) {
+        memset(memo_table, 0, sizeof(memo_table));
+        arena_reset(&memo_arena);
+        return 0;
+    }
+
+    long ttl = 0;
+    int nfiles = 0, nvars = 0;
+    char **files = NULL, **vars = NULL;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (!args[i + 1] || (strcmp(args[i], "-t") && strcmp(args[i], "-f") && strcmp(args[i], "-e"))) {
+            fprintf(stderr, "memo: usage: memo [-t SECONDS] [-f FILE]... [-e VAR]... cmd [args...]\n");
+            return 2;
+        }
+        char *value = args[++i];
+        if (args[i - 1][1] == 't') {
+            ttl = strtol(value, NULL, 10);
+        } else if (args[i - 1][1] == 'f') {
+            files = arena_grow(&line_arena, files, nfiles * sizeof(char *), (nfiles + 1) * sizeof(char *));
+            files[nfiles++] = value;
+        } else {
+            vars = arena_grow(&line_arena, vars, nvars * sizeof(char *), (nvars + 1) * sizeof(char *));
+            vars[nvars++] = value;
+        }
+    }
+    char **cmd = &args[i];
+    if (!cmd[0]) {
+        fprintf(stderr, "memo: command required\n");
+        return 2;
+    }
+    const struct builtin *b = find_builtin(cmd[0]);
+    if (b) return b->fn(cmd);
+
+    // Key: cwd, then argv, then VAR=value for every -e variable
+    char cwd[1024];
+    if (!getcwd(cwd, sizeof(cwd))) cwd[0] = '\0';
+    size_t key_len = strlen(cwd) + 2;
+    for (int k = 0; cmd[k]; k++) key_len += strlen(cmd[k]) + 1;
+    for (int k = 0; k < nvars; k++) {
+        const char *v = var_get(vars[k]);
+        key_len += strlen(vars[k]) + (v ? strlen(v) : 0) + 2;
+    }
+    char *key = arena_alloc(&line_arena, key_len + 1);
+    char *w = stpcpy(key, cwd);
+    for (int k = 0; cmd[k]; k++) {
+        *w++ = '\x1f';
+        w = stpcpy(w, cmd[k]);
+    }
+    *w++ = '\x1e';
+    for (int k = 0; k < nvars; k++) {
+        const char *v = var_get(vars[k]);
+        w += sprintf(w, "%s=%s\x1f", vars[k], v ? v : "");
+    }
+    *w = '\0';
+
+    unsigned int h = hash_string(key);
+    struct memo_entry **link = &memo_table[h % MEMO_BUCKETS];
+    for (struct memo_entry **l = link; *l; l = &(*l)->next) {
+        struct memo_entry *e = *l;
+        if (e->hash != h || strcmp(e->key, key) != 0) continue;
+        if (memo_valid(e)) {
+            out_ref(e->output, e->output_len);
+            return e->status;
+        }
+        *l = e->next;  // Stale: unlink and run again
+        break;
+    }
+
+    // Run it with stdout captured, then print the capture; without a memfd it just runs uncached
+    int fd = memfd_create("memo-output", MFD_CLOEXEC);
+    if (fd < 0) perror("memo: memfd_create");
+    struct stat before[nfiles + 1];
+    for (int k = 0; k < nfiles; k++) memo_file_stat(files[k], &before[k]);
+
+    struct spawn_fds fds = { 0 };
+    if (fd >= 0) spawn_fds_add(&fds, fd, STDOUT_FILENO);
+    sigset_t old;
+    block_sigchld(&old);
+    int j = start_command(cmd, current_command, 0, &fds);
+    int code = j < 0 ? 127 : wait_for_job(j);
+    unblock_sigchld(&old);
+    if (fd < 0) return code;
+    copy_to_stdout(fd);
+
+    struct stat st;
+    if (j >= 0 && code != 128 + SIGTSTP && fstat(fd, &st) == 0 && st.st_size <= MEMO_MAX_OUTPUT) {
+        if (memo_arena.total > MEMO_BYTES) {
+            memset(memo_table, 0, sizeof(memo_table));
+            arena_reset(&memo_arena);
+        }
+        struct memo_entry *e = arena_alloc(&memo_arena, sizeof(*e));
+        e->hash = h;
+        e->key = arena_strndup(&memo_arena, key, strlen(key));
+        e->output_len = st.st_size;
+        e->output = arena_alloc(&memo_arena, st.st_size + 1);
+        if (pread(fd, e->output, st.st_size, 0) != st.st_size) e->output_len = 0;
+        e->status = code;
+        clock_gettime(CLOCK_MONOTONIC, &e->created);
+        e->ttl = ttl;
+        e->nfiles = nfiles;
+        e->files = arena_alloc(&memo_arena, (nfiles + 1) * sizeof(char *));
+        e->file_stats = arena_alloc(&memo_arena, (nfiles + 1) * sizeof(struct stat));
+        for (int k = 0; k < nfiles; k++) {
+            e->files[k] = arena_strndup(&memo_arena, files[k], strlen(files[k]));
+            e->file_stats[k] = before[k];  // As seen before the run, so a change during it invalidates
+        }
+        e->next = memo_table[h % MEMO_BUCKETS];
+        memo_table[h % MEMO_BUCKETS] = e;
+    }
+    close(fd);
+    return code;
+}
+
+void limit_begin(struct limit_state *s, const struct job_limits *l) {
+    /*
+        - Makes l the active limit: creates its cgroup if it has --cpu or --mem, and works out
+          the affinity for --cpus, or for --cpu when no cgroup could be made (N CPUs of
+          bandwidth are then approximated by N CPUs to run on).
+    */
+    memset(s, 0, sizeof(*s));
+    s->limits = l;
+    s->procs_fd = -1;
+    if (l->cpu_milli || l->mem) limit_cgroup_create(s);
+    if (l->set_cpus) {
+        s->cpus = l->cpus;
+        s->set_cpus = 1;
+    } else if (l->cpu_milli && !s->cgroup[0]) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            long want = (l->cpu_milli + 999) / 1000;
+            CPU_ZERO(&s->cpus);
+            for (int c = 0; c < CPU_SETSIZE && want > 0; c++) {
+                if (CPU_ISSET(c, &allowed)) {
+                    CPU_SET(c, &s->cpus);
+                    want--;
+                }
+            }
+            s->set_cpus = 1;
+        }
+    }
+    s->first_stage = time_current.count;
+    s->outer = active_limit;
+    active_limit = s;
+}
+
+void limit_cleanup() {
+    /*
+        - Removes the leftover cgroups that have become empty.
+    */
+    limit_cleanup_due = 0;
+    struct limit_leftover **link = &limit_leftovers;
+    while (*link) {
+        struct limit_leftover *e = *link;
+        if (rmdir(e->path) == 0 || errno == ENOENT) {
+            *link = e->next;
+            free(e->path);
+            free(e);
+        } else {
+            link = &e->next;
+        }
+    }
+}
+
+void limit_cleanup_detach() {
+    /*
+        - At exit: the cgroups of jobs that are still running cannot be removed yet, so a
+          detached child stays behind and removes each one once its last process has exited.
+          cgroup.events then reads 'populated 0', and poll() wakes on every change to it
+          (POLLPRI); the files are opened before each removal attempt, so no change is missed.
+    */
+    limit_cleanup();
+    if (!limit_leftovers) return;
+    out_flush();
+    fflush(stderr);
+    if (fork() != 0) return;
+    setsid();
+    signal(SIGHUP, SIG_IGN);
+    int null = open("/dev/null", O_RDWR);
+    for (int fd = 0; fd < 3 && null >= 0; fd++) dup2(null, fd);
+    close_range(3, ~0U, 0);
+
+    while (limit_leftovers) {
+        int n = 0;
+        for (struct limit_leftover *e = limit_leftovers; e; e = e->next) n++;
+        struct pollfd fds[n];
+        n = 0;
+        for (struct limit_leftover *e = limit_leftovers; e; e = e->next) {
+            char events[PATH_MAX + 16];
+            snprintf(events, sizeof(events), "%s/cgroup.events", e->path);
+            fds[n].fd = open(events, O_RDONLY | O_CLOEXEC);
+            fds[n].events = POLLPRI;
+            n++;
+        }
+        limit_cleanup();
+        if (limit_leftovers) poll(fds, n, -1);
+        for (int i = 0; i < n; i++) {
+            if (fds[i].fd >= 0) close(fds[i].fd);
+        }
+    }
+    _exit(0);
+}
+
+void limit_end(struct limit_state *s) {
+    /*
+        - Deactivates the limit and reports on stderr what it did: for a cgroup the CPU
+          throttling (cpu.stat) and peak memory and OOM kills (memory.peak, memory.events),
+          then the CPU time and max RSS of the processes that ran under it, from the rusage
+          that 'time' collects.
+        - Removes the cgroup, or keeps it for limit_cleanup while processes remain in it
+          (background or stopped jobs).
+    */
+    active_limit = s->outer;
+    const struct job_limits *l = s->limits;
+    char text[1024];
+    fprintf(stderr, "limit:");
+    if (l->cpu_milli && s->cgroup[0] && read_control_file(s->cgroup, "cpu.stat", text, sizeof(text)) == 0) {
+        fprintf(stderr, " cpu %.2f: %ld of %ld periods throttled, %.3fs;", l->cpu_milli / 1000.0,
+                cgroup_stat(text, "nr_throttled"), cgroup_stat(text, "nr_periods"),
+                cgroup_stat(text, "throttled_usec") / 1e6);
+    }
+    if (l->mem && s->cgroup[0]) {
+        long peak = read_control_file(s->cgroup, "memory.peak", text, sizeof(text)) == 0 ? strtol(text, NULL, 10) : -1;
+        long kills = read_control_file(s->cgroup, "memory.events", text, sizeof(text)) == 0 ? cgroup_stat(text, "oom_kill") : -1;
+        fprintf(stderr, " memory %ldKB: peak %ldKB, %ld OOM kills;", l->mem >> 10, peak < 0 ? -1 : peak >> 10, kills);
+    } else if (l->mem) {
+        fprintf(stderr, " memory %ldKB (RLIMIT_AS);", l->mem >> 10);
+    }
+    if (s->set_cpus) fprintf(stderr, " %d CPUs%s;", CPU_COUNT(&s->cpus), l->set_cpus ? "" : " (no cgroup for --cpu)");
+    if (l->set_nice) fprintf(stderr, " nice %+d;", l->nice);
+
+    double user = 0, sys = 0;
+    long maxrss = 0;
+    for (int i = s->first_stage; i < time_current.count; i++) {
+        const struct rusage *u = &time_current.stages[i].usage;
+        user += u->ru_utime.tv_sec + u->ru_utime.tv_usec / 1e6;
+        sys += u->ru_stime.tv_sec + u->ru_stime.tv_usec / 1e6;
+        if (u->ru_maxrss > maxrss) maxrss = u->ru_maxrss;
+    }
+    fprintf(stderr, " %d processes, user %.3fs, sys %.3fs, maxrss %ldKB\n",
+            time_current.count - s->first_stage, user, sys, maxrss);
+
+    if (s->procs_fd >= 0) close(s->procs_fd);
+    if (s->cgroup[0] && rmdir(s->cgroup) < 0 && errno == EBUSY) {
+        struct limit_leftover *e = malloc(sizeof(*e));
+        e->path = strdup(s->cgroup);
+        e->next = limit_leftovers;
+        limit_leftovers = e;
+    }
+    limit_cleanup();
+}
+
+int run_builtin_limit(char **args) {
+    /*
+        - Builtin form of the 'limit' prefix: 'limit [--cpu N] [--mem SIZE] [--nice N]
+          [--cpus LIST] cmd [args...]', for where the prefix is not parsed (a pipeline stage,
+          after 'memo'). The prefix form limits a whole pipeline or '&&' list.
+        - Utility builtins run from PATH under a limit, so it has a process to act on; other
+          builtins run in the shell and are not limited.
+    */
+    struct job_limits l;
+    memset(&l, 0, sizeof(l));
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; i += 2) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (!args[i + 1] || limit_option(&l, args[i], args[i + 1]) < 0) {
+            fprintf(stderr, "limit: usage: limit [--cpu N] [--mem SIZE] [--nice N] [--cpus LIST] cmd [args...]\n");
+            return 2;
+        }
+    }
+    char **cmd = &args[i];
+    if (!cmd[0]) {
+        fprintf(stderr, "limit: command required\n");
+        return 2;
+    }
+    struct limit_state s;
+    limit_begin(&s, &l);
+    const struct builtin *b = find_builtin(cmd[0]);
+    int code = b ? b->fn(cmd) : run_external(cmd);
+    limit_end(&s);
+    return code;
+}
+
+// run_line and exec_node are reached again from builtins ('history -i') and subshells
+int run_line(char *line);
+int exec_node(struct node *n);
+
+int run_builtin_history(char **args) {
+    /*
+        - Built-in command handler for 'history'.
+        - 'history -i' starts the incremental reverse search; the accepted entry is echoed
+          and run like a typed line (run_line is defined further down, hence the prototype).
+        - Any other form lists entries through show_history.
+    */
+    if (args[1] && strcmp(args[1], "-i") == 0) {
+        char *picked = history_search_interactive();
+        if (!picked) return 1;
+        out_printf("%s\n", picked);
+        run_line(picked);
+        return last_status;
+    }
+    return show_history(args);
+}
+
+int run_builtin_exit(char **args) {
+    /*
+        - Built-in command handler for 'exit'.
+        - Asks the main loop to stop after the current line; the shell exits with args[1],
+          or with the status of the last command if no argument is given.
+    */
+    exit_requested = 1;
+    if (args[1]) last_status = atoi(args[1]) & 0xff;
+    return last_status;
+}
+
+// Builtin dispatch table; every executor looks commands up here before searching PATH
+const struct builtin builtins[] = {
+    { "cd", run_builtin_cd, 0 },            // Change directory
+    { "pwd", run_builtin_pwd, 0 },          // Print working directory
+    { "exit", run_builtin_exit, 0 },        // Exit the shell loop
+    { "history", run_builtin_history, 0 },  // Display or search command history
+    { "hash", run_builtin_hash, 0 },        // Show or reset the command-location cache
+    { "jobs", run_builtin_jobs, 0 },        // List background and stopped jobs
+    { "fg", run_builtin_fg, 0 },            // Bring a job to the foreground
+    { "bg", run_builtin_bg, 0 },            // Continue a stopped job in the background
+    { "wait", run_builtin_wait, 0 },        // Wait for background jobs
+    { "kill", run_builtin_kill, 0 },        // Signal jobs or processes
+    { "par", run_builtin_par, 0 },          // Run a command over many inputs in parallel
+    { "set", run_builtin_set, 0 },          // Show or change shell options
+    { "coproc", run_builtin_coproc, 0 },    // Start and talk to long-lived coprocesses
+    { "memo", run_builtin_memo, 0 },        // Cache the output of repeated commands
+    { "export", run_builtin_export, 0 },    // Export shell variables to commands
+    { "unset", run_builtin_unset, 0 },      // Remove shell variables
+    { "limit", run_builtin_limit, 0 },      // Run a command under CPU and memory limits
+    { "@", run_builtin_remote, 0 },         // Run a command on a host group over shared ssh connections
+    { "echo", run_builtin_echo, 1 },        // In-process versions of common utilities
+    { "printf", run_builtin_printf, 1 },
+    { "test", run_builtin_test, 1 },
+    { "[", run_builtin_test, 1 },
+    { "true", run_builtin_true, 1 },
+    { "false", run_builtin_false, 1 },
+    { "cat", run_builtin_cat, 1 },
+};
+
+const struct builtin *find_builtin(const char *name) {
+    /*
+        - Returns the builtin table entry for name, or NULL if name is not a builtin.
+        - Every '@GROUP' word is the '@' entry.
+        - Utility builtins are not found under 'set -o posix', so the programs run instead,
+          nor under 'limit', which needs a process to apply to.
+    */
+    if (name[0] == '@') name = "@";  // '@GROUP' runs on a host group
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return builtins[i].utility && (opt_posix || active_limit) ? NULL : &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+int run_builtin(const struct builtin *b, char **args) {
+    /*
+        - Runs a builtin inside the shell process and returns its exit status.
+        - Flushes the output buffer afterwards, so its output is on the file descriptor before the
+          caller moves descriptors back or starts the next command.
+    */
+    uint64_t trace_start = trace_now();
+    int status = b->fn(args);
+    out_flush();
+    trace_record(TRACE_BUILTIN, trace_start, 0, status, args[0]);
+    return status;
+}
+
+void fork_child_setup(int job) {
+    /*
+        - Runs in a child forked for job (a builtin stage or a background subshell) before
+          it does anything else.
+        - Joins the job's process group like a spawned stage, takes the terminal if it starts
+          a foreground group, and restores the default dispositions of the signals the
+          interactive shell ignores, plus the shell's original signal mask.
+        - The child keeps the SIGCHLD handler but starts with an empty job table of its own and
+          without job control, so commands it starts (a builtin like 'memo' or 'par', or a
+          subshell's list) are waited for normally and stay in the job's process group.
+        - The parent's event loop is closed; the child's first wait opens one of its own.
+    */
+    if (job_control) {
+        setpgid(0, jobs[job].pgid);
+        if (!jobs[job].background && jobs[job].pgid == 0) tcsetpgrp(STDIN_FILENO, getpid());
+    }
+    job_control = 0;
+    memset(procs, 0, sizeof(procs));
+    event_close();
+    job_free_top = 0;
+    for (int k = MAX_JOBS - 1; k >= 0; k--) {
+        jobs[k].state = JOB_FREE;
+        job_free_list[job_free_top++] = k;
+    }
+    int defaults[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+    for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) signal(defaults[i], SIG_DFL);
+    sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+    // Under 'limit' the child enters the limit now; what it starts inherits it from here
+    if (active_limit) {
+        limit_apply(active_limit);
+        active_limit = NULL;
+    }
+}
+
+int fork_builtin(pid_t *pid, const struct builtin *b, const struct node *cmd, const int *src,
+                 int in_fd, int out_fd, int job) {
+    /*
+        - Runs a builtin in a forked child as a member of job, for builtins that cannot run in
+          the shell process (earlier pipeline stages, background jobs).
+        - in_fd and out_fd, if not -1, become the child's stdin and stdout; then the command's
+          redirections (resolved by redirect_open into src) are applied. Pipe descriptors
+          are O_CLOEXEC but the child never execs, so it closes every pipeline pipe the shell
+          holds (stage_pipe_fds, including those of an enclosing pipeline) itself, and the
+          coprocess pipes (coproc_close_fds).
+        - The child is set up by fork_child_setup.
+        - Must be called with SIGCHLD blocked. Returns 0, or an errno value if fork failed or
+          the process table is full.
+    */
+    out_flush();
+    fflush(stderr);
+    pid_t child = fork();
+    if (child < 0) return errno;
+
+    if (child == 0) {
+        fork_child_setup(job);
+
+        if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+        if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+        for (int i = 0; i < stage_pipe_count; i++) close(stage_pipe_fds[i]);
+        stage_pipe_count = 0;
+        if (redirect_apply(cmd, src, NULL) < 0) _exit(1);
+        coproc_close_fds(cmd);
+        int status = b->fn(cmd->argv);
+        out_flush();
+        _exit(status);
+    }
+
+    // Set the group from the parent too, so it exists before the next stage tries to join it
+    if (job_control) setpgid(child, jobs[job].pgid ? jobs[job].pgid : child);
+    *pid = child;
+    return job_add_process(job, child, cmd->argv[0]) < 0 ? EAGAIN : 0;
+}
+
+// Fields produced by expanding one or more words; the field being built grows in buf
+struct fields {
+    char **items;
+    int count;
+    int cap;
+    char *buf;
+    size_t len;
+    size_t buf_cap;
+    char *pat;       // With glob set: the current field as a pattern, quoted characters escaped
+    size_t pat_len;
+    size_t pat_cap;
+    int glob;        // Fields are subject to pathname expansion (command words)
+    int has_glob;    // The current field has an unquoted glob character
+    int started;     // The current field exists even if empty (it had quotes)
+    int drop_empty;  // The current field only has quotes around an empty "$@"
+};
+
+void text_append(char **buf, size_t *len, size_t *cap, const char *s, size_t n) {
+    /*
+        - Appends s[0, n) to a NUL-terminated buffer growing in line_arena.
+    */
+    if (*len + n + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 64;
+        while (new_cap < *len + n + 1) new_cap *= 2;
+        *buf = arena_grow(&line_arena, *buf, *cap, new_cap);
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+void fields_append(struct fields *f, const char *s, size_t n) {
+    /*
+        - Appends literal text to the current field; in the pattern, glob characters are
+          escaped so they only match themselves.
+    */
+    text_append(&f->buf, &f->len, &f->buf_cap, s, n);
+    f->started = 1;
+    if (!f->glob) return;
+    for (size_t i = 0; i < n; i++) {
+        if (strchr("*?[]\\", s[i])) text_append(&f->pat, &f->pat_len, &f->pat_cap, "\\", 1);
+        text_append(&f->pat, &f->pat_len, &f->pat_cap, s + i, 1);
+    }
+}
+
+void fields_append_pattern(struct fields *f, const char *s, size_t n) {
+    /*
+        - Appends unquoted text to the current field, whose glob characters stay active.
+    */
+    text_append(&f->buf, &f->len, &f->buf_cap, s, n);
+    f->started = 1;
+    if (!f->glob) return;
+    text_append(&f->pat, &f->pat_len, &f->pat_cap, s, n);
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[') f->has_glob = 1;
+    }
+}
+
+void fields_push(struct fields *f, const char *s, size_t n) {
+    /*
+        - Appends a copy of s[0, n) as a finished field, keeping room for the NULL terminator.
+    */
+    if (f->count + 1 >= f->cap) {
+        int cap = f->cap ? f->cap * 2 : 8;
+        f->items = arena_grow(&line_arena, f->items, f->cap * sizeof(char *), cap * sizeof(char *));
+        f->cap = cap;
+    }
+    f->items[f->count++] = arena_strndup(&line_arena, s, n);
+}
+
+struct dir_listing *dir_read(const char *path) {
+    /*
+        - Returns the entries of directory path ('' for the current directory), or NULL if
+          it cannot be read.
+        - A cached listing is used while the directory's device, inode and mtime match it;
+          any entry created, removed or renamed changes the mtime, so nothing is read then.
+        - A listing taken within DIR_CACHE_SETTLE seconds of the mtime is not reused: a change
+          in the same timestamp tick leaves the mtime as it was, so it may already be stale.
+        - Also called by the completion thread: the cache is only touched under
+          dir_cache_lock, and the directory is read without holding it.
+    */
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    unsigned int bucket = (unsigned int)(st.st_ino ^ st.st_dev) % DIR_CACHE_BUCKETS;
+    struct dir_listing *d;
+    pthread_mutex_lock(&dir_cache_lock);
+    for (d = dir_cache[bucket]; d; d = d->next) {
+        if (d->ino == st.st_ino && d->dev == st.st_dev && d->settled &&
+            d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+    if (d) {
+        close(fd);
+        return d;
+    }
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return NULL;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    char *text = NULL;
+    size_t text_len = 0, text_cap = 0;
+    unsigned char *types = NULL;
+    int count = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2]))) continue;
+        size_t n = strlen(e->d_name) + 1;
+        if (text_len + n > text_cap) {
+            text_cap = text_cap ? text_cap * 2 : 4096;
+            while (text_cap < text_len + n) text_cap *= 2;
+            text = realloc(text, text_cap);
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            types = realloc(types, cap);
+        }
+        memcpy(text + text_len, e->d_name, n);
+        text_len += n;
+        types[count++] = e->d_type;
+    }
+    closedir(dir);
+
+    // Copy the listing into the cache, replacing an older listing of the same directory
+    pthread_mutex_lock(&dir_cache_lock);
+    d = arena_alloc(&dir_arena, sizeof(*d));
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    d->settled = now.tv_sec - st.st_mtim.tv_sec >= DIR_CACHE_SETTLE;
+    d->count = count;
+    d->names = arena_alloc(&dir_arena, (count + 1) * sizeof(char *));
+    d->types = arena_alloc(&dir_arena, count + 1);
+    if (count) memcpy(d->types, types, count);
+    char *names = arena_alloc(&dir_arena, text_len + 1);
+    if (text_len) memcpy(names, text, text_len);
+    for (int k = 0; k < count; k++) {
+        d->names[k] = names;
+        names += strlen(names) + 1;
+    }
+    struct dir_listing **link = &dir_cache[bucket];
+    while (*link) {
+        if ((*link)->ino == st.st_ino && (*link)->dev == st.st_dev) *link = (*link)->next;
+        else link = &(*link)->next;
+    }
+    d->next = dir_cache[bucket];
+    dir_cache[bucket] = d;
+    pthread_mutex_unlock(&dir_cache_lock);
+    free(text);
+    free(types);
+    return d;
+}
+
+int glob_has_magic(const char *p, size_t n) {
+    /*
+        - Returns whether the pattern component p[0, n) has an unescaped '*', '?' or a
+          '[' with a closing ']'.
+    */
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] == '\\') i++;
+        else if (p[i] == '*' || p[i] == '?') return 1;
+        else if (p[i] == '[' && memchr(p + i + 1, ']', n - i - 1)) return 1;
+    }
+    return 0;
+}
+
+int compare_strings(const void *a, const void *b) {
+    /*
+        - qsort comparator for an array of C strings, in strcmp order.
+    */
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int glob_walk(char *path, size_t len, const char *pat, struct fields *f) {
+    /*
+        - Matches the pattern pat against the entries below the directory path[0, len) ('' or
+          ending in '/') and pushes every path that matches, in sorted order.
+        - pat is matched one component at a time: literal components are only checked to
+          exist, other ones are matched against the directory's (cached) listing.
+        - '*SUFFIX' components, as in '*.c', are compared directly instead of by fnmatch.
+        - A component followed by '/' only matches directories. Names starting with '.'
+          are only matched by a pattern starting with '.'.
+        - Returns the number of paths pushed.
+    */
+    const char *slash = strchr(pat, '/');
+    size_t n = slash ? (size_t)(slash - pat) : strlen(pat);
+    const char *rest = slash ? slash + 1 : NULL;
+    char comp[n + 1];
+    memcpy(comp, pat, n);
+    comp[n] = '\0';
+
+    if (!glob_has_magic(comp, n)) {
+        // Literal component: unescape it and go on if it exists
+        size_t w = len;
+        for (size_t i = 0; i < n && w + 2 < PATH_MAX; i++) {
+            if (comp[i] == '\\' && i + 1 < n) i++;
+            path[w++] = comp[i];
+        }
+        path[w] = '\0';
+        struct stat st;
+        if (!rest) {
+            if (lstat(path, &st) < 0) return 0;
+            fields_push(f, path, w);
+            return 1;
+        }
+        if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return 0;
+        path[w++] = '/';
+        path[w] = '\0';
+        if (!*rest) {
+            fields_push(f, path, w);
+            return 1;
+        }
+        return glob_walk(path, w, rest, f);
+    }
+
+    path[len] = '\0';
+    struct dir_listing *d = dir_read(path);
+    if (!d) return 0;
+    // A '*' followed only by ordinary characters is a suffix test
+    const char *suffix = NULL;
+    size_t suffix_len = 0;
+    if (comp[0] == '*' && !strpbrk(comp + 1, "*?[\\")) {
+        suffix = comp + 1;
+        suffix_len = n - 1;
+    }
+    char **matches = arena_alloc(&line_arena, (d->count + 1) * sizeof(char *));
+    int nmatches = 0;
+    for (int k = 0; k < d->count; k++) {
+        const char *name = d->names[k];
+        if (suffix) {
+            size_t name_len = strlen(name);
+            if (name[0] == '.' || name_len < suffix_len ||
+                memcmp(name + name_len - suffix_len, suffix, suffix_len) != 0) {
+                continue;
+            }
+        } else if (fnmatch(comp, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        if (rest && d->types[k] != DT_DIR && d->types[k] != DT_LNK && d->types[k] != DT_UNKNOWN) continue;
+        matches[nmatches++] = (char *)name;
+    }
+    qsort(matches, nmatches, sizeof(char *), compare_strings);
+
+    int found = 0;
+    for (int k = 0; k < nmatches; k++) {
+        size_t name_len = strlen(matches[k]);
+        if (len + name_len + 2 >= PATH_MAX) continue;
+        memcpy(path + len, matches[k], name_len + 1);
+        size_t w = len + name_len;
+        if (!rest) {
+            fields_push(f, path, w);
+            found++;
+            continue;
+        }
+        struct stat st;
+        if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) continue;
+        path[w++] = '/';
+        path[w] = '\0';
+        if (*rest) {
+            found += glob_walk(path, w, rest, f);
+        } else {
+            fields_push(f, path, w);
+            found++;
+        }
+    }
+    return found;
+}
+
+int glob_expand(const char *pat, struct fields *f) {
+    /*
+        - Pushes the paths matching pat as fields and returns their number.
+    */
+    if (dir_arena.total > DIR_CACHE_BYTES) {
+        pthread_mutex_lock(&dir_cache_lock);
+        memset(dir_cache, 0, sizeof(dir_cache));
+        arena_reset(&dir_arena);
+        pthread_mutex_unlock(&dir_cache_lock);
+    }
+    char path[PATH_MAX];
+    size_t len = 0;
+    if (*pat == '/') {
+        path[len++] = '/';
+        while (*pat == '/') pat++;
+    }
+    return glob_walk(path, len, pat, f);
+}
+
+void fields_end(struct fields *f) {
+    /*
+        - Finishes the current field, if there is one, and pushes a copy of it.
+        - A field with unquoted glob characters is replaced by the paths it matches, or kept
+          as it is if it matches none.
+    */
+    if (f->started && !(f->drop_empty && f->len == 0)) {
+        if (!f->has_glob || glob_expand(f->pat, f) == 0) fields_push(f, f->buf ? f->buf : "", f->len);
+    }
+    f->len = 0;
+    f->pat_len = 0;
+    f->has_glob = 0;
+    f->started = 0;
+    f->drop_empty = 0;
+}
+
+void expand_text(const char *s, size_t n, struct fields *f, int split);
+
+char *expand_string(const char *s, size_t n) {
+    /*
+        - Expands s[0, n) into a single string, without field splitting (assignments,
+          redirection targets, the word of '${NAME:-word}').
+    */
+    struct fields f = { 0 };
+    expand_text(s, n, &f, 0);
+    char *result = arena_strndup(&line_arena, f.buf ? f.buf : "", f.len);
+    return result;
+}
+
+const char *param_get(const char *name, size_t len) {
+    /*
+        - Returns the value of one parameter: a variable, a positional parameter ($1, ${10}),
+          or one of the special parameters $? $$ $! $# $0 $* $@. NULL if it is unset.
+        - Numbers are formatted into line_arena.
+    */
+    char number[24];
+    if (isdigit((unsigned char)name[0])) {
+        long i = 0;
+        for (size_t k = 0; k < len && i <= shell_nargs; k++) i = i * 10 + (name[k] - '0');
+        if (i == 0) return shell_args[0];
+        return i <= shell_nargs ? shell_args[i] : NULL;
+    }
+    if (len == 1 && strchr("?$!#*@", name[0])) {
+        switch (name[0]) {
+        case '?': snprintf(number, sizeof(number), "%d", last_status); break;
+        case '$': snprintf(number, sizeof(number), "%d", (int)shell_pid); break;
+        case '!':
+            if (!last_background_pid) return NULL;
+            snprintf(number, sizeof(number), "%d", (int)last_background_pid);
+            break;
+        case '#': snprintf(number, sizeof(number), "%d", shell_nargs); break;
+        default: {
+            size_t total = 1;
+            for (int i = 1; i <= shell_nargs; i++) total += strlen(shell_args[i]) + 1;
+            char *joined = arena_alloc(&line_arena, total), *w = joined;
+            *w = '\0';
+            for (int i = 1; i <= shell_nargs; i++) {
+                if (i > 1) *w++ = ' ';
+                w = stpcpy(w, shell_args[i]);
+            }
+            return joined;
+        }
+        }
+        return arena_strndup(&line_arena, number, strlen(number));
+    }
+    return var_get_n(name, len);
+}
+
+const char *param_expand(const char *expr, size_t len) {
+    /*
+        - Expands the inside of '${...}': NAME, #NAME (length), or NAME followed by one of
+          -  =  +  ?  with an optional ':' that makes an empty value count as unset:
+          '${A:-word}' uses word if A is unset or empty, ':=' also assigns it, ':+' uses word
+          only if A is set, ':?' prints word as an error if A is unset.
+        - Returns NULL for an unset parameter; prints an error for anything else.
+    */
+    int length = len > 1 && expr[0] == '#';
+    const char *name = expr + length;
+    size_t rest = len - length;
+    size_t name_len = var_name_length(name);
+    if (!name_len && rest > 0) {
+        name_len = isdigit((unsigned char)name[0]) ? strspn(name, "0123456789") :
+                   strchr("?$!#*@", name[0]) ? 1 : 0;
+        if (name_len > rest) name_len = rest;
+    }
+    const char *value = name_len ? param_get(name, name_len) : NULL;
+    if (length) {
+        if (name_len != rest) goto bad;
+        char number[24];
+        snprintf(number, sizeof(number), "%zu", value ? strlen(value) : 0);
+        return arena_strndup(&line_arena, number, strlen(number));
+    }
+    if (name_len == rest && name_len) return value;
+    if (!name_len) goto bad;
+
+    const char *op = name + name_len;
+    int colon = *op == ':';
+    op += colon;
+    if (!strchr("-=+?", *op) || op >= expr + len) goto bad;
+    int unset = !value || (colon && !value[0]);
+    const char *word_start = op + 1;
+    size_t word_len = expr + len - word_start;
+
+    switch (*op) {
+    case '-':
+        return unset ? expand_string(word_start, word_len) : value;
+    case '+':
+        return unset ? "" : expand_string(word_start, word_len);
+    case '=':
+        if (!unset) return value;
+        if (!var_name_length(name) || var_name_length(name) != name_len) goto bad;
+        {
+            char *word = expand_string(word_start, word_len);
+            char var[name_len + 1];
+            memcpy(var, name, name_len);
+            var[name_len] = '\0';
+            var_set(var, word, 0);
+            return word;
+        }
+    default:
+        if (!unset) return value;
+        fprintf(stderr, "%.*s: %s\n", (int)name_len, name,
+                word_len ? expand_string(word_start, word_len) : "parameter null or not set");
+        return NULL;
+    }
+
+bad:
+    fprintf(stderr, "${%.*s}: bad substitution\n", (int)len, expr);
+    return NULL;
+}
+
+const char *brace_end(const char *p) {
+    /*
+        - Returns the '}' closing the '{' at p, skipping nested '${...}', or NULL if none.
+    */
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '{') depth++;
+        else if (*p == '}' && --depth == 0) return p;
+    }
+    return NULL;
+}
+
+size_t expand_dollar(const char *s, size_t i, struct fields *f, int split, int quoted) {
+    /*
+        - Expands the '$' at s[i] into f and returns the position after the expansion.
+        - In a command word (split set) an unquoted value is split into fields at blanks,
+          and "$@" gives one field per positional parameter, or none if there are none.
+        - A '$' that starts no expansion is kept as is.
+    */
+    const char *expr = s + i + 1;
+    size_t len, next;
+    const char *value;
+    const char *close = *expr == '{' ? brace_end(expr) : NULL;
+    if (close) {
+        expr++;
+        len = close - expr;
+        next = close + 1 - s;
+        value = param_expand(expr, len);
+    } else {
+        len = var_name_length(expr);
+        if (!len && (isdigit((unsigned char)*expr) || (*expr && strchr("?$!#*@", *expr)))) len = 1;
+        if (!len) {
+            fields_append(f, "$", 1);
+            return i + 1;
+        }
+        next = i + 1 + len;
+        value = param_get(expr, len);
+    }
+
+    if (len == 1 && *expr == '@' && quoted && split) {
+        // "$@": every parameter is a field of its own, joined to the text around the quotes
+        if (shell_nargs == 0) f->drop_empty = 1;
+        for (int k = 1; k <= shell_nargs; k++) {
+            if (k > 1) fields_end(f);
+            fields_append(f, shell_args[k], strlen(shell_args[k]));
+        }
+        return next;
+    }
+    if (!value) return next;
+    if (!split || quoted) {
+        fields_append(f, value, strlen(value));
+        return next;
+    }
+    for (const char *v = value; *v;) {
+        size_t blanks = strspn(v, " \t\n");
+        if (blanks) {
+            if (f->started) fields_end(f);
+            v += blanks;
+            continue;
+        }
+        size_t word = strcspn(v, " \t\n");
+        fields_append_pattern(f, v, word);
+        v += word;
+    }
+    return next;
+}
+
+void expand_text(const char *s, size_t n, struct fields *f, int split) {
+    /*
+        - Expands a raw word s[0, n) into f: removes quotes and backslashes like the tokenizer
+          does for plain words, expands '$' parameters, and with split set ends a field at
+          every blank produced by an unquoted expansion.
+    */
+    int quoted = 0;
+    size_t i = 0;
+    while (i < n) {
+        char c = s[i];
+        if (c == '\'' && !quoted) {
+            const char *close = memchr(s + i + 1, '\'', n - i - 1);
+            size_t end = close ? (size_t)(close - s) : n;
+            fields_append(f, s + i + 1, end - i - 1);
+            i = end + 1;
+        } else if (c == '"') {
+            quoted = !quoted;
+            f->started = 1;
+            i++;
+        } else if (c == '\\' && i + 1 < n && (!quoted || strchr("\\\"$`", s[i + 1]))) {
+            fields_append(f, s + i + 1, 1);
+            i += 2;
+        } else if (c == '\\' && !quoted) {
+            i++;  // Trailing backslash is dropped
+        } else if (c == '$') {
+            i = expand_dollar(s, i, f, split, quoted);
+        } else if (!quoted) {
+            fields_append_pattern(f, s + i, 1);
+            i++;
+        } else {
+            fields_append(f, s + i, 1);
+            i++;
+        }
+    }
+}
+
+struct node *expand_command(struct node *cmd) {
+    /*
+        - Returns the command as it is to be run: the command itself if none of its words has
+          quotes or '$' left (the tokenizer removed quotes in place), or else a copy in
+          line_arena with every raw word expanded and quote-removed.
+        - Words of argv are split into fields, so an unset '$A' disappears and '$A' holding
+          'a b' gives two arguments; assignment values and redirection targets are not split.
+        - Expansion happens each time the command runs, so a cached tree stays valid and
+          'A=1; echo $A' sees the assignment made before it on the same line.
+    */
+    if (!cmd->raw) return cmd;
+    struct node *n = arena_alloc(&line_arena, sizeof(*n));
+    *n = *cmd;
+    n->raw = NULL;
+
+    struct fields f = { 0 };
+    f.glob = 1;
+    for (int i = 0; i < cmd->count; i++) {
+        if (cmd->raw[i]) {
+            expand_text(cmd->argv[i], strlen(cmd->argv[i]), &f, 1);
+        } else {
+            fields_append(&f, cmd->argv[i], strlen(cmd->argv[i]));
+        }
+        fields_end(&f);
+    }
+    n->count = f.count;
+    n->argv = arena_alloc(&line_arena, (f.count + 1) * sizeof(char *));
+    memcpy(n->argv, f.items, f.count * sizeof(char *));
+    n->argv[f.count] = NULL;
+
+    if (cmd->nassigns) {
+        n->assigns = arena_alloc(&line_arena, (cmd->nassigns + 1) * sizeof(char *));
+        for (int k = 0; k < cmd->nassigns; k++) {
+            char *a = cmd->assigns[k];
+            if (!cmd->raw[cmd->count + k]) {
+                n->assigns[k] = a;
+                continue;
+            }
+            size_t name = var_name_length(a) + 1;
+            char *value = expand_string(a + name, strlen(a + name));
+            n->assigns[k] = arena_alloc(&line_arena, name + strlen(value) + 1);
+            memcpy(n->assigns[k], a, name);
+            strcpy(n->assigns[k] + name, value);
+        }
+        n->assigns[cmd->nassigns] = NULL;
+    }
+    if (cmd->nredirects) {
+        n->redirects = arena_alloc(&line_arena, cmd->nredirects * sizeof(struct redirect));
+        for (int k = 0; k < cmd->nredirects; k++) {
+            n->redirects[k] = cmd->redirects[k];
+            if (n->redirects[k].raw) {
+                n->redirects[k].target = expand_string(cmd->redirects[k].target, strlen(cmd->redirects[k].target));
+                n->redirects[k].raw = 0;
+            }
+        }
+    }
+    return n;
+}
+
+int execute_command(struct node *cmd, int background) {
+    /*
+        - Executes a simple command; builtins are looked up first.
+        - The command is expanded first (expand_command). A command made only of assignments
+          sets shell variables; assignments before a command only apply to that command.
+        - Redirections are opened first; if one fails the command is not run and 1 is returned.
+          A command made only of redirections ('> file') just opens them.
+        - A foreground builtin runs in the shell process with its redirections applied around
+          it, so 'cd' and friends take effect; a background builtin runs in a forked child job.
+        - Other commands start as a new job via start_command (posix_spawn on the cached
+          PATH location), with the redirections as dup2 file actions.
+        - If background is 0, waits for the command to finish and returns its exit code.
+        - If background is 1, runs the command in the background, prints the job number and PID,
+          and returns 0; the SIGCHLD handler reaps it and reports when it is done.
+        - Returns 127 if the command could not be started.
+    */
+    cmd = expand_command(cmd);
+    char **args = cmd->argv;
+    int src[cmd->nredirects + 1];
+    if (redirect_open(cmd, src) < 0) return 1;
+    if (!args[0]) {
+        for (int i = 0; i < cmd->nassigns; i++) var_assign(cmd->assigns[i]);
+        redirect_close(cmd, src, cmd->nredirects);
+        return 0;
+    }
+
+    // Prefix assignments only apply to this command: builtins see them through var_get,
+    // children get them layered over the environment by env_build
+    char **saved_overlay = env_overlay;
+    if (cmd->nassigns) env_overlay = cmd->assigns;
+
+    const struct builtin *b = find_builtin(args[0]);
+    if (b && !background) {
+        int saved[cmd->nredirects + 1];
+        int code = 1;
+        if (redirect_apply(cmd, src, saved) == 0) {
+            code = run_builtin(b, args);
+            redirect_restore(cmd, saved, cmd->nredirects);
+        }
+        redirect_close(cmd, src, cmd->nredirects);
+        env_overlay = saved_overlay;
+        return code;
+    }
+
+    sigset_t old;
+    block_sigchld(&old);
+
+    int j = -1;
+    if (b) {
+        pid_t pid;
+        j = job_alloc(job_label(cmd), background);
+        if (j >= 0 && fork_builtin(&pid, b, cmd, src, -1, -1, j) != 0) {
+            perror("fork failed");
+            job_free(j);
+            j = -1;
+        }
+    } else {
+        struct spawn_fds fds = { 0 };
+        redirect_actions(&fds, cmd, src);
+        j = start_command(args, job_label(cmd), background, &fds);
+    }
+    env_overlay = saved_overlay;
+    redirect_close(cmd, src, cmd->nredirects);
+    if (j < 0) {
+        unblock_sigchld(&old);
+        return 127;
+    }
+
+    int code = 0;
+    if (!background) {
+        // Wait for child to finish if not background
+        code = wait_for_job(j);
+    } else {
+        // For background process, print job number and process ID and do not wait
+        out_printf("[%d] Process ID: %d\n", j + 1, jobs[j].last_pid);
+        last_background_pid = jobs[j].last_pid;
+    }
+
+    unblock_sigchld(&old);
+    return code;
+}
+void token_push(struct token_list *list, enum token_type type, size_t offset, size_t length) {
+    /*
+        - Appends a token to the list, doubling its capacity in the list's arena when full.
+    */
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 32;
+        list->items = arena_grow(list->arena, list->items,
+                                 list->cap * sizeof(*list->items), cap * sizeof(*list->items));
+        list->cap = cap;
+    }
+    struct token *tok = &list->items[list->count++];
+    tok->type = type;
+    tok->flags = 0;
+    tok->offset = offset;
+    tok->length = length;
+    tok->end = offset + length;
+}
+
+size_t scan_redirect(char *line, size_t start, size_t r, struct token_list *tokens) {
+    /*
+        - Pushes a redirection operator found at line[r] as one TOK_REDIR token spanning
+          line[start, end), where start may point at an fd number written before the operator.
+        - Returns the position after the operator.
+    */
+    size_t end = r + 1;
+    if ((line[r] == '>' && line[r + 1] == '>') || line[r + 1] == '&') end++;
+    token_push(tokens, TOK_REDIR, start, end - start);
+    return end;
+}
+
+size_t scan_dollar(const char *line, size_t r, int *flags) {
+    /*
+        - Skips the '$' at line[r] and, for '${', everything up to the matching '}', so blanks
+          inside '${A:-a b}' do not end the word. Marks the word TOKEN_RAW if the '$' starts
+          an expansion.
+        - Returns the position after it, or (size_t)-1 (after printing an error) if a '${' is
+          not closed.
+    */
+    char next = line[r + 1];
+    if (next == '{') {
+        const char *close = brace_end(line + r + 1);
+        if (!close) {
+            fprintf(stderr, "syntax error: missing '}'\n");
+            return (size_t)-1;
+        }
+        *flags |= TOKEN_RAW;
+        return close + 1 - line;
+    }
+    if (isalnum((unsigned char)next) || (next && strchr("_?$!#*@", next))) *flags |= TOKEN_RAW;
+    return r + 1;
+}
+
+size_t scan_word(const char *line, size_t r, int *flags) {
+    /*
+        - Finds the end of the word starting at line[r], following quotes and escapes.
+        - Sets TOKEN_RAW in flags if the word contains a '$' expansion outside single quotes
+          or an unquoted glob character.
+        - Returns the position after the word, or (size_t)-1 (after printing an error) on an
+          unterminated quote or '${'.
+    */
+    while (r != (size_t)-1 && line[r]) {
+        char c = line[r];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '|' || c == '&' || c == ';' ||
+            c == '<' || c == '>') {
+            break;
+        }
+        if (c == '\\') {
+            r += line[r + 1] ? 2 : 1;
+        } else if (c == '\'') {
+            const char *close = strchr(line + r + 1, '\'');
+            if (!close) {
+                fprintf(stderr, "syntax error: unterminated quote\n");
+                return (size_t)-1;
+            }
+            r = close + 1 - line;
+        } else if (c == '"') {
+            r++;
+            while (r != (size_t)-1 && line[r] && line[r] != '"') {
+                if (line[r] == '\\' && line[r + 1]) r += 2;
+                else if (line[r] == '$') r = scan_dollar(line, r, flags);
+                else r++;
+            }
+            if (r == (size_t)-1) break;
+            if (!line[r]) {
+                fprintf(stderr, "syntax error: unterminated quote\n");
+                return (size_t)-1;
+            }
+            r++;
+        } else if (c == '$') {
+            r = scan_dollar(line, r, flags);
+        } else {
+            // An unquoted '*' or '?', or a '[' closed later in the word, makes it a glob pattern;
+            // a '[' alone, as in '[ -f x ]', does not
+            if (c == '*' || c == '?') *flags |= TOKEN_RAW;
+            if (c == '[' && line[r + 1 + strcspn(line + r + 1, "] \t\n\r|&;<>")] == ']') *flags |= TOKEN_RAW;
+            r++;
+        }
+    }
+    return r;
+}
+
+size_t unquote_word(char *word, size_t len) {
+    /*
+        - Removes quotes and escapes from a word in place: single quotes are literal, double
+          quotes only keep backslash escapes of \\ \" \$ \` and a backslash outside quotes
+          escapes any character (a trailing one is dropped).
+        - Returns the new length; the text only ever moves down, so nothing is copied elsewhere.
+    */
+    size_t r = 0, w = 0;
+    while (r < len) {
+        char c = word[r];
+        if (c == '\\') {
+            if (r + 1 < len) word[w++] = word[r + 1];
+            r += 2;
+        } else if (c == '\'') {
+            for (r++; r < len && word[r] != '\''; r++) word[w++] = word[r];
+            r++;
+        } else if (c == '"') {
+            for (r++; r < len && word[r] != '"'; r++) {
+                if (word[r] == '\\' && r + 1 < len && strchr("\\\"$`", word[r + 1])) r++;
+                word[w++] = word[r];
+            }
+            r++;
+        } else {
+            word[w++] = word[r++];
+        }
+    }
+    return w;
+}
+
+int parse_input(char *line, struct token_list *tokens) {
+    /*
+        - Tokenizes the input line in a single pass, replacing strtok.
+        - Words are separated by spaces, tabs or newlines; '|', '||', '&&', '&', ';' and the
+          redirection operators are tokens even without surrounding spaces, so operator detection
+          needs no extra scans. Digits directly before '<' or '>' are the redirected fd ('2>&1').
+        - Supports single quotes (literal), double quotes (backslash escapes \\ \" \$ \`) and
+          backslash escapes outside quotes; '#' at the start of a word begins a comment.
+        - Quote and escape removal is done in place, so each word is a span (offset, length)
+          into the original line and nothing is copied. Words are NUL-terminated by parse_command.
+        - A word with '$' expansions ('$A', '${A:-x}', '"$@"', '$?') keeps its raw text and is
+          flagged TOKEN_RAW; a word starting with NAME= is flagged TOKEN_ASSIGN.
+        - There is no limit on the number of words.
+        - Returns 0 on success, or -1 (after printing an error) on an unterminated quote.
+    */
+    uint64_t trace_start = trace_now();
+    tokens->count = 0;
+
+    size_t r = 0;  // Read position
+    while (line[r]) {
+        char c = line[r];
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            r++;
+            continue;
+        }
+        if (c == '#') break;  // Comment runs to end of line
+        if (c == '|') {
+            if (line[r + 1] == '|') {
+                token_push(tokens, TOK_OR, r, 2);
+                r += 2;
+            } else {
+                token_push(tokens, TOK_PIPE, r, 1);
+                r++;
+            }
+            continue;
+        }
+        if (c == ';') {
+            token_push(tokens, TOK_SEMI, r, 1);
+            r++;
+            continue;
+        }
+        if (c == '<' || c == '>') {
+            r = scan_redirect(line, r, r, tokens);
+            continue;
+        }
+        if (c == '&') {
+            if (line[r + 1] == '&') {
+                token_push(tokens, TOK_AND, r, 2);
+                r += 2;
+            } else {
+                token_push(tokens, TOK_BG, r, 1);
+                r++;
+            }
+            continue;
+        }
+
+        // Start of a word: find its end, then remove quotes in place unless it has expansions,
+        // which expand_command does together with quote removal each time the command runs
+        size_t start = r;
+        int flags = 0;
+        size_t name = var_name_length(line + r);
+        if (name && line[r + name] == '=') flags |= TOKEN_ASSIGN;
+        r = scan_word(line, r, &flags);
+        if (r == (size_t)-1) {
+            trace_record(TRACE_PARSE, trace_start, 0, -1, NULL);
+            return -1;
+        }
+        if ((line[r] == '<' || line[r] == '>') && strspn(line + start, "0123456789") == r - start) {
+            r = scan_redirect(line, start, r, tokens);  // Unquoted digits right before '<' / '>' name the fd
+            continue;
+        }
+        size_t len = flags & TOKEN_RAW ? r - start : unquote_word(line + start, r - start);
+        token_push(tokens, TOK_WORD, start, len);
+        tokens->items[tokens->count - 1].flags = flags;
+        tokens->items[tokens->count - 1].end = r;
+    }
+    trace_record(TRACE_PARSE, trace_start, 0, tokens->count, NULL);
+    return 0;
+}
+
+struct node *node_new(struct arena *a, enum node_type type, struct node *left, struct node *right) {
+    /*
+        - Allocates a zeroed tree node in the arena.
+    */
+    struct node *n = arena_alloc(a, sizeof(*n));
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+int parser_peek(struct parser *p) {
+    /*
+        - Returns the type of the next token, or -1 at the end of the line.
+    */
+    return p->pos < p->tokens->count ? (int)p->tokens->items[p->pos].type : -1;
+}
+
+void parser_error(struct parser *p) {
+    /*
+        - Reports a syntax error at the next token, or at the last operator if the line
+          ended where a command was expected (e.g. 'ls &&').
+    */
+    int i = p->pos < p->tokens->count ? p->pos : p->tokens->count - 1;
+    struct token *tok = &p->tokens->items[i];
+    fprintf(stderr, "syntax error near '%.*s'\n", (int)tok->length, p->line + tok->offset);
+}
+
+int parser_word_is(struct parser *p, const char *word) {
+    /*
+        - Returns 1 if the next token is a word equal to word (used for reserved words).
+    */
+    if (parser_peek(p) != TOK_WORD) return 0;
+    struct token *tok = &p->tokens->items[p->pos];
+    return tok->length == strlen(word) && strncmp(p->line + tok->offset, word, tok->length) == 0;
+}
+
+struct node *parser_span(struct parser *p, struct node *n, int first) {
+    /*
+        - Records in n the text from token first up to the last consumed token; returns n.
+    */
+    if (n && first < p->pos) {
+        n->text_start = p->tokens->items[first].offset;
+        n->text_len = p->tokens->items[p->pos - 1].end - n->text_start;
+    }
+    return n;
+}
+
+struct node *parse_command(struct parser *p) {
+    /*
+        - command := (WORD | REDIR WORD)+
+        - Words and redirections may be mixed ('sort < in -r > out'); the word after a
+          redirection operator is its target and not part of argv.
+        - NAME=value words before the first other word are the command's assignments.
+        - NUL-terminates each word in the line; operators are already tokenized, so the
+          byte overwritten after a word is never needed again.
+        - Returns NULL (after printing an error) if there is no word or redirection, or a
+          redirection has no valid target.
+    */
+    int start = p->pos;
+    int words = 0, redirects = 0, assigns = 0, raw = 0;
+    while (parser_peek(p) == TOK_WORD || parser_peek(p) == TOK_REDIR) {
+        if (p->fanout_depth > 0 && (parser_word_is(p, ",") || parser_word_is(p, "}"))) break;
+        if (parser_peek(p) == TOK_REDIR) {
+            p->pos++;
+            if (parser_peek(p) != TOK_WORD) {
+                parser_error(p);
+                return NULL;
+            }
+            redirects++;
+        } else if (words == 0 && (p->tokens->items[p->pos].flags & TOKEN_ASSIGN)) {
+            assigns++;
+        } else {
+            words++;
+        }
+        raw |= p->tokens->items[p->pos].flags & TOKEN_RAW;
+        p->pos++;
+    }
+    if (words == 0 && redirects == 0 && assigns == 0) {
+        parser_error(p);
+        return NULL;
+    }
+
+    struct node *n = node_new(p->arena, NODE_COMMAND, NULL, NULL);
+    n->count = words;
+    n->argv = arena_alloc(p->arena, (words + 1) * sizeof(char *));
+    n->nredirects = redirects;
+    n->redirects = redirects ? arena_alloc(p->arena, redirects * sizeof(struct redirect)) : NULL;
+    n->nassigns = assigns;
+    n->assigns = assigns ? arena_alloc(p->arena, (assigns + 1) * sizeof(char *)) : NULL;
+    if (raw) {
+        n->raw = arena_alloc(p->arena, words + assigns);
+        memset(n->raw, 0, words + assigns);
+    }
+
+    int nwords = words;
+    words = redirects = assigns = 0;
+    for (int i = start; i < p->pos; i++) {
+        struct token *tok = &p->tokens->items[i];
+        char *op = p->line + tok->offset;
+        if (tok->type == TOK_WORD) {
+            op[tok->length] = '\0';
+            int is_raw = tok->flags & TOKEN_RAW;
+            if (words == 0 && (tok->flags & TOKEN_ASSIGN) && assigns < n->nassigns) {
+                if (is_raw) n->raw[nwords + assigns] = 1;
+                n->assigns[assigns++] = op;
+            } else {
+                if (is_raw) n->raw[words] = 1;
+                n->argv[words++] = op;
+            }
+            continue;
+        }
+
+        // Operator: optional fd digits, then '<', '>', '>>', '<&' or '>&'
+        struct redirect *r = &n->redirects[redirects++];
+        size_t digits = strspn(op, "0123456789");
+        char kind = op[digits];
+        r->fd = digits ? atoi(op) : (kind == '<' ? STDIN_FILENO : STDOUT_FILENO);
+        if (op[digits + 1] == '&' && digits + 2 == tok->length) {
+            r->type = REDIR_DUP;
+        } else if (kind == '>' && op[digits + 1] == '>') {
+            r->type = REDIR_APPEND;
+        } else {
+            r->type = kind == '<' ? REDIR_IN : REDIR_OUT;
+        }
+
+        struct token *target = &p->tokens->items[++i];
+        r->target = p->line + target->offset;
+        r->target[target->length] = '\0';
+        r->raw = target->flags & TOKEN_RAW;
+        if (r->type == REDIR_DUP && (target->length == 0 ||
+                                     strspn(r->target, "0123456789") != target->length)) {
+            p->pos = i;
+            parser_error(p);
+            return NULL;
+        }
+    }
+    n->argv[words] = NULL;
+    if (n->assigns) n->assigns[assigns] = NULL;
+    return parser_span(p, n, start);
+}
+
+// parse_fanout and parse_pipeline call each other (a branch is a pipeline)
+struct node *parse_pipeline(struct parser *p);
+
+struct node *parse_fanout(struct parser *p) {
+    /*
+        - fanout := '{' pipeline (',' pipeline)* '}'
+        - '{', ',' and '}' are reserved words here, so they must stand alone ('{ a , b }').
+    */
+    int start = p->pos;
+    p->pos++;  // '{'
+    p->fanout_depth++;
+    struct node *n = node_new(p->arena, NODE_FANOUT, NULL, NULL);
+    int cap = 4;
+    n->stages = arena_alloc(p->arena, cap * sizeof(struct node *));
+    while (1) {
+        struct node *branch = parse_pipeline(p);
+        if (!branch) return NULL;
+        if (n->count == cap) {
+            n->stages = arena_grow(p->arena, n->stages, cap * sizeof(struct node *),
+                                   cap * 2 * sizeof(struct node *));
+            cap *= 2;
+        }
+        n->stages[n->count++] = branch;
+        if (parser_word_is(p, ",")) {
+            p->pos++;
+        } else if (parser_word_is(p, "}")) {
+            p->pos++;
+            break;
+        } else {
+            parser_error(p);
+            return NULL;
+        }
+    }
+    p->fanout_depth--;
+    return parser_span(p, n, start);
+}
+
+struct node *parse_pipeline(struct parser *p) {
+    /*
+        - pipeline := ['pipesize' SIZE] command ('|' command)* ['|' fanout]
+        - A single command is returned as is; two or more become one NODE_PIPELINE.
+        - A fan-out group can only be the last stage.
+        - The 'pipesize SIZE' prefix overrides 'set -o pipesize' for this pipeline's pipes.
+    */
+    int start = p->pos;
+    long pipe_size = 0;
+    if (parser_word_is(p, "pipesize") && p->pos + 1 < p->tokens->count &&
+        p->tokens->items[p->pos + 1].type == TOK_WORD) {
+        struct token *tok = &p->tokens->items[p->pos + 1];
+        p->line[tok->offset + tok->length] = '\0';
+        if (parse_size(p->line + tok->offset, &pipe_size) < 0) {
+            fprintf(stderr, "pipesize: %s: invalid size\n", p->line + tok->offset);
+            return NULL;
+        }
+        p->pos += 2;
+    }
+
+    struct node *first = parse_command(p);
+    if (!first || parser_peek(p) != TOK_PIPE) return first;
+
+    struct node *n = node_new(p->arena, NODE_PIPELINE, NULL, NULL);
+    n->pipe_size = pipe_size;
+    int cap = 4;
+    n->stages = arena_alloc(p->arena, cap * sizeof(struct node *));
+    n->stages[n->count++] = first;
+    while (parser_peek(p) == TOK_PIPE) {
+        p->pos++;
+        int fanout = parser_word_is(p, "{");
+        struct node *stage = fanout ? parse_fanout(p) : parse_command(p);
+        if (!stage) return NULL;
+        if (n->count == cap) {
+            n->stages = arena_grow(p->arena, n->stages, cap * sizeof(struct node *),
+                                   cap * 2 * sizeof(struct node *));
+            cap *= 2;
+        }
+        n->stages[n->count++] = stage;
+        if (fanout && parser_peek(p) == TOK_PIPE) {
+            parser_error(p);
+            return NULL;
+        }
+    }
+    return parser_span(p, n, start);
+}
+
+struct node *parse_and_or(struct parser *p) {
+    /*
+        - and_or := pipeline (('&&' | '||') pipeline)*
+        - '&&' and '||' have equal precedence and associate to the left, as in sh.
+    */
+    int start = p->pos;
+    struct node *left = parse_pipeline(p);
+    while (left && (parser_peek(p) == TOK_AND || parser_peek(p) == TOK_OR)) {
+        enum node_type type = parser_peek(p) == TOK_AND ? NODE_AND : NODE_OR;
+        p->pos++;
+        struct node *right = parse_pipeline(p);
+        if (!right) return NULL;
+        left = parser_span(p, node_new(p->arena, type, left, right), start);
+    }
+    return left;
+}
+
+struct node *parse_limited(struct parser *p) {
+    /*
+        - limited := ['limit' (OPTION VALUE)* ['--']] and_or
+        - The options are parsed here, like 'pipesize', so a bad one fails the whole line.
+    */
+    if (!parser_word_is(p, "limit")) return parse_and_or(p);
+    int start = p->pos;
+    p->pos++;
+    struct job_limits *l = arena_alloc(p->arena, sizeof(*l));
+    memset(l, 0, sizeof(*l));
+    while (parser_peek(p) == TOK_WORD) {
+        struct token *tok = &p->tokens->items[p->pos];
+        char *word = p->line + tok->offset;
+        if (word[0] != '-') break;
+        word[tok->length] = '\0';
+        p->pos++;
+        if (strcmp(word, "--") == 0) break;
+        if (parser_peek(p) != TOK_WORD) {
+            fprintf(stderr, "limit: %s: value required\n", word);
+            return NULL;
+        }
+        struct token *value = &p->tokens->items[p->pos++];
+        p->line[value->offset + value->length] = '\0';
+        if (limit_option(l, word, p->line + value->offset) < 0) return NULL;
+    }
+    struct node *body = parse_and_or(p);
+    if (!body) return NULL;
+    struct node *n = node_new(p->arena, NODE_LIMIT, body, NULL);
+    n->limits = l;
+    return parser_span(p, n, start);
+}
+
+struct node *parse_list(struct parser *p) {
+    /*
+        - list := item ((';' | '&') item)* [';' | '&'], item := ['time'] limited
+        - '&' puts the item before it in the background; both separators bind loosest.
+    */
+    struct node *list = NULL;
+    while (p->pos < p->tokens->count) {
+        struct node *item;
+        int start = p->pos;
+        if (parser_word_is(p, "time")) {
+            // 'time' prefix: times the whole and_or list after it; alone it has no child
+            p->pos++;
+            int bare = parser_peek(p) == -1 || parser_peek(p) == TOK_SEMI || parser_peek(p) == TOK_BG;
+            struct node *timed = bare ? NULL : parse_limited(p);
+            if (!bare && !timed) return NULL;
+            item = parser_span(p, node_new(p->arena, NODE_TIME, timed, NULL), start);
+        } else {
+            item = parse_limited(p);
+            if (!item) return NULL;
+        }
+        if (parser_peek(p) == TOK_BG) {
+            item = parser_span(p, node_new(p->arena, NODE_BACKGROUND, item, NULL), start);
+            p->pos++;
+        } else if (parser_peek(p) == TOK_SEMI) {
+            p->pos++;
+        } else if (parser_peek(p) != -1) {
+            parser_error(p);
+            return NULL;
+        }
+        list = list ? node_new(p->arena, NODE_SEQUENCE, list, item) : item;
+    }
+    return list;
+}
+
+struct node *parse_line(char *line, struct token_list *tokens, struct arena *arena) {
+    /*
+        - Builds the command tree of a tokenized line in one pass over the tokens.
+        - Returns NULL on a syntax error (already reported) or an empty line.
+    */
+    struct parser p = { .line = line, .tokens = tokens, .pos = 0, .arena = arena };
+    return parse_list(&p);
+}
+
+struct node *node_clone(struct arena *a, const struct node *n) {
+    /*
+        - Deep-copies a command tree, including its words, into another arena.
+    */
+    if (!n) return NULL;
+    struct node *copy = node_new(a, n->type, node_clone(a, n->left), node_clone(a, n->right));
+    copy->count = n->count;
+    copy->pipe_size = n->pipe_size;
+    copy->text_start = n->text_start;
+    copy->text_len = n->text_len;
+    if (n->limits) {
+        copy->limits = arena_alloc(a, sizeof(*copy->limits));
+        *copy->limits = *n->limits;
+    }
+    copy->nredirects = n->nredirects;
+    if (n->redirects) {
+        copy->redirects = arena_alloc(a, n->nredirects * sizeof(struct redirect));
+        for (int i = 0; i < n->nredirects; i++) {
+            copy->redirects[i] = n->redirects[i];
+            copy->redirects[i].target = arena_strndup(a, n->redirects[i].target,
+                                                      strlen(n->redirects[i].target));
+        }
+    }
+    if (n->argv) {
+        copy->argv = arena_alloc(a, (n->count + 1) * sizeof(char *));
+        for (int i = 0; i < n->count; i++) {
+            copy->argv[i] = arena_strndup(a, n->argv[i], strlen(n->argv[i]));
+        }
+        copy->argv[n->count] = NULL;
+    }
+    copy->nassigns = n->nassigns;
+    if (n->assigns) {
+        copy->assigns = arena_alloc(a, (n->nassigns + 1) * sizeof(char *));
+        for (int i = 0; i < n->nassigns; i++) {
+            copy->assigns[i] = arena_strndup(a, n->assigns[i], strlen(n->assigns[i]));
+        }
+        copy->assigns[n->nassigns] = NULL;
+    }
+    if (n->raw) {
+        copy->raw = arena_alloc(a, n->count + n->nassigns);
+        memcpy(copy->raw, n->raw, n->count + n->nassigns);
+    }
+    if (n->stages) {
+        copy->stages = arena_alloc(a, n->count * sizeof(struct node *));
+        for (int i = 0; i < n->count; i++) copy->stages[i] = node_clone(a, n->stages[i]);
+    }
+    return copy;
+}
+
+struct node *ast_cache_lookup(const char *text) {
+    /*
+        - Returns the cached command tree of a line with exactly this text, or NULL.
+    */
+    unsigned int h = hash_string(text);
+    struct ast_cache_entry *e = &ast_cache[h % AST_CACHE_SLOTS];
+    if (e->root && e->hash == h && strcmp(e->text, text) == 0) return e->root;
+    return NULL;
+}
+
+void ast_cache_store(const char *text, const struct node *root) {
+    /*
+        - Keeps a copy of a parsed line's tree in its direct-mapped slot, replacing the old entry.
+        - Once the cache arena passes AST_CACHE_BYTES, all entries are dropped and the arena
+          reset; not while a nested run_line may still be walking a cached tree.
+    */
+    if (ast_arena.total > AST_CACHE_BYTES) {
+        if (line_depth > 1) return;
+        memset(ast_cache, 0, sizeof(ast_cache));
+        arena_reset(&ast_arena);
+    }
+    unsigned int h = hash_string(text);
+    struct ast_cache_entry *e = &ast_cache[h % AST_CACHE_SLOTS];
+    e->hash = h;
+    e->text = arena_strndup(&ast_arena, text, strlen(text));
+    e->root = node_clone(&ast_arena, root);
+}
+
+int make_pipe(int fds[2], long size) {
+    /*
+        - Creates an O_CLOEXEC pipe for a pipeline, in packet mode (O_DIRECT) if 'set -o pipedirect'.
+        - Both ends are recorded in stage_pipe_fds until close_pipe closes them.
+        - If size is not 0, grows its capacity with F_SETPIPE_SZ, capped at
+          /proc/sys/fs/pipe-max-size. Larger pipes let fast producers and consumers run longer
+          between context switches. A refused resize (per-user pipe page limit) is not an error.
+        - Returns 0, or -1 with errno set if the pipe could not be created.
+    */
+    if (pipe2(fds, O_CLOEXEC | (opt_pipe_direct ? O_DIRECT : 0)) < 0) return -1;
+    if (stage_pipe_count + 2 > stage_pipe_cap) {
+        stage_pipe_cap = stage_pipe_cap ? stage_pipe_cap * 2 : 16;
+        stage_pipe_fds = realloc(stage_pipe_fds, stage_pipe_cap * sizeof(int));
+    }
+    stage_pipe_fds[stage_pipe_count++] = fds[0];
+    stage_pipe_fds[stage_pipe_count++] = fds[1];
+    if (size > 0) {
+        if (pipe_max_size == 0) {
+            FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+            if (!f || fscanf(f, "%ld", &pipe_max_size) != 1) pipe_max_size = 1 << 20;
+            if (f) fclose(f);
+        }
+        fcntl(fds[1], F_SETPIPE_SZ, size < pipe_max_size ? size : pipe_max_size);
+    }
+    return 0;
+}
+
+void close_pipe(int fd) {
+    /*
+        - Closes one end of a pipe made by make_pipe and drops it from stage_pipe_fds.
+    */
+    for (int i = 0; i < stage_pipe_count; i++) {
+        if (stage_pipe_fds[i] != fd) continue;
+        stage_pipe_fds[i] = stage_pipe_fds[--stage_pipe_count];
+        break;
+    }
+    close(fd);
+}
+
+void fanout_pump(int in, int *outs, int n) {
+    /*
+        - Copies everything from the pipe in to every pipe in outs, until in reaches EOF or
+          every consumer has gone away (EPIPE; SIGPIPE is ignored by the caller).
+        - Data stays in the kernel: tee(2) duplicates the pipe buffers into all outputs but
+          the last without consuming them, then splice(2) moves the same bytes into the last.
+        - tee can copy less into a full output than into the first one and cannot resume at an
+          offset, so in that case the chunk is read once and the missing tails are written
+          from user space. If the kernel refuses tee/splice, everything is copied that way.
+    */
+    char *buf = NULL;
+    int zero_copy = 1;
+    while (n > 0) {
+        if (!buf && !zero_copy) buf = malloc(FANOUT_CHUNK);
+        if (!zero_copy) {
+            ssize_t len = buf ? read(in, buf, FANOUT_CHUNK) : -1;
+            if (len < 0 && errno == EINTR) continue;
+            if (len <= 0) break;
+            for (int k = n - 1; k >= 0; k--) {
+                if (write(outs[k], buf, len) < 0 && errno == EPIPE) outs[k] = outs[--n];
+            }
+            continue;
+        }
+
+        // Wait for data: duplicate it into outs[0], or move it there if it is the only output
+        ssize_t len = n > 1 ? tee(in, outs[0], FANOUT_CHUNK, 0)
+                            : splice(in, NULL, outs[0], NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+        if (len == 0) break;  // Producer finished
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EPIPE) {
+                outs[0] = outs[--n];  // Consumer exited; drop it and retry
+            } else if (errno == EINVAL) {
+                zero_copy = 0;
+            } else {
+                break;
+            }
+            continue;
+        }
+        if (n == 1) continue;
+
+        // done[k] = bytes of this chunk output k already has, or -1 once it is gone
+        ssize_t done[n];
+        int complete = 1;
+        done[0] = len;
+        for (int k = 1; k < n - 1; k++) {
+            done[k] = tee(in, outs[k], len, 0);
+            if (done[k] < 0 && errno != EPIPE) done[k] = 0;
+            if (done[k] >= 0 && done[k] < len) complete = 0;
+        }
+        done[n - 1] = 0;
+
+        if (complete) {
+            // Consume the chunk into the last output; partial splices just continue
+            while (done[n - 1] >= 0 && done[n - 1] < len) {
+                ssize_t moved = splice(in, NULL, outs[n - 1], NULL, len - done[n - 1], SPLICE_F_MOVE);
+                if (moved < 0 && errno == EINTR) continue;
+                if (moved <= 0) break;
+                done[n - 1] += moved;
+            }
+            if (done[n - 1] < len) complete = 0;  // Last consumer gone: drain the rest below
+        }
+        if (!complete) {
+            // Slow path: read what is left of the chunk once and complete every short output
+            if (!buf) buf = malloc(FANOUT_CHUNK);
+            if (!buf) break;
+            ssize_t base = done[n - 1] > 0 ? done[n - 1] : 0;
+            ssize_t have = base;
+            while (have < len) {
+                ssize_t r = read(in, buf + (have - base), len - have);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) break;
+                have += r;
+            }
+            for (int k = 1; k < n; k++) {
+                ssize_t from = done[k] > base ? done[k] : base;
+                if (done[k] >= 0 && from < have &&
+                    write(outs[k], buf + (from - base), have - from) < 0 && errno == EPIPE) {
+                    done[k] = -1;
+                }
+            }
+        }
+        for (int k = n - 1; k >= 1; k--) {
+            if (done[k] < 0) outs[k] = outs[--n];
+        }
+    }
+    free(buf);
+}
+
+void start_stages(struct node *stages[], int count, int in_fd, int out_fd, long pipe_size, int job);
+
+void start_fanout(struct node *fan, int in_fd, long pipe_size, int job) {
+    /*
+        - Starts a fan-out group reading from in_fd as part of job.
+        - Every branch gets its own O_CLOEXEC pipe. A forked pump process (a child of the
+          shell that never execs) copies in_fd into all of them with fanout_pump; it is
+          not a separate 'tee' program. On the tee/splice path the data stays in the kernel;
+          a short tee or a kernel that refuses it falls back to copying through user space.
+        - The pump is started before the branches, so the job's status is the one of the
+          last branch, as with 'a | tee >(b) | c'. Branch pipes get pipe_size like the others.
+    */
+    int outs[fan->count][2];
+    for (int k = 0; k < fan->count; k++) {
+        if (make_pipe(outs[k], pipe_size) < 0) {
+            perror("pipe failed");
+            for (int i = 0; i < k; i++) {
+                close_pipe(outs[i][0]);
+                close_pipe(outs[i][1]);
+            }
+            return;
+        }
+    }
+
+    out_flush();
+    fflush(stderr);
+    pid_t pump = fork();
+    if (pump == 0) {
+        fork_child_setup(job);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+        sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+        // Keep only the input and the write ends: close every gap between them in one call each
+        int keep[fan->count + 1];
+        keep[0] = in_fd;
+        for (int k = 0; k < fan->count; k++) keep[k + 1] = outs[k][1];
+        int nkeep = fan->count + 1;
+        for (int i = 1; i < nkeep; i++) {
+            for (int j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+                int t = keep[j];
+                keep[j] = keep[j - 1];
+                keep[j - 1] = t;
+            }
+        }
+        unsigned int from = 3;
+        for (int i = 0; i < nkeep; i++) {
+            if ((unsigned int)keep[i] > from) close_range(from, keep[i] - 1, 0);
+            from = keep[i] + 1;
+        }
+        close_range(from, ~0U, 0);
+
+        int writers[fan->count];
+        for (int k = 0; k < fan->count; k++) writers[k] = outs[k][1];
+        fanout_pump(in_fd, writers, fan->count);
+        _exit(0);
+    }
+    if (pump > 0 && job_control) setpgid(pump, jobs[job].pgid ? jobs[job].pgid : pump);
+    if (pump < 0 || job_add_process(job, pump, "fanout") < 0) perror("fork failed");
+
+    for (int k = 0; k < fan->count; k++) {
+        close_pipe(outs[k][1]);
+        struct node *branch = fan->stages[k];
+        if (branch->type == NODE_PIPELINE) {
+            start_stages(branch->stages, branch->count, outs[k][0], -1, pipe_size, job);
+        } else {
+            start_stages(&fan->stages[k], 1, outs[k][0], -1, pipe_size, job);
+        }
+        close_pipe(outs[k][0]);
+    }
+}
+
+void start_stages(struct node *stages[], int count, int in_fd, int out_fd, long pipe_size, int job) {
+    /*
+        - Starts the stages of a pipeline as members of job, without waiting.
+        - Creates all N-1 pipes up front with O_CLOEXEC (make_pipe, with pipe_size capacity),
+          so no stage inherits pipe ends it does not use.
+        - in_fd / out_fd, if not -1, become the first stage's stdin and the last stage's stdout.
+        - Starts every stage concurrently with posix_spawn on its cached PATH location; each stage
+          only gets dup2 file actions for its stdin/stdout, followed by its own redirections
+          (which therefore override the pipe), which avoids copying the shell's page tables per stage.
+        - Builtin stages run in forked children (fork_builtin); a NODE_FANOUT last stage is
+          started by start_fanout. A stage whose redirections cannot be opened is not started.
+        - Under 'set -o pipeplace' each stage starts on the CPUs place_stage picks for it.
+        - Prints error messages if a stage cannot be spawned. Must be called with SIGCHLD blocked.
+    */
+    // Build every pipe before starting any stage: pipes[i] connects stage i to stage i + 1
+    int pipes[count > 1 ? count - 1 : 1][2];
+    for (int i = 0; i < count - 1; i++) {
+        if (make_pipe(pipes[i], pipe_size) < 0) {
+            perror("pipe failed");
+            for (int j = 0; j < i; j++) {
+                close_pipe(pipes[j][0]);
+                close_pipe(pipes[j][1]);
+            }
+            return;
+        }
+    }
+
+    char **saved_overlay = env_overlay;
+    for (int i = 0; i < count; i++) {
+        struct node *cmd = stages[i]->type == NODE_COMMAND ? expand_command(stages[i]) : stages[i];
+        int stage_in = i > 0 ? pipes[i - 1][0] : in_fd;
+        int stage_out = i < count - 1 ? pipes[i][1] : out_fd;
+        if (cmd->type == NODE_FANOUT) {
+            start_fanout(cmd, stage_in, pipe_size, job);
+            continue;
+        }
+        int src[cmd->nredirects + 1];
+        if (redirect_open(cmd, src) < 0) continue;
+        if (!cmd->argv[0]) {
+            redirect_close(cmd, src, cmd->nredirects);
+            continue;
+        }
+        pid_t pid;
+        int err;
+        env_overlay = cmd->nassigns ? cmd->assigns : saved_overlay;
+
+        const cpu_set_t *cpus = place_stage();
+        const struct builtin *b = find_builtin(cmd->argv[0]);
+        if (b) {
+            err = fork_builtin(&pid, b, cmd, src, stage_in, stage_out, job);
+        } else {
+            struct spawn_fds fds = { 0 };
+            if (stage_in >= 0) {
+                // Read end of the previous pipe becomes stdin
+                spawn_fds_add(&fds, stage_in, STDIN_FILENO);
+            }
+            if (stage_out >= 0) {
+                // Write end of the next pipe becomes stdout
+                spawn_fds_add(&fds, stage_out, STDOUT_FILENO);
+            }
+            redirect_actions(&fds, cmd, src);
+            err = spawn_command(&pid, cmd->argv, &fds, job);
+            // The spawn server's children inherit its affinity, not the shell's
+            if (err == 0 && cpus && spawn_server_fd >= 0) sched_setaffinity(pid, sizeof(*cpus), cpus);
+        }
+        redirect_close(cmd, src, cmd->nredirects);
+        if (err != 0) {
+            fprintf(stderr, "exec error: %s: %s\n", cmd->argv[0], strerror(err));
+        }
+    }
+    env_overlay = saved_overlay;
+
+    // Parent closes every pipe end so stages see EOF once their writer exits
+    for (int i = 0; i < count - 1; i++) {
+        close_pipe(pipes[i][0]);
+        close_pipe(pipes[i][1]);
+    }
+}
+
+int handle_pipe(struct node *pipeline, int background) {
+    /*
+        - Handles execution of an N-stage pipeline 'cmd1 | cmd2 | ... | cmdN', optionally ending
+          in a fan-out group 'cmd | { a , b | c }' whose branches all read the same output.
+        - Receives the pipeline node from the parser; start_stages starts its stages.
+        - Pipes get the capacity of a 'pipesize N' prefix, or else of 'set -o pipesize'.
+        - With 'set -o pipeplace=cache|node' adjacent stages are pinned to CPUs sharing a cache
+          or a NUMA node (place_begin).
+        - A builtin in the last stage of a foreground pipeline runs in the shell process with
+          stdin moved onto the last pipe.
+        - With background set, the job is left running and its number and last PID are printed.
+        - All stages form one job, whose stages are reaped by the SIGCHLD handler's single
+          waitpid loop.
+        - Returns the exit code of the last stage (0 for a background pipeline).
+    */
+    uint64_t trace_start = trace_now();
+    struct node **stages = pipeline->stages;
+    int count = pipeline->count;
+    long pipe_size = pipeline->pipe_size ? pipeline->pipe_size : opt_pipe_size;
+
+    sigset_t old;
+    block_sigchld(&old);
+    int job = job_alloc(job_label(pipeline), background);
+    if (job < 0) {
+        unblock_sigchld(&old);
+        return 1;
+    }
+
+    struct node *tail = stages[count - 1]->type == NODE_COMMAND ? expand_command(stages[count - 1]) : stages[count - 1];
+    const struct builtin *last = NULL;
+    if (!background && tail->type == NODE_COMMAND && tail->argv[0]) last = find_builtin(tail->argv[0]);
+
+    int code = 0;
+    if (last) {
+        // The last-stage builtin reads the last pipe as stdin; the shell's own stdin is kept aside
+        int tail_pipe[2];
+        if (make_pipe(tail_pipe, pipe_size) < 0) {
+            perror("pipe failed");
+            job_free(job);
+            unblock_sigchld(&old);
+            return 1;
+        }
+        place_begin();
+        start_stages(stages, count - 1, -1, tail_pipe[1], pipe_size, job);
+        place_end();
+        close_pipe(tail_pipe[1]);
+
+        out_flush();
+        int saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(tail_pipe[0], STDIN_FILENO);
+        close_pipe(tail_pipe[0]);
+
+        int src[tail->nredirects + 1], saved[tail->nredirects + 1];
+        code = 1;
+        if (redirect_open(tail, src) == 0) {
+            if (redirect_apply(tail, src, saved) == 0) {
+                char **saved_overlay = env_overlay;
+                if (tail->nassigns) env_overlay = tail->assigns;
+                code = run_builtin(last, tail->argv);
+                env_overlay = saved_overlay;
+                redirect_restore(tail, saved, tail->nredirects);
+            }
+            redirect_close(tail, src, tail->nredirects);
+        }
+        // Restoring stdin drops the last read end, so writers still running get SIGPIPE
+        if (saved_stdin >= 0) {
+            dup2(saved_stdin, STDIN_FILENO);
+            close(saved_stdin);
+        }
+        wait_for_job(job);
+    } else {
+        place_begin();
+        start_stages(stages, count, -1, -1, pipe_size, job);
+        place_end();
+        if (background) {
+            out_printf("[%d] Process ID: %d\n", job + 1, jobs[job].last_pid);
+            last_background_pid = jobs[job].last_pid;
+        } else {
+            code = wait_for_job(job);
+        }
+    }
+    unblock_sigchld(&old);
+    trace_record(TRACE_PIPELINE, trace_start, 0, count, stages[0]->argv[0]);
+    return code;
+}
+
+double timespec_seconds(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void print_time_report(const struct time_report *report, const struct timespec *start,
+                       const struct timespec *end, const struct rusage *shell_usage) {
+    /*
+        - Prints the 'time' report to stderr: one line per process with wall, user and sys time,
+          max RSS and voluntary/involuntary context switches, then the totals.
+        - If shell_usage is given, the time the shell itself spent (builtins, spawning) is
+          shown as its own line and included in the totals.
+        - Wall time of the whole command is measured by the caller; if start is NULL, it is
+          taken from the earliest start to the latest end of the processes.
+    */
+    double user = 0, sys = 0;
+    long maxrss = 0, vcsw = 0, ivcsw = 0;
+    struct timespec first = { 0, 0 }, last = { 0, 0 };
+
+    if (report->count > 0) {
+        fprintf(stderr, "%-5s %-8s %9s %9s %9s %10s %8s %8s  %s\n",
+                "stage", "pid", "wall", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+    }
+    for (int i = 0; i < report->count; i++) {
+        const struct stage_stats *st = &report->stages[i];
+        double u = timeval_seconds(&st->usage.ru_utime);
+        double sy = timeval_seconds(&st->usage.ru_stime);
+        fprintf(stderr, "%-5d %-8d %8.3fs %8.3fs %8.3fs %8ldKB %8ld %8ld  %s\n",
+                i + 1, st->pid, timespec_seconds(&st->start, &st->end), u, sy,
+                st->usage.ru_maxrss, st->usage.ru_nvcsw, st->usage.ru_nivcsw, st->name);
+        user += u;
+        sys += sy;
+        if (st->usage.ru_maxrss > maxrss) maxrss = st->usage.ru_maxrss;
+        vcsw += st->usage.ru_nvcsw;
+        ivcsw += st->usage.ru_nivcsw;
+        if (i == 0 || timespec_seconds(&st->start, &first) > 0) first = st->start;
+        if (i == 0 || timespec_seconds(&last, &st->end) > 0) last = st->end;
+    }
+
+    if (shell_usage) {
+        double u = timeval_seconds(&shell_usage->ru_utime);
+        double sy = timeval_seconds(&shell_usage->ru_stime);
+        fprintf(stderr, "%-5s %-8d %9s %8.3fs %8.3fs %10s %8ld %8ld  %s\n",
+                "shell", getpid(), "", u, sy, "", shell_usage->ru_nvcsw, shell_usage->ru_nivcsw, "(in-process)");
+        user += u;
+        sys += sy;
+        vcsw += shell_usage->ru_nvcsw;
+        ivcsw += shell_usage->ru_nivcsw;
+    }
+
+    double wall = start ? timespec_seconds(start, end) : timespec_seconds(&first, &last);
+    fprintf(stderr, "%-5s %-8s %8.3fs %8.3fs %8.3fs %8ldKB %8ld %8ld\n",
+            "total", "", wall, user, sys, maxrss, vcsw, ivcsw);
+}
+
+char *expand_history(char *line) {
+    /*
+        - Performs history expansion on a line starting with '!':
+          '!!' (previous entry), '!n' (entry n), '!-n' (n entries back) and '!prefix'
+          (newest entry starting with prefix, answered through the prefix index).
+        - The rest of the line after the event is appended to the recalled entry.
+        - Returns line itself if there is nothing to expand, the expanded line (in line_arena,
+          echoed to stdout), or NULL after printing an error if the event does not exist.
+    */
+    char *p = line + strspn(line, " \t");
+    if (!history_enabled || p[0] != '!' || p[1] == '\0' || strchr(" \t=(", p[1])) return line;
+
+    char *spec = p + 1;
+    char *rest = spec + strcspn(spec, " \t");
+    long total = history_count();
+    long id = 0;
+
+    if (spec[0] == '!') {
+        id = total;
+        rest = spec + 1;
+    } else if ((spec[0] >= '0' && spec[0] <= '9') || (spec[0] == '-' && spec[1] >= '0' && spec[1] <= '9')) {
+        long n = strtol(spec, &rest, 10);
+        id = n < 0 ? total + 1 + n : n;
+    } else {
+        char *prefix = arena_strndup(&line_arena, spec, rest - spec);
+        id = history_find_prefix(prefix, total + 1);
+    }
+
+    size_t len = 0;
+    const char *entry = history_get(id, &len);
+    if (!entry) {
+        fprintf(stderr, "%.*s: event not found\n", (int)(rest - p), p);
+        return NULL;
+    }
+
+    size_t rest_len = strlen(rest);
+    char *expanded = arena_alloc(&line_arena, len + rest_len + 1);
+    memcpy(expanded, entry, len);
+    memcpy(expanded + len, rest, rest_len + 1);
+    out_printf("%s\n", expanded);
+    return expanded;
+}
+
+int run_subshell(struct node *n) {
+    /*
+        - Runs a list that must not block the shell, like 'a && b &', in a forked child job.
+        - The child (set up by fork_child_setup) runs the tree with the normal executor and
+          exits with its status.
+        - Prints the job number and PID like other background jobs. Returns 0, or 1 if the
+          child could not be started.
+    */
+    sigset_t old;
+    block_sigchld(&old);
+    int j = job_alloc(job_label(n), 1);
+    if (j < 0) {
+        unblock_sigchld(&old);
+        return 1;
+    }
+
+    out_flush();
+    fflush(stderr);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork failed");
+        job_free(j);
+        unblock_sigchld(&old);
+        return 1;
+    }
+    if (child == 0) {
+        fork_child_setup(j);
+        int status = exec_node(n);
+        out_flush();
+        _exit(status);
+    }
+
+    if (job_control) setpgid(child, child);
+    if (job_add_process(j, child, jobs[j].command) < 0) {
+        perror("fork failed");
+        job_free(j);
+        unblock_sigchld(&old);
+        return 1;
+    }
+    out_printf("[%d] Process ID: %d\n", j + 1, child);
+    last_background_pid = child;
+    unblock_sigchld(&old);
+    return 0;
+}
+
+int exec_node(struct node *n) {
+    /*
+        - Executes a command tree and returns its exit status, which is also kept in last_status.
+        - '&&' / '||' run their right side only if the left side succeeded / failed; the
+          skipped side is never started, so short-circuiting costs no fork.
+        - ';' runs both sides in order. Nothing more runs once 'exit' has been called.
+        - Simple commands and pipelines go to execute_command and handle_pipe; they also
+          handle '&' for themselves, other backgrounded lists go to run_subshell.
+        - 'time' runs its child and reports the resource usage of everything it started;
+          'limit' runs it with every process it starts under the resource limits.
+    */
+    int status = 0;
+    switch (n->type) {
+    case NODE_COMMAND:
+        status = execute_command(n, 0);
+        break;
+    case NODE_PIPELINE:
+        status = handle_pipe(n, 0);
+        break;
+    case NODE_FANOUT:
+        break;  // Only appears as the last stage of a pipeline
+    case NODE_AND:
+    case NODE_OR: {
+        uint64_t trace_start = trace_now();
+        status = exec_node(n->left);
+        if ((status == 0) == (n->type == NODE_AND) && !exit_requested) {
+            status = exec_node(n->right);
+        }
+        trace_record(TRACE_AND, trace_start, 0, status, n->type == NODE_AND ? "&&" : "||");
+        break;
+    }
+    case NODE_SEQUENCE:
+        status = exec_node(n->left);
+        if (!exit_requested) status = exec_node(n->right);
+        break;
+    case NODE_BACKGROUND:
+        if (n->left->type == NODE_COMMAND) {
+            status = execute_command(n->left, 1);
+        } else if (n->left->type == NODE_PIPELINE) {
+            status = handle_pipe(n->left, 1);
+        } else {
+            status = run_subshell(n->left);
+        }
+        break;
+    case NODE_LIMIT: {
+        struct limit_state limit;
+        limit_begin(&limit, n->limits);
+        status = exec_node(n->left);
+        limit_end(&limit);
+        break;
+    }
+    case NODE_TIME: {
+        if (!n->left) {
+            print_time_report(&time_previous, NULL, NULL, NULL);
+            break;
+        }
+        struct timespec start, end;
+        struct rusage self_before, self_after;
+        getrusage(RUSAGE_SELF, &self_before);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        status = exec_node(n->left);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &self_after);
+
+        // Usage of the shell process itself during the command
+        struct rusage self;
+        memset(&self, 0, sizeof(self));
+        timersub(&self_after.ru_utime, &self_before.ru_utime, &self.ru_utime);
+        timersub(&self_after.ru_stime, &self_before.ru_stime, &self.ru_stime);
+        self.ru_nvcsw = self_after.ru_nvcsw - self_before.ru_nvcsw;
+        self.ru_nivcsw = self_after.ru_nivcsw - self_before.ru_nivcsw;
+        print_time_report(&time_current, &start, &end, &self);
+        break;
+    }
+    }
+    last_status = status;
+    return status;
+}
+
+int run_parsed_line(char *line, struct node *root) {
+    /*
+        - Executes a single command line whose tree may already be built (root, from a compiled
+          script); with root NULL the line is parsed here.
+        - Expands '!' history references, records the line in history, then builds the
+          command tree with parse_line and runs it with exec_node. A line changed by history
+          expansion is always parsed.
+        - With history enabled, trees are cached by line text, so a line run again from history
+          is executed without tokenizing or parsing it again.
+        - A line that does not tokenize or parse sets the status to 2, as in other shells.
+        - All parse state is allocated from line_arena; the caller resets it afterwards.
+        - Returns 1 if the shell should exit ('exit' built-in), otherwise 0.
+    */
+    char *expanded = expand_history(line);
+    if (!expanded) return 0;
+    if (expanded != line) root = NULL;
+    line = expanded;
+    add_to_history(line);  // Store command in history
+
+    // Keep an untouched copy of the line to label jobs; the tokenizer edits line in place.
+    // A nested line ('history -i') gets its own, and the outer one is put back afterwards.
+    const char *outer_command = current_command;
+    current_command = arena_strndup(&line_arena, line, strlen(line));
+
+    line_depth++;
+    if (!root && history_enabled) root = ast_cache_lookup(current_command);
+    if (!root) {
+        // Tokenize once, then build the tree from the tokens.
+        // Tokens, words and nodes live in line_arena, which main resets after every line.
+        struct token_list tokens = { .arena = &line_arena };
+        int bad = parse_input(line, &tokens) != 0;
+        if (!bad && tokens.count > 0) {
+            root = parse_line(line, &tokens, &line_arena);
+            if (root && history_enabled) ast_cache_store(current_command, root);
+            bad = !root;
+        }
+        if (bad) last_status = 2;  // A syntax error fails the line, like a failed command
+    }
+
+    if (root) {
+        // Every line collects process statistics; the previous line's stay available to a bare 'time'
+        time_previous = time_current;
+        time_current.count = 0;
+        exec_node(root);
+    }
+    line_depth--;
+    if (line_depth > 0) current_command = outer_command;
+    return exit_requested;
+}
+
+int run_line(char *line) {
+    /*
+        - Parses and executes a single command line (see run_parsed_line).
+    */
+    return run_parsed_line(line, NULL);
+}
+
+void reader_init_fd(struct line_reader *r, int fd) {
+    /*
+        - Prepares a line reader for a file descriptor.
+        - Regular files are memory-mapped whole; anything else (tty, pipe) is read in READ_CHUNK blocks.
+    */
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            r->map = map;
+            r->data = map;
+            r->len = st.st_size;
+            r->fd = -1;  // Whole file is already in memory
+            return;
+        }
+    }
+    r->chunk = malloc(READ_CHUNK);
+    r->data = r->chunk;
+}
+
+void reader_init_string(struct line_reader *r, const char *str) {
+    /*
+        - Prepares a line reader over an in-memory string (the argument of '-c').
+    */
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->data = str;
+    r->len = strlen(str);
+}
+
+void reader_append(struct line_reader *r, const char *src, size_t n) {
+    /*
+        - Appends n bytes to the reader's line buffer, growing it geometrically.
+        - Lines therefore have no length limit, and the buffer is reused for every line.
+    */
+    if (r->line_len + n + 1 > r->line_cap) {
+        size_t cap = r->line_cap ? r->line_cap : 256;
+        while (cap < r->line_len + n + 1) cap *= 2;
+        r->line = realloc(r->line, cap);
+        r->line_cap = cap;
+    }
+    memcpy(r->line + r->line_len, src, n);
+    r->line_len += n;
+    r->line[r->line_len] = '\0';
+}
+
+char *reader_next_line(struct line_reader *r) {
+    /*
+        - Returns the next line without its trailing newline, or NULL at end of input.
+        - Splits lines with memchr over whole chunks instead of reading one line per call.
+        - The returned buffer is owned by the reader and overwritten by the next call.
     */
+    r->line_len = 0;
+    int have_data = 0;
+
+    while (1) {
+        if (r->pos == r->len) {
+            if (r->fd < 0) break;  // In-memory input is exhausted
 
-    if (history[history_index]) {
-        free(history[history_index]);
-    } 
-    history[history_index] = strdup(cmd);
-    history_index = (history_index + 1) % HISTORY_COUNT;
+            ssize_t n = read(r->fd, r->chunk, READ_CHUNK);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;      // EOF or read error
+            r->len = n;
+            r->pos = 0;
+        }
+
+        const char *start = r->data + r->pos;
+        const char *newline = memchr(start, '\n', r->len - r->pos);
+        if (newline) {
+            reader_append(r, start, newline - start);
+            r->pos += (newline - start) + 1;
+            return r->line;
+        }
+
+        // No newline in this chunk: keep the partial line and fetch more
+        reader_append(r, start, r->len - r->pos);
+        r->pos = r->len;
+        have_data = 1;
+    }
+
+    if (have_data || r->line_len > 0) return r->line;  // Last line without a newline
+    return NULL;
+}
+
+void reader_close(struct line_reader *r) {
+    /*
+        - Releases the mapping and buffers held by a line reader.
+    */
+    if (r->map) munmap(r->map, r->len);
+    free(r->chunk);
+    free(r->line);
 }
 
+int line_is_blank(const char *line) {
+    /*
+        - Returns 1 for lines the main loop skips: empty lines and comment lines (including a
+          '#!' interpreter line).
+    */
+    const char *first = line + strspn(line, " \t\r");
+    return *first == '\0' || *first == '#';
+}
 
-void show_history() {
+uint32_t script_put(struct script_writer *w, const void *data, size_t n, size_t align) {
     /*
-        - Displays the stored command history.
-        - Iterates from the current history_index and prints commands in the order they were entered.
-        - Limits output to HISTORY_COUNT entries.
-        - Each entry is numbered starting from 1.
+        - Appends n bytes at the next multiple of align and returns their file offset.
+        - Sets w->failed (and returns 0) if the buffer cannot grow or would pass 4 GiB.
     */
+    size_t off = (w->len + align - 1) & ~(align - 1);
+    if (w->failed || off + n > UINT32_MAX) {
+        w->failed = 1;
+        return 0;
+    }
+    if (off + n > w->cap) {
+        size_t cap = w->cap ? w->cap : 65536;
+        while (cap < off + n) cap *= 2;
+        char *buf = realloc(w->buf, cap);
+        if (!buf) {
+            w->failed = 1;
+            return 0;
+        }
+        w->buf = buf;
+        w->cap = cap;
+    }
+    memset(w->buf + w->len, 0, off - w->len);
+    if (n > 0) memcpy(w->buf + off, data, n);
+    w->len = off + n;
+    return off;
+}
 
-    int count = 0;
-    int idx = history_index;
+void script_put_varint(struct script_writer *w, uint64_t value) {
+    /*
+        - Appends value as an LEB128 varint: 7 bits per byte, high bit set on all but the last.
+    */
+    unsigned char bytes[10];
+    size_t n = 0;
     do {
-        if (history[idx]) {
-            printf("[%d] %s\n", count + 1, history[idx]);
-            count++;
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value) bytes[n] |= 0x80;
+        n++;
+    } while (value);
+    script_put(w, bytes, n, 1);
+}
+
+void script_put_byte(struct script_writer *w, unsigned char byte) {
+    script_put(w, &byte, 1, 1);
+}
+
+void script_put_string(struct script_writer *w, const char *str) {
+    script_put(w, str, strlen(str) + 1, 1);
+}
+
+void script_encode(struct script_writer *w, const struct node *n) {
+    /*
+        - Appends a command tree in preorder (the node layout is described above enum script_field).
+    */
+    unsigned char fields = (n->argv ? SCRIPT_ARGV : 0) | (n->assigns ? SCRIPT_ASSIGNS : 0) |
+                           (n->raw ? SCRIPT_RAW : 0) | (n->redirects ? SCRIPT_REDIRECTS : 0) |
+                           (n->stages ? SCRIPT_STAGES : 0) | (n->limits ? SCRIPT_LIMITS : 0) |
+                           (n->left ? SCRIPT_LEFT : 0) | (n->right ? SCRIPT_RIGHT : 0);
+    script_put_byte(w, n->type);
+    script_put_byte(w, fields);
+    script_put_varint(w, n->count);
+    script_put_varint(w, n->text_start);
+    script_put_varint(w, n->text_len);
+    if (n->argv) {
+        for (int i = 0; i < n->count; i++) script_put_string(w, n->argv[i]);
+    }
+    if (n->assigns) {
+        script_put_varint(w, n->nassigns);
+        for (int i = 0; i < n->nassigns; i++) script_put_string(w, n->assigns[i]);
+    }
+    if (n->raw) script_put(w, n->raw, n->count + n->nassigns, 1);
+    if (n->redirects) {
+        script_put_varint(w, n->nredirects);
+        for (int i = 0; i < n->nredirects; i++) {
+            script_put_byte(w, n->redirects[i].type);
+            script_put_varint(w, n->redirects[i].fd);
+            script_put_byte(w, n->redirects[i].raw);
+            script_put_string(w, n->redirects[i].target);
         }
-        idx = (idx + 1) % HISTORY_COUNT;
-    } while (idx != history_index && count < HISTORY_COUNT);
+    }
+    if (n->type == NODE_PIPELINE) script_put_varint(w, n->pipe_size);
+    if (n->limits) script_put(w, n->limits, sizeof(*n->limits), 1);
+    if (n->stages) {
+        for (int i = 0; i < n->count; i++) script_encode(w, n->stages[i]);
+    }
+    if (n->left) script_encode(w, n->left);
+    if (n->right) script_encode(w, n->right);
 }
 
-void run_builtin_cd(char **args) {
+const void *script_cache_at(const struct script_cache *c, uint32_t off, size_t n, size_t align) {
     /*
-        - Built-in command handler for 'cd'.
-        - Changes the current working directory to the directory specified in args[1].
-        - If no argument is provided, changes to the HOME directory.
-        - On success, updates the PWD environment variable to the new directory.
-        - On failure, prints an error message using perror.
+        - Returns the n bytes at offset off of the compiled script, or NULL if they are not
+          inside it or misaligned.
     */
-    char *target = args[1];
-    if (!target) {
-        target = getenv("HOME");  // Default to HOME if no argument
+    if (off == 0 || off % align != 0 || off > c->size || n > c->size - off) return NULL;
+    return c->data + off;
+}
+
+const void *script_get(struct script_decoder *d, size_t n) {
+    /*
+        - Consumes n bytes; returns them, or NULL (and marks the decoder bad) past the end.
+    */
+    if (d->bad || n > d->c->size - d->pos) {
+        d->bad = 1;
+        return NULL;
     }
+    const void *p = d->c->data + d->pos;
+    d->pos += n;
+    return p;
+}
 
-    if (chdir(target) != 0) {
-        perror("cd error");  // Print error if chdir fails
-    } else {
-        // Update PWD environment variable to reflect current directory
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd))) {
-            setenv("PWD", cwd, 1);
+unsigned char script_get_byte(struct script_decoder *d) {
+    const unsigned char *p = script_get(d, 1);
+    return p ? *p : 0;
+}
+
+uint64_t script_get_varint(struct script_decoder *d) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char byte = script_get_byte(d);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    d->bad = 1;
+    return 0;
+}
+
+char *script_get_string(struct script_decoder *d) {
+    /*
+        - Consumes a NUL-terminated string and returns it in place (the file ends with a NUL).
+    */
+    if (d->bad || d->pos >= d->c->size) {
+        d->bad = 1;
+        return NULL;
+    }
+    const char *start = d->c->data + d->pos;
+    size_t len = strlen(start);
+    return (char *)script_get(d, len + 1);
+}
+
+uint32_t script_get_count(struct script_decoder *d) {
+    /*
+        - Consumes a varint count; one larger than the bytes left cannot be genuine.
+    */
+    uint64_t n = script_get_varint(d);
+    if (n > d->c->size - d->pos) d->bad = 1;
+    return d->bad ? 0 : (uint32_t)n;
+}
+
+struct node *script_decode(struct script_decoder *d) {
+    /*
+        - Rebuilds the next command tree of the stream in line_arena. Words and redirection
+          targets point into the compiled script; nothing is tokenized or parsed.
+        - Returns NULL with d->bad set if the stream is damaged.
+    */
+    if (++d->depth > SCRIPT_CACHE_DEPTH) d->bad = 1;
+    unsigned char type = script_get_byte(d);
+    unsigned char fields = script_get_byte(d);
+    uint32_t count = script_get_count(d);
+    if (d->bad || type > NODE_FANOUT) {
+        d->bad = 1;
+        return NULL;
+    }
+    struct node *n = node_new(&line_arena, type, NULL, NULL);
+    n->count = count;
+    n->text_start = script_get_varint(d);
+    n->text_len = script_get_varint(d);
+    if (fields & SCRIPT_ARGV) {
+        n->argv = arena_alloc(&line_arena, ((size_t)count + 1) * sizeof(char *));
+        for (uint32_t i = 0; i < count; i++) n->argv[i] = script_get_string(d);
+        n->argv[count] = NULL;
+    }
+    if (fields & SCRIPT_ASSIGNS) {
+        n->nassigns = script_get_count(d);
+        n->assigns = arena_alloc(&line_arena, ((size_t)n->nassigns + 1) * sizeof(char *));
+        for (int i = 0; i < n->nassigns; i++) n->assigns[i] = script_get_string(d);
+        n->assigns[n->nassigns] = NULL;
+    }
+    if (fields & SCRIPT_RAW) n->raw = (unsigned char *)script_get(d, (size_t)count + n->nassigns);
+    if (fields & SCRIPT_REDIRECTS) {
+        n->nredirects = script_get_count(d);
+        n->redirects = arena_alloc(&line_arena, (size_t)n->nredirects * sizeof(struct redirect));
+        for (int i = 0; i < n->nredirects; i++) {
+            n->redirects[i].type = script_get_byte(d);
+            n->redirects[i].fd = script_get_varint(d);
+            n->redirects[i].raw = script_get_byte(d);
+            n->redirects[i].target = script_get_string(d);
+        }
+    }
+    if (type == NODE_PIPELINE) n->pipe_size = script_get_varint(d);
+    if (fields & SCRIPT_LIMITS) {
+        const void *limits = script_get(d, sizeof(struct job_limits));
+        if (limits) {
+            n->limits = arena_alloc(&line_arena, sizeof(struct job_limits));
+            memcpy(n->limits, limits, sizeof(struct job_limits));
         }
     }
+    if (fields & SCRIPT_STAGES) {
+        n->stages = arena_alloc(&line_arena, ((size_t)count ? count : 1) * sizeof(struct node *));
+        for (uint32_t i = 0; i < count && !d->bad; i++) n->stages[i] = script_decode(d);
+    }
+    if (fields & SCRIPT_LEFT) n->left = script_decode(d);
+    if (fields & SCRIPT_RIGHT) n->right = script_decode(d);
+    d->depth--;
+    return d->bad ? NULL : n;
 }
 
-void run_builtin_pwd() {
+int script_cache_key(struct script_cache_key *key, const struct stat *st) {
     /*
-        - Built-in command handler for 'pwd'.
-        - Retrieves and prints the current working directory.
-        - Uses getcwd system call; on failure, prints an error message.
+        - Fills the key of a script from its stat data and the shell executable's.
+        - Returns 0, or -1 if the shell executable cannot be identified.
     */
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("%s\n", cwd);
+    struct stat shell;
+    if (stat("/proc/self/exe", &shell) < 0) return -1;
+    memset(key, 0, sizeof(*key));
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->shell_size = shell.st_size;
+    key->shell_mtime_sec = shell.st_mtim.tv_sec;
+    key->shell_mtime_nsec = shell.st_mtim.tv_nsec;
+    return 0;
+}
+
+int script_cache_path(const char *abs, char *path, size_t size) {
+    /*
+        - Builds the cache file name of the script at absolute path abs: a 64-bit FNV-1a hash
+          of the path in $SHELL322_CACHE, or ~/.cache/shell322, creating the directory.
+        - Returns 0, or -1 if there is no cache directory.
+    */
+    char dir[PATH_MAX];
+    const char *env = var_get("SHELL322_CACHE");
+    if (env && *env) {
+        snprintf(dir, sizeof(dir), "%s", env);
     } else {
-        perror("pwd error");
+        const char *home = var_get("HOME");
+        if (!home || !*home) return -1;
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.cache/shell322", home);
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) return -1;
+
+    uint64_t h = 14695981039346656037ull;
+    for (const unsigned char *p = (const unsigned char *)abs; *p; p++) h = (h ^ *p) * 1099511628211ull;
+    int n = snprintf(path, size, "%s/%016" PRIx64 ".sc", dir, h);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+int script_cache_open(struct script_cache *c, const char *path, const char *abs, const struct script_cache_key *key) {
+    /*
+        - Maps the cache file at path if it holds the compiled form of abs for this key.
+        - The mapping is private and writable, so the trees can be used like parsed ones
+          without ever touching the file.
+        - Returns 0, or -1 if the file is missing, stale or damaged.
+    */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct script_cache_header)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    struct script_cache t = { .data = map, .size = st.st_size, .mapped = 1 };
+    const struct script_cache_header *h = map;
+    const char *cached_path = script_cache_at(&t, h->path, 1, 1);
+    t.nlines = h->nlines;
+    t.lines = script_cache_at(&t, h->lines, (size_t)h->nlines * sizeof(uint32_t), sizeof(uint32_t));
+    int ok = memcmp(h->magic, SCRIPT_CACHE_MAGIC, sizeof(h->magic)) == 0 &&
+             h->file_size == (uint64_t)st.st_size && t.data[t.size - 1] == '\0' &&
+             memcmp(&h->key, key, sizeof(*key)) == 0 &&
+             cached_path && strcmp(cached_path, abs) == 0 && (t.lines || h->nlines == 0);
+    for (uint32_t i = 0; ok && i < t.nlines; i++) ok = script_cache_at(&t, t.lines[i], 1, 1) != NULL;
+    if (!ok) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
+    *c = t;
+    return 0;
+}
+
+int script_compile(struct script_writer *w, struct line_reader *reader, const char *abs,
+                   const struct script_cache_key *key) {
+    /*
+        - Tokenizes and parses every command line of the script into w, laid out as a cache file.
+        - The parser reports syntax errors as it finds them, so stderr points at /dev/null
+          during the pass; such lines are stored without a tree and reported when they run.
+        - Returns 0, or -1 if the buffer could not be built.
+    */
+    struct arena scratch = { 0 };
+    struct script_cache_header header;
+    memset(&header, 0, sizeof(header));
+    script_put(w, &header, sizeof(header), 8);
+
+    fflush(stderr);
+    int saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    int null_fd = saved_stderr >= 0 ? open("/dev/null", O_WRONLY | O_CLOEXEC) : -1;
+    if (null_fd >= 0) {
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    uint32_t *lines = NULL;
+    size_t nlines = 0, cap = 0;
+    char *line;
+    while (!w->failed && (line = reader_next_line(reader))) {
+        if (line_is_blank(line)) continue;
+        if (nlines == cap) {
+            cap = cap ? cap * 2 : 256;
+            uint32_t *grown = realloc(lines, cap * sizeof(*lines));
+            if (!grown) {
+                w->failed = 1;
+                break;
+            }
+            lines = grown;
+        }
+        lines[nlines++] = script_put(w, line, strlen(line) + 1, 1);
+
+        // The tokenizer edits its input, so it gets a copy; the stored text stays as written
+        struct token_list tokens = { .arena = &scratch };
+        char *copy = arena_strndup(&scratch, line, strlen(line));
+        struct node *root = NULL;
+        if (parse_input(copy, &tokens) == 0 && tokens.count > 0) root = parse_line(copy, &tokens, &scratch);
+        script_put_byte(w, root != NULL);
+        if (root) script_encode(w, root);
+        arena_reset(&scratch);
+    }
+
+    if (saved_stderr >= 0) {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+
+    header.lines = script_put(w, lines, nlines * sizeof(*lines), sizeof(*lines));
+    header.nlines = nlines;
+    header.path = script_put(w, abs, strlen(abs) + 1, 1);
+    script_put(w, "", 1, 1);  // Every string ends before the end of the file
+    free(lines);
+    arena_free(&scratch);
+    if (w->failed) return -1;
+
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.file_size = w->len;
+    header.key = *key;
+    memcpy(w->buf, &header, sizeof(header));
+    return 0;
+}
+
+void script_cache_write(const char *path, const char *data, size_t len) {
+    /*
+        - Stores a compiled script: written to a temporary file and renamed over path, so
+          scripts started at the same moment (cron) never see a partial file.
+        - Failures are ignored; the script is simply compiled again next time.
+    */
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
     }
+    if (close(fd) == 0 && done == len && rename(tmp, path) == 0) return;
+    unlink(tmp);
 }
 
-void execute_command(char **args, int background) {
+int script_cache_load(struct script_cache *c, const char *script, int fd, struct line_reader *reader) {
     /*
-        - Executes a command given by args.
-        - If background is 0, waits for the command to finish.
-        - If background is 1, runs the command in the background and prints the PID.
-        - Uses fork to create a child process and execvp to execute the command.
-        - Prints error message if fork or execvp fails.
+        - Gets the compiled form of the script open on fd, so its lines run without being
+          tokenized or parsed: from the cache file when it matches the script's path, mtime
+          and size (and the shell binary), otherwise by compiling the script from reader and
+          storing the result.
+        - A script changed less than SCRIPT_CACHE_SETTLE seconds ago is not compiled, since
+          another change within the same mtime tick would go unnoticed.
+        - Returns 0, or -1 if the script should be read line by line from reader instead
+          (not a regular file, no cache directory, or compiling failed).
     */
-    pid_t pid = fork();
+    struct stat st;
+    char abs[PATH_MAX], path[PATH_MAX];
+    struct script_cache_key key;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !realpath(script, abs) ||
+        script_cache_key(&key, &st) < 0 || script_cache_path(abs, path, sizeof(path)) < 0) {
+        return -1;
+    }
+    if (script_cache_open(c, path, abs, &key) == 0) return 0;
+    if (time(NULL) - st.st_mtime < SCRIPT_CACHE_SETTLE) return -1;
+
+    struct script_writer w = { 0 };
+    if (script_compile(&w, reader, abs, &key) < 0) {
+        // The pass consumed the reader; start it over on the script
+        free(w.buf);
+        reader_close(reader);
+        lseek(fd, 0, SEEK_SET);
+        reader_init_fd(reader, fd);
+        return -1;
+    }
+    script_cache_write(path, w.buf, w.len);
+
+    c->data = w.buf;
+    c->size = w.len;
+    c->mapped = 0;
+    const struct script_cache_header *h = (const struct script_cache_header *)w.buf;
+    c->lines = (const uint32_t *)(w.buf + h->lines);
+    c->nlines = h->nlines;
+    c->next = 0;
+    return 0;
+}
+
+char *script_cache_next(struct script_cache *c, struct node **root) {
+    /*
+        - Returns the next command line of a compiled script (a copy in line_arena) and sets
+          *root to its tree, or to NULL if the line has to be parsed when run.
+        - Returns NULL after the last line.
+    */
+    if (c->next == c->nlines) return NULL;
+    struct script_decoder d = { .c = c, .pos = c->lines[c->next++] };
+    char *text = script_get_string(&d);
+    *root = script_get_byte(&d) ? script_decode(&d) : NULL;
+    return arena_strndup(&line_arena, text, strlen(text));
+}
 
-    if (pid < 0) {
-        perror("fork failed");  // Fork failure
-    } else if (pid == 0) {
-        // Child process: execute the command
-        execvp(args[0], args);
-        // If execvp returns, an error occurred
-        perror("exec error");
-        exit(EXIT_FAILURE);
+void script_cache_close(struct script_cache *c) {
+    /*
+        - Releases the mapping or buffer of a compiled script.
+    */
+    if (c->mapped) {
+        munmap(c->data, c->size);
     } else {
-        // Parent process
-        if (!background) {
-            // Wait for child to finish if not background
-            waitpid(pid, NULL, 0);
+        free(c->data);
+    }
+    c->data = NULL;
+}
+
+void *completion_thread(void *arg) {
+    /*
+        - Body of the completion thread: lists the directories of the latest request through
+          dir_read and posts the listings back, so a slow directory (a network mount) is read
+          here while the editor keeps taking keys.
+        - A request replaced while it was being listed is thrown away.
+    */
+    (void)arg;
+    struct completion_job *c = &completer;
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (c->taken == c->seq) pthread_cond_wait(&c->wake, &c->lock);
+        unsigned long seq = c->seq;
+        char **dirs = c->dirs;
+        int ndirs = c->ndirs;
+        c->dirs = NULL;
+        c->taken = seq;
+        pthread_mutex_unlock(&c->lock);
+
+        struct dir_listing **listings = malloc((ndirs + 1) * sizeof(*listings));
+        for (int i = 0; i < ndirs; i++) listings[i] = dir_read(dirs[i]);
+        free(dirs);
+
+        pthread_mutex_lock(&c->lock);
+        if (seq == c->seq) {
+            free(c->listings);
+            c->listings = listings;
+            c->nlistings = ndirs;
+            c->done = seq;
+            if (write(c->notify[1], "", 1) < 0) {}  // Pipe full: a wakeup is pending anyway
         } else {
-            // For background process, print process ID and do not wait
-            printf("[BG] Process ID: %d\n", pid);
+            free(listings);
         }
     }
+    return NULL;
 }
 
-int parse_input(char *line, char **args) {
+void dir_cache_lock_fork() {
     /*
-        - Parses the input line into arguments separated by spaces or tabs.
-        - Stores pointers to tokens in the args array.
-        - Ensures args is NULL-terminated.
-        - Returns the number of arguments parsed.
+        - pthread_atfork prepare handler: holds the directory cache lock across fork so the
+          child never inherits it half-taken by the completion thread.
     */
-    int i = 0;
-    char *token = strtok(line, " \t\n");
+    pthread_mutex_lock(&dir_cache_lock);
+}
 
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " \t\n");
-    }
+void dir_cache_unlock_fork() {
+    /*
+        - pthread_atfork parent and child handler: releases the lock taken before the fork.
+    */
+    pthread_mutex_unlock(&dir_cache_lock);
+}
+
+int completion_start() {
+    /*
+        - Starts the completion thread on first use; returns -1 if it cannot run, and Tab
+          then lists directories itself.
+    */
+    if (completer.started) return 0;
+    if (pipe2(completer.notify, O_CLOEXEC | O_NONBLOCK) < 0) return -1;
 
-    args[i] = NULL;
-    return i;
+    // The thread takes no signals, so SIGCHLD and the rest keep going to the main thread
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, completion_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        close(completer.notify[0]);
+        close(completer.notify[1]);
+        completer.notify[0] = completer.notify[1] = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    // A child forked while the thread holds the cache lock would otherwise find it held forever
+    pthread_atfork(dir_cache_lock_fork, dir_cache_unlock_fork, dir_cache_unlock_fork);
+    completer.started = 1;
+    return 0;
 }
 
-void handle_pipe(char *left, char *right) {
+unsigned long completion_submit(char **dirs, int ndirs) {
     /*
-        - Handles execution of two commands connected by a pipe '|'.
-        - Creates a pipe and forks two child processes.
-        - The first child redirects its stdout to the pipe write end and executes the left command.
-        - The second child redirects its stdin to the pipe read end and executes the right command.
-        - Parent closes pipe descriptors and waits for both children to finish.
-        - Prints error messages if exec fails.
+        - Hands a copy of the directory list to the completion thread and returns the number
+          of the request. A request the thread has not picked up yet is replaced.
     */
-    int pipefd[2];
-    pipe(pipefd);  // Create a pipe: pipefd[0] for reading, pipefd[1] for writing
+    size_t size = ndirs * sizeof(char *);
+    for (int i = 0; i < ndirs; i++) size += strlen(dirs[i]) + 1;
+    char **copy = malloc(size);
+    char *text = (char *)(copy + ndirs);
+    for (int i = 0; i < ndirs; i++) {
+        copy[i] = text;
+        strcpy(text, dirs[i]);
+        text += strlen(dirs[i]) + 1;
+    }
+
+    struct completion_job *c = &completer;
+    pthread_mutex_lock(&c->lock);
+    free(c->dirs);
+    c->dirs = copy;
+    c->ndirs = ndirs;
+    unsigned long seq = ++c->seq;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+    return seq;
+}
 
-    pid_t pid1 = fork();
-    if (pid1 == 0) {
-        // First child: executes left command, output goes to pipe write end
-        dup2(pipefd[1], STDOUT_FILENO);  // Redirect stdout to pipe write end
-        close(pipefd[0]);                 // Close unused read end
-        close(pipefd[1]);                 // Close original write end after dup2
+struct dir_listing **completion_result(unsigned long seq, int *count) {
+    /*
+        - Returns the listings of request seq (copied to line_arena) once the thread is done
+          with it, or NULL if it is not; always empties the wakeup pipe.
+    */
+    struct completion_job *c = &completer;
+    char drain[64];
+    while (read(c->notify[0], drain, sizeof(drain)) > 0) {}
 
-        char *args[MAX_ARGS];
-        parse_input(left, args);
-        execvp(args[0], args);
-        perror("exec left");  // Exec failed
-        exit(1);
+    struct dir_listing **result = NULL;
+    pthread_mutex_lock(&c->lock);
+    if (seq && c->done == seq) {
+        result = arena_alloc(&line_arena, (c->nlistings + 1) * sizeof(*result));
+        memcpy(result, c->listings, c->nlistings * sizeof(*result));
+        *count = c->nlistings;
     }
+    pthread_mutex_unlock(&c->lock);
+    return result;
+}
 
-    pid_t pid2 = fork();
-    if (pid2 == 0) {
-        // Second child: executes right command, input comes from pipe read end
-        dup2(pipefd[0], STDIN_FILENO);   // Redirect stdin to pipe read end
-        close(pipefd[1]);                 // Close unused write end
-        close(pipefd[0]);                 // Close original read end after dup2
+// Word under the cursor, as seen by completion
+struct completion_word {
+    size_t start;  // Offset of the word in the line
+    int command;   // In command position without a '/': complete command names
+    char *dir;     // Directory to list, with '~/' expanded ('' for the current directory)
+    char *base;    // Unescaped rest of the word, which candidates must start with
+};
 
-        char *args[MAX_ARGS];
-        parse_input(right, args);
-        execvp(args[0], args);
-        perror("exec right");  // Exec failed
-        exit(1);
+void completion_word_at(struct line_editor *ed, struct completion_word *w) {
+    /*
+        - Finds the word ending at the cursor and whether it names a command: it is the first
+          word after the start of the line or '|', '&', ';' and '(' that is not an assignment
+          or a redirection target.
+    */
+    size_t start = 0;
+    int command = 1, redirect = 0;
+    for (size_t i = 0; i < ed->pos; i++) {
+        char c = ed->buf[i];
+        if (c == '\\') {
+            i++;
+        } else if (strchr("|&;(", c)) {
+            command = 1;
+            redirect = 0;
+            start = i + 1;
+        } else if (c == '<' || c == '>') {
+            redirect = 1;
+            start = i + 1;
+        } else if (c == ' ' || c == '\t') {
+            if (start < i) {
+                size_t name = var_name_length(ed->buf + start);
+                if (redirect) redirect = 0;
+                else if (!(name && ed->buf[start + name] == '=')) command = 0;
+            }
+            start = i + 1;
+        }
     }
 
-    // Parent closes both ends of the pipe as it's not used here
-    close(pipefd[0]);
-    close(pipefd[1]);
-    // Wait for both child processes to finish
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+    // Unescape the word and split it at its last '/'
+    char *word = arena_alloc(&line_arena, ed->pos - start + 1);
+    size_t n = 0, slash = 0;
+    for (size_t i = start; i < ed->pos; i++) {
+        if (ed->buf[i] == '\\' && i + 1 < ed->pos) i++;
+        word[n++] = ed->buf[i];
+        if (ed->buf[i] == '/') slash = n;
+    }
+    word[n] = '\0';
+    w->start = start;
+    w->command = command && !redirect && slash == 0;
+    w->base = word + slash;
+    const char *home = slash && word[0] == '~' && word[1] == '/' ? var_get("HOME") : NULL;
+    if (home) {
+        w->dir = arena_alloc(&line_arena, strlen(home) + slash);
+        memcpy(w->dir, home, strlen(home));
+        memcpy(w->dir + strlen(home), word + 1, slash - 1);
+        w->dir[strlen(home) + slash - 1] = '\0';
+    } else {
+        w->dir = arena_strndup(&line_arena, word, slash);
+    }
 }
 
-void handle_and(char *left, char *right) {
+int completion_dirs(struct completion_word *w, char ***dirs) {
     /*
-        - Handles execution of two commands connected by logical AND '&&'.
-        - Executes the left command first.
-        - If the left command exits successfully (exit status 0), executes the right command.
-        - Uses fork and execvp for execution and waitpid to check exit status.
+        - Sets dirs to the directories whose listings hold the candidates: every PATH
+          directory for a command name, or the word's own directory; returns their number.
     */
-    char *args[MAX_ARGS];
-    parse_input(left, args);
+    if (!w->command) {
+        *dirs = arena_alloc(&line_arena, sizeof(char *));
+        (*dirs)[0] = w->dir;
+        return 1;
+    }
+    const char *path = var_get("PATH");
+    if (!path) path = "/usr/bin:/bin";
+    int n = 1;
+    for (const char *p = path; *p; p++) n += *p == ':';
+    *dirs = arena_alloc(&line_arena, n * sizeof(char *));
+    n = 0;
+    for (const char *p = path;; p++) {
+        size_t len = strcspn(p, ":");
+        (*dirs)[n++] = len ? arena_strndup(&line_arena, p, len) : ".";
+        p += len;
+        if (!*p) break;
+    }
+    return n;
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child executes left command
-        execvp(args[0], args);
-        perror("exec");  // Exec failed
-        exit(1);
+void editor_insert(struct line_editor *ed, const char *s, size_t n) {
+    /*
+        - Inserts n bytes of s at the cursor and moves the cursor past them, growing the
+          buffer by doubling.
+    */
+    if (ed->len + n + 1 > ed->cap) {
+        size_t cap = ed->cap ? ed->cap : 256;
+        while (cap < ed->len + n + 1) cap *= 2;
+        ed->buf = realloc(ed->buf, cap);
+        ed->cap = cap;
     }
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, s, n);
+    ed->len += n;
+    ed->pos += n;
+    ed->buf[ed->len] = '\0';
+    ed->edits++;
+}
 
-    int status;
-    waitpid(pid, &status, 0);
-    // Check if left command exited normally with status 0
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-        // If successful, parse and execute right command
-        parse_input(right, args);
-        execute_command(args, 0);
+void editor_delete(struct line_editor *ed, size_t from, size_t to) {
+    /*
+        - Removes the bytes [from, to) of the line; a cursor inside the range moves to from,
+          one after it moves back with the text.
+    */
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    ed->buf[ed->len] = '\0';
+    if (ed->pos > to) ed->pos -= to - from;
+    else if (ed->pos > from) ed->pos = from;
+    ed->edits++;
+}
+
+void editor_set(struct line_editor *ed, const char *s, size_t n) {
+    /*
+        - Replaces the whole line with n bytes of s and puts the cursor at its end.
+    */
+    ed->len = ed->pos = 0;
+    editor_insert(ed, s, n);
+}
+
+void editor_redraw(struct line_editor *ed) {
+    /*
+        - Rewrites the prompt and the line in place and puts the cursor back.
+    */
+    out_write("\r", 1);
+    out_write(ed->prompt, strlen(ed->prompt));
+    out_write(ed->buf, ed->len);
+    out_write("\033[K", 3);
+    if (ed->pos < ed->len) out_printf("\033[%zuD", ed->len - ed->pos);
+    out_flush();
+}
+
+void editor_show_candidates(struct line_editor *ed, char **items, int count) {
+    /*
+        - Lists the candidates in columns under the line, then draws the line again.
+    */
+    struct winsize ws;
+    int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+    size_t longest = 0;
+    for (int i = 0; i < count; i++) {
+        if (strlen(items[i]) > longest) longest = strlen(items[i]);
+    }
+    int columns = width / (int)(longest + 2);
+    if (columns < 1) columns = 1;
+    int rows = (count + columns - 1) / columns;
+    out_write("\n", 1);
+    for (int r = 0; r < rows; r++) {
+        for (int k = r; k < count; k += rows) {
+            out_printf("%-*s", k + rows < count ? (int)(longest + 2) : 0, items[k]);
+        }
+        out_write("\n", 1);
     }
+    editor_redraw(ed);
 }
 
+void editor_apply_completion(struct line_editor *ed, struct dir_listing **listings, int nlistings, int show) {
+    /*
+        - Completes the word at the cursor from the listings (and, for a command name, the
+          builtins and the command-location cache): a single candidate is inserted whole,
+          several are extended to their longest common prefix, and listed if that adds nothing
+          and show is set (second Tab).
+        - Directories get a '/' and nothing after it; other completed words get a space.
+    */
+    struct completion_word w;
+    completion_word_at(ed, &w);
+    size_t base_len = strlen(w.base);
+    int cap = 64, count = 0;
+    char **items = arena_alloc(&line_arena, cap * sizeof(char *));
 
-int main() {
-    char line[MAX_LINE];
+    for (int pass = 0; pass < 3; pass++) {
+        size_t nsources = pass == 0 ? (w.command ? sizeof(builtins) / sizeof(builtins[0]) : 0)
+                        : pass == 1 ? (w.command ? HASH_BUCKETS : 0) : (size_t)nlistings;
+        for (size_t s = 0; s < nsources; s++) {
+            struct hash_entry *h = pass == 1 ? command_hash[s] : NULL;
+            struct dir_listing *d = pass == 2 ? listings[s] : NULL;
+            int n = pass == 0 ? 1 : pass == 2 ? (d ? d->count : 0) : 0;
+            for (int k = 0; pass == 1 ? h != NULL : k < n; k++) {
+                const char *name;
+                int is_dir = 0;
+                if (pass == 0) {
+                    name = builtins[s].name;
+                } else if (pass == 1) {
+                    name = h->name;
+                    h = h->next;
+                } else {
+                    name = d->names[k];
+                    is_dir = d->types[k] == DT_DIR;
+                    if (w.command && is_dir) continue;
+                    if (name[0] == '.' && w.base[0] != '.') continue;
+                }
+                if (strncmp(name, w.base, base_len) != 0) continue;
+                if (count == cap) {
+                    items = arena_grow(&line_arena, items, cap * sizeof(char *), 2 * cap * sizeof(char *));
+                    cap *= 2;
+                }
+                size_t len = strlen(name);
+                items[count] = arena_alloc(&line_arena, len + 2);
+                memcpy(items[count], name, len);
+                items[count][len] = '/';
+                items[count][len + is_dir] = '\0';
+                count++;
+            }
+        }
+    }
+    if (count == 0) {
+        out_write("\a", 1);
+        out_flush();
+        return;
+    }
+    qsort(items, count, sizeof(char *), compare_strings);
+    int unique = 1;
+    for (int i = 1; i < count; i++) {
+        if (strcmp(items[i], items[unique - 1]) != 0) items[unique++] = items[i];
+    }
+    count = unique;
 
-    // Main shell loop
-    while (1) {
-        printf("shell322> ");
-        if (!fgets(line, sizeof(line), stdin)) break;  // Exit on EOF or error
-        if (line[0] == '\n') continue;                  // Ignore empty lines
+    size_t common = strlen(items[0]);
+    for (int i = 1; i < count; i++) {
+        size_t k = 0;
+        while (k < common && items[i][k] == items[0][k]) k++;
+        common = k;
+    }
+    if (common == base_len && count > 1) {
+        if (show) editor_show_candidates(ed, items, count);
+        else out_write("\a", 1);
+        out_flush();
+        return;
+    }
 
-        add_to_history(line);  // Store command in history
+    // Insert the completed part, escaping what the tokenizer would treat specially
+    for (size_t k = base_len; k < common; k++) {
+        char c = items[0][k];
+        if (strchr(" \t\\'\"$&|;<>()*?[]#{},!", c)) editor_insert(ed, "\\", 1);
+        editor_insert(ed, &c, 1);
+    }
+    if (count == 1 && items[0][common - 1] != '/') editor_insert(ed, " ", 1);
+    editor_redraw(ed);
+}
 
-        // Check for logical AND operator '&&' in the input line
-        char *and_ptr = strstr(line, "&&");
-        if (and_ptr) {
-            *and_ptr = '\0';            // Split line into two commands
-            handle_and(line, and_ptr + 2);  // Handle commands connected by &&
-            continue;
+void editor_complete(struct line_editor *ed, int show) {
+    /*
+        - Handles Tab: asks the completion thread for the listings the word needs and
+          waits up to COMPLETE_WAIT_MS for them. Listings already in the directory cache come
+          back at once; a slow directory finishes in the background and is applied as soon as
+          it arrives, unless the line has been edited in the meantime.
+    */
+    struct completion_word w;
+    completion_word_at(ed, &w);
+    char **dirs;
+    int ndirs = completion_dirs(&w, &dirs);
+
+    if (completion_start() < 0) {
+        struct dir_listing **listings = arena_alloc(&line_arena, ndirs * sizeof(*listings));
+        for (int i = 0; i < ndirs; i++) listings[i] = dir_read(dirs[i]);
+        editor_apply_completion(ed, listings, ndirs, show);
+        return;
+    }
+    unsigned long seq = completion_submit(dirs, ndirs);
+    struct pollfd p = { completer.notify[0], POLLIN, 0 };
+    if (poll(&p, 1, COMPLETE_WAIT_MS) > 0) {
+        int count;
+        struct dir_listing **listings = completion_result(seq, &count);
+        if (listings) {
+            editor_apply_completion(ed, listings, count, show);
+            return;
         }
+    }
+    ed->pending = seq;
+    ed->pending_edits = ed->edits;
+    ed->pending_show = show;
+}
 
-        // Check for pipe '|' in the input line
-        char *pipe_ptr = strchr(line, '|');
-        if (pipe_ptr) {
-            *pipe_ptr = '\0';            // Split line into two commands
-            handle_pipe(line, pipe_ptr + 1);  // Handle commands connected by pipe
-            continue;
+void editor_history(struct line_editor *ed, int older) {
+    /*
+        - Up / Down: moves to the next older or newer history entry that starts with the text
+          typed before the first Up (every entry if nothing was typed), through the history
+          index; going past the newest entry brings the typed text back.
+    */
+    long total = history_count();
+    if (ed->hist_id > total) {
+        ed->typed = realloc(ed->typed, ed->len + 1);
+        memcpy(ed->typed, ed->buf, ed->len + 1);
+        ed->typed_len = ed->len;
+    }
+    long id = 0;
+    size_t len;
+    if (older) {
+        id = history_find_prefix(ed->typed, ed->hist_id);
+    } else if (ed->hist_id <= total) {
+        for (long k = ed->hist_id + 1; k <= total && !id; k++) {
+            const char *entry = history_get(k, &len);
+            if (entry && len >= ed->typed_len && memcmp(entry, ed->typed, ed->typed_len) == 0) id = k;
+        }
+        if (!id) id = total + 1;
+    }
+    if (!id) {
+        out_write("\a", 1);
+        return;
+    }
+    ed->hist_id = id;
+    const char *entry = id <= total ? history_get(id, &len) : NULL;
+    if (entry) editor_set(ed, entry, len);
+    else editor_set(ed, ed->typed, ed->typed_len);
+}
+
+int editor_key(int timeout_ms) {
+    /*
+        - Reads the next byte of an escape sequence, or returns -1 if none comes in time.
+    */
+    struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    unsigned char c;
+    if (poll(&p, 1, timeout_ms) <= 0 || read(STDIN_FILENO, &c, 1) != 1) return -1;
+    return c;
+}
+
+char *line_edit(struct line_editor *ed, const char *prompt, struct line_reader *reader) {
+    /*
+        - Reads one line from the terminal with editing: arrows, Home / End, Ctrl-A / E / B / F
+          move, Backspace / Delete / Ctrl-D / K / U / W delete, Up / Down (Ctrl-P / N) walk the
+          history, Ctrl-R searches it, Tab completes, Ctrl-C drops the line, Ctrl-L clears
+          the screen.
+        - Returns the line (owned by the editor, without a newline), or NULL at end of input.
+        - Falls back to the plain reader if the terminal cannot be put in raw mode.
+    */
+    struct termios saved, raw;
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) {
+        out_write(prompt, strlen(prompt));
+        out_flush();
+        return reader_next_line(reader);
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    ed->len = ed->pos = 0;
+    ed->prompt = prompt;
+    ed->hist_id = history_count() + 1;
+    ed->pending = 0;
+    ed->last_was_tab = 0;
+    editor_insert(ed, "", 0);
+    editor_redraw(ed);
+
+    char *result = NULL;
+    while (1) {
+        struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { completer.notify[0], POLLIN, 0 } };
+        if (poll(fds, completer.started ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (completer.started && (fds[1].revents & POLLIN)) {
+            int count;
+            struct dir_listing **listings = completion_result(ed->pending, &count);
+            if (listings) {
+                if (ed->edits == ed->pending_edits) editor_apply_completion(ed, listings, count, ed->pending_show);
+                ed->pending = 0;
+            }
         }
+        if (!fds[0].revents) continue;
 
-        // Check for background execution symbol '&'
-        int background = 0;
-        if (strchr(line, '&')) {
-            background = 1;                  // Mark command for background execution
-            line[strcspn(line, "&")] = '\0'; // Remove '&' from the command string
+        unsigned char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (ed->len) result = ed->buf;  // Last line without a newline
+            break;
         }
+        int tab = c == '\t';
+        if (c == '\r' || c == '\n') {
+            out_write("\n", 1);
+            result = ed->buf;
+            break;
+        } else if (c == 4 && ed->len == 0) {
+            out_write("\n", 1);
+            break;  // Ctrl-D on an empty line
+        } else if (c == '\t') {
+            editor_complete(ed, ed->last_was_tab);
+        } else if (c == 3) {
+            out_write("^C\n", 3);
+            ed->len = ed->pos = 0;
+            ed->buf[0] = '\0';
+            ed->hist_id = history_count() + 1;
+            ed->edits++;
+        } else if (c == 1) {
+            ed->pos = 0;
+        } else if (c == 5) {
+            ed->pos = ed->len;
+        } else if (c == 2) {
+            if (ed->pos > 0) ed->pos--;
+        } else if (c == 6) {
+            if (ed->pos < ed->len) ed->pos++;
+        } else if (c == 127 || c == 8) {
+            if (ed->pos > 0) editor_delete(ed, ed->pos - 1, ed->pos);
+        } else if (c == 4) {
+            if (ed->pos < ed->len) editor_delete(ed, ed->pos, ed->pos + 1);
+        } else if (c == 11) {
+            editor_delete(ed, ed->pos, ed->len);
+        } else if (c == 21) {
+            editor_delete(ed, 0, ed->pos);
+        } else if (c == 23) {
+            size_t from = ed->pos;
+            while (from > 0 && ed->buf[from - 1] == ' ') from--;
+            while (from > 0 && ed->buf[from - 1] != ' ') from--;
+            editor_delete(ed, from, ed->pos);
+        } else if (c == 12) {
+            out_write("\033[H\033[2J", 7);
+        } else if (c == 16 || c == 14) {
+            editor_history(ed, c == 16);
+        } else if (c == 18) {
+            char *found = history_search_interactive();
+            if (found) editor_set(ed, found, strlen(found));
+        } else if (c == 27) {
+            // Escape sequences of the arrow, Home, End and Delete keys
+            int k = editor_key(50);
+            int key = k == '[' || k == 'O' ? editor_key(50) : -1;
+            if (key >= '0' && key <= '9') {
+                // ESC [ n ~: 3 is Delete, 1 and 7 Home, 4 and 8 End
+                int digit = key;
+                while (key >= '0' && key <= '9') key = editor_key(50);
+                if (key == '~' && digit == '3' && ed->pos < ed->len) editor_delete(ed, ed->pos, ed->pos + 1);
+                key = key != '~' ? -1 : digit == '1' || digit == '7' ? 'H' : digit == '4' || digit == '8' ? 'F' : -1;
+            }
+            if (key == 'A' || key == 'B') editor_history(ed, key == 'A');
+            else if (key == 'C' && ed->pos < ed->len) ed->pos++;
+            else if (key == 'D' && ed->pos > 0) ed->pos--;
+            else if (key == 'H') ed->pos = 0;
+            else if (key == 'F') ed->pos = ed->len;
+        } else if (c >= 32) {
+            editor_insert(ed, (char *)&c, 1);
+        }
+        ed->last_was_tab = tab;
+        editor_redraw(ed);
+    }
 
-        char *args[MAX_ARGS];
-        parse_input(line, args);
-        if (args[0] == NULL) continue;  // Ignore empty commands
+    out_flush();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    ed->pending = 0;
+    return result;
+}
 
-        // Handle built-in commands
-        if (strcmp(args[0], "cd") == 0) {
-            run_builtin_cd(args);  // Change directory
-        } else if (strcmp(args[0], "pwd") == 0) {
-            run_builtin_pwd();     // Print working directory
-        } else if (strcmp(args[0], "exit") == 0) {
-            break;                // Exit the shell loop
-        } else if (strcmp(args[0], "history") == 0) {
-            show_history();       // Display command history
-        } else {
-            // Execute external command with optional background execution
-            execute_command(args, background);
+int main(int argc, char *argv[]) {
+    /*
+        - Entry point of the shell.
+        - 'shell322' reads commands from stdin; the prompt is only shown when stdin is a terminal.
+        - 'shell322 script.sh' runs the commands of a script file without any prompt, from its
+          compiled form in the script cache (script_cache_load); 'shell322 --no-cache script.sh'
+          reads and parses it line by line instead.
+        - 'shell322 -c "commands"' runs the given command string without any prompt.
+        - Arguments after the script ('shell322 script.sh a b') or after '-c commands NAME'
+          are the positional parameters $1...
+    */
+    struct line_reader reader;
+    struct line_editor editor = { 0 };
+    int interactive = 0;
+    int script_fd = -1;
+
+    // Internal mode: the spawn server re-executed by 'set -o spawnserver'
+    if (argc == 3 && strcmp(argv[1], "--spawn-server") == 0) return spawn_server(atoi(argv[2]));
+
+    int use_cache = 1;
+    if (argc > 1 && strcmp(argv[1], "--no-cache") == 0) {
+        use_cache = 0;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    shell_pid = getpid();
+    var_import(environ);
+    shell_args = argv;  // $0 is the shell, or the script / the name after '-c cmd'
+
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        reader_init_string(&reader, argv[2]);
+        if (argc > 3) {
+            shell_args = argv + 3;
+            shell_nargs = argc - 4;
+        }
+    } else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "shell322: -c: option requires an argument\n");
+        return 2;
+    } else if (argc > 1) {
+        script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) {
+            fprintf(stderr, "shell322: %s: %s\n", argv[1], strerror(errno));
+            return 127;
         }
+        reader_init_fd(&reader, script_fd);
+        shell_args = argv + 1;
+        shell_nargs = argc - 2;
+    } else {
+        interactive = isatty(STDIN_FILENO);
+        reader_init_fd(&reader, STDIN_FILENO);
     }
+    init_shell(interactive);
+    trace_open();
+
+    // Interactive sessions keep history; scripts only do when a history file is given explicitly
+    history_enabled = interactive || var_get("SHELL322_HISTFILE") != NULL;
+    if (history_enabled) history_open();
+
+    // A script runs from its compiled form when there is one
+    struct script_cache script = { 0 };
+    int compiled = script_fd >= 0 && use_cache && script_cache_load(&script, argv[1], script_fd, &reader) == 0;
+
+    // Main shell loop
+    while (1) {
+        uint64_t trace_start = trace_now();
+        struct node *root = NULL;
+        char *line = interactive ? line_edit(&editor, "shell322> ", &reader) :
+                     compiled ? script_cache_next(&script, &root) : reader_next_line(&reader);
+        trace_record(TRACE_READ_LINE, trace_start, 0, 0, NULL);
+        if (!line) break;  // Exit on EOF or error
+
+        // Ignore empty lines and comment lines (including a '#!' interpreter line)
+        if (line_is_blank(line)) continue;
+
+        trace_start = trace_now();
+        int done = run_parsed_line(line, root);
+        out_flush();
+        trace_record(TRACE_LINE, trace_start, 0, 0, current_command);
+        arena_reset(&line_arena);  // Drop all per-command state in one step
 
-    // Free dynamically allocated memory in history before exiting
-    for (int i = 0; i < HISTORY_COUNT; i++) {
-        if (history[i]) free(history[i]);
+        // Write trace events out between commands once the ring is half full
+        if (trace_fd >= 0 && trace_write - trace_read >= TRACE_RING / 2) trace_flush();
+        if (limit_cleanup_due) limit_cleanup();
+        if (done) break;
     }
 
-    return 0;
-}
\ No newline at end of file
+    reader_close(&reader);
+    if (compiled) script_cache_close(&script);
+    free(editor.buf);
+    free(editor.typed);
+    if (script_fd >= 0) close(script_fd);
+
+    // Unmap the history files and free the in-memory history before exiting
+    history_close();
+    trace_close();
+    limit_cleanup_detach();
+    free(topology.cache);
+    free(topology.node);
+    hash_clear();
+    var_clear();
+    free(stage_pipe_fds);
+    arena_free(&line_arena);
+    arena_free(&ast_arena);
+    arena_free(&memo_arena);
+    arena_free(&dir_arena);
+
+    return last_status;
+}
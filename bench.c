@@ -0,0 +1,254 @@
+/*
+ * bench.c
+ *
+ * Purpose:
+ * Benchmark harness for the custom shell (shell322). It drives the shell
+ * binary from the outside and measures:
+ * 1. Cold start: time to spawn `shell322 -c ''` and reap it.
+ * 2. Per-command overhead of builtins (`pwd`, `cd`) versus an external
+ *    command (`true`), taken from scripts of N identical lines minus an
+ *    empty script.
+ * 3. Pipeline throughput in bytes/sec for `cat file | cat ... | wc -c`
+ *    with 1 to 8 stages.
+ * 4. Latency of an `&&` chain line (`true && true`).
+ * 5. History insertion cost with 10, 10k and 1M entries already stored.
+ *
+ * Every result is printed as one JSON object per line, so runs can be
+ * compared by a script:
+ *
+ *     gcc -O2 -o shell322 290201036_P2.c
+ *     gcc -O2 -o bench bench.c
+ *     ./bench ./shell322 > bench_output.txt
+ *
+ * `./bench ./shell322 -q` runs fewer iterations for a quick check.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+extern char **environ;
+
+// Path of the shell under test and the scratch directory for scripts and data
+const char *shell_path;
+char work_dir[] = "/tmp/shell322-bench-XXXXXX";
+
+// Number of repetitions per measurement; the median is reported
+int repeats = 5;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double run_shell(char **args, char **envp) {
+    /*
+        - Runs the shell with the given arguments, stdout and stderr sent to /dev/null.
+        - Returns the wall time from spawn to reap in seconds, or -1 on failure.
+    */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    double start = now_seconds();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell_path, &actions, NULL, args, envp ? envp : environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) return -1;
+
+    int status;
+    waitpid(pid, &status, 0);
+    return now_seconds() - start;
+}
+
+double median_run(char **args, char **envp) {
+    /*
+        - Runs the shell 'repeats' times and returns the median wall time.
+    */
+    double samples[64];
+    for (int i = 0; i < repeats; i++) samples[i] = run_shell(args, envp);
+    qsort(samples, repeats, sizeof(double), compare_doubles);
+    return samples[repeats / 2];
+}
+
+void write_script(const char *path, const char *line, long count) {
+    /*
+        - Writes a script consisting of count copies of line.
+    */
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    for (long i = 0; i < count; i++) fprintf(f, "%s\n", line);
+    fclose(f);
+}
+
+double script_cost(const char *line, long count, char **envp) {
+    /*
+        - Returns the per-line cost in seconds of running line count times from a script,
+          with the cost of starting the shell on an empty script subtracted.
+    */
+    char script[512], empty[512];
+    snprintf(script, sizeof(script), "%s/script.sh", work_dir);
+    snprintf(empty, sizeof(empty), "%s/empty.sh", work_dir);
+    write_script(script, line, count);
+    write_script(empty, "", 0);
+
+    char *args[] = { (char *)shell_path, script, NULL };
+    char *empty_args[] = { (char *)shell_path, empty, NULL };
+    double total = median_run(args, envp);
+    double base = median_run(empty_args, envp);
+    return (total - base) / count;
+}
+
+void bench_cold_start() {
+    char *args[] = { (char *)shell_path, "-c", "", NULL };
+    double t = median_run(args, NULL);
+    printf("{\"bench\":\"cold_start\",\"seconds\":%.9f}\n", t);
+}
+
+void bench_commands(long count) {
+    static const char *lines[][2] = {
+        { "builtin", "pwd" },
+        { "builtin", "cd /tmp" },
+        { "external", "true" },
+        { "and_chain", "true && true" },
+    };
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        double t = script_cost(lines[i][1], count, NULL);
+        printf("{\"bench\":\"per_command\",\"kind\":\"%s\",\"command\":\"%s\",\"iterations\":%ld,"
+               "\"ns_per_command\":%.1f}\n", lines[i][0], lines[i][1], count, t * 1e9);
+    }
+}
+
+void bench_pipelines(long bytes) {
+    /*
+        - Measures throughput of 'cat data | cat | ... | wc -c' for 1 to 8 stages.
+    */
+    char data[512];
+    snprintf(data, sizeof(data), "%s/data", work_dir);
+    int fd = open(data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char block[65536];
+    memset(block, 'x', sizeof(block));
+    for (long written = 0; written < bytes; written += sizeof(block)) {
+        if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block)) break;
+    }
+    close(fd);
+
+    for (int stages = 1; stages <= 8; stages++) {
+        char cmd[1024];
+        int len = snprintf(cmd, sizeof(cmd), "cat %s", data);
+        for (int s = 2; s < stages; s++) len += snprintf(cmd + len, sizeof(cmd) - len, " | cat");
+        if (stages > 1) snprintf(cmd + len, sizeof(cmd) - len, " | wc -c");
+
+        char *args[] = { (char *)shell_path, "-c", cmd, NULL };
+        double t = median_run(args, NULL);
+        printf("{\"bench\":\"pipeline\",\"stages\":%d,\"bytes\":%ld,\"seconds\":%.6f,"
+               "\"bytes_per_sec\":%.0f}\n", stages, bytes, t, bytes / t);
+    }
+}
+
+void write_history(const char *hist, long entries, char **envp) {
+    /*
+        - Recreates the history file with the given number of entries, drops its index files,
+          and runs the shell once so the indexes are rebuilt outside the measurement.
+    */
+    FILE *f = fopen(hist, "w");
+    if (!f) {
+        perror(hist);
+        exit(1);
+    }
+    for (long n = 0; n < entries; n++) fprintf(f, "echo history entry %ld\n", n);
+    fclose(f);
+
+    char path[600];
+    snprintf(path, sizeof(path), "%s.idx", hist);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s.tri", hist);
+    unlink(path);
+
+    char *warm[] = { (char *)shell_path, "-c", "", NULL };
+    run_shell(warm, envp);
+}
+
+void bench_history(long count) {
+    /*
+        - Measures the cost of recording one history entry with 10, 10k and 1M entries stored.
+        - The same script is timed with and without SHELL322_HISTFILE; the difference per
+          line is the insertion cost.
+        - The history file is recreated before every timed run, since each run appends count
+          entries and would otherwise measure a larger history than the one reported.
+    */
+    static const long sizes[] = { 10, 10000, 1000000 };
+    char script[512];
+    snprintf(script, sizeof(script), "%s/script.sh", work_dir);
+    write_script(script, "hash", count);
+    char *args[] = { (char *)shell_path, script, NULL };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char hist[512];
+        snprintf(hist, sizeof(hist), "%s/history-%ld", work_dir, sizes[i]);
+
+        char env_hist[600];
+        snprintf(env_hist, sizeof(env_hist), "SHELL322_HISTFILE=%s", hist);
+        char *envp[] = { env_hist, "PATH=/usr/bin:/bin", NULL };
+        char *plain_envp[] = { "PATH=/usr/bin:/bin", NULL };
+
+        double samples[64];
+        for (int r = 0; r < repeats; r++) {
+            write_history(hist, sizes[i], envp);
+            samples[r] = run_shell(args, envp);
+        }
+        qsort(samples, repeats, sizeof(double), compare_doubles);
+
+        // The empty script appends nothing, so it can reuse the last history file
+        char empty[512];
+        snprintf(empty, sizeof(empty), "%s/empty.sh", work_dir);
+        write_script(empty, "", 0);
+        char *empty_args[] = { (char *)shell_path, empty, NULL };
+        double with = (samples[repeats / 2] - median_run(empty_args, envp)) / count;
+
+        double without = script_cost("hash", count, plain_envp);
+        printf("{\"bench\":\"history_insert\",\"entries\":%ld,\"iterations\":%ld,"
+               "\"ns_per_insert\":%.1f}\n", sizes[i], count, (with - without) * 1e9);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    shell_path = argc > 1 ? argv[1] : "./shell322";
+    int quick = argc > 2 && strcmp(argv[2], "-q") == 0;
+    if (quick) repeats = 3;
+
+    if (access(shell_path, X_OK) != 0) {
+        fprintf(stderr, "bench: %s: not executable\n", shell_path);
+        return 1;
+    }
+    if (!mkdtemp(work_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    bench_cold_start();
+    bench_commands(quick ? 200 : 2000);
+    bench_pipelines(quick ? (16L << 20) : (256L << 20));
+    bench_history(quick ? 200 : 2000);
+
+    char cleanup[600];
+    snprintf(cleanup, sizeof(cleanup), "rm -rf %s", work_dir);
+    return system(cleanup) == 0 ? 0 : 1;
+}